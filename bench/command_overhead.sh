@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+# Time how long later takes per command when it starts one directly (posix_spawnp) and when it
+# has to go through `sh -c`.
+#
+#   bench/command_overhead.sh [path/to/later] [commands-per-task] [data-dir]
+#
+# Each form runs as one task of /bin/true commands; the redirect in the shell form is what
+# sends it through sh. The figure is the gap between command starts in the task's timing file,
+# so it covers spawn, wait and bookkeeping but not the task's own startup.
+
+set -euo pipefail
+
+LATER=${1:-./build/later}
+COUNT=${2:-2000}
+DATA=${3:-$(mktemp -d "${TMPDIR:-/tmp}/later-bench.XXXXXX")}
+
+export XDG_DATA_HOME=$DATA
+unset LATER_DURABILITY
+
+printf '%-8s %8s %10s %10s\n' form cmds "total ms" "us/cmd"
+for form in direct shell; do
+    "$LATER" --purge >/dev/null 2>&1 || true
+    if [ "$form" = direct ]; then
+        cmd='/bin/true'
+    else
+        cmd='/bin/true >/dev/null'
+    fi
+    for ((i = 0; i < COUNT; ++i)); do
+        echo "$cmd"
+    done | "$LATER" +0s >/dev/null
+    status=
+    until [[ $status =~ ^(completed|failed|cancelled)$ ]]; do
+        sleep 0.1
+        status=$("$LATER" -l | awk 'NR == 2 { print $2 }')
+    done
+    if [ "$status" != completed ]; then
+        echo "the $form task $status; see: $LATER --log 1" >&2
+        exit 1
+    fi
+    timing=$(find "$DATA/later" -name timing | head -n 1)
+    awk -F'[=:]' -v form="$form" '
+        $1 == "cmd_us" { if (!n++) first = $3; last = $3 }
+        END {
+            total = (last - first) / 1000
+            printf "%-8s %8d %10d %10.0f\n", form, n, total, (last - first) / (n - 1)
+        }' "$timing"
+done
+"$LATER" --purge >/dev/null 2>&1 || true
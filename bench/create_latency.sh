@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+# Time `later +1h` task creation under each durability mode.
+#
+#   bench/create_latency.sh [path/to/later] [tasks-per-mode] [data-dir]
+#
+# The data dir should live on the disk you care about (tmpfs makes every mode look free).
+# Tasks are scheduled an hour out and purged after each mode, so nothing actually runs.
+
+set -euo pipefail
+
+LATER=${1:-./build/later}
+COUNT=${2:-50}
+DATA=${3:-$(mktemp -d "${TMPDIR:-/tmp}/later-bench.XXXXXX")}
+
+export XDG_DATA_HOME=$DATA
+unset LATER_DURABILITY
+
+now_ns() {
+    date +%s%N
+}
+
+printf '%-8s %8s %10s %10s\n' mode tasks "total ms" "ms/task"
+for mode in strict relaxed batched; do
+    "$LATER" --purge >/dev/null 2>&1 || true
+    start=$(now_ns)
+    for ((i = 0; i < COUNT; ++i)); do
+        echo true | "$LATER" --durability "$mode" +1h >/dev/null
+    done
+    end=$(now_ns)
+    total_ms=$(((end - start) / 1000000))
+    printf '%-8s %8d %10d %10s\n' "$mode" "$COUNT" "$total_ms" \
+        "$(awk -v t="$total_ms" -v n="$COUNT" 'BEGIN { printf "%.2f", t / n }')"
+done
+"$LATER" --purge >/dev/null 2>&1 || true
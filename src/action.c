@@ -1,21 +1,103 @@
 #include "action.h"
 
+#include "capture.h"
+#include "catalog.h"
 #include "daemon.h"
+#include "idle.h"
+#include "manifest.h"
+#include "queue.h"
 #include "store.h"
 #include "strvec.h"
+#include "supervisor.h"
+#include "tasklog.h"
 #include "timefmt.h"
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+/* "850us", "12.3ms", "1.250s", or a timefmt duration from a minute up. */
+static void format_span_us(long long us, char *buf, size_t n)
+{
+    const char *sign = us < 0 ? "-" : "";
+    if (us < 0)
+        us = -us;
+    if (us < 1000)
+        snprintf(buf, n, "%s%lldus", sign, us);
+    else if (us < 1000000)
+        snprintf(buf, n, "%s%.1fms", sign, (double)us / 1e3);
+    else if (us < 60000000)
+        snprintf(buf, n, "%s%.3fs", sign, (double)us / 1e6);
+    else
+    {
+        char d[32];
+        timefmt_format_duration((long)(us / 1000000), d, sizeof(d));
+        snprintf(buf, n, "%s%s", sign, d);
+    }
+}
+
+/* "812KB", "3.2MB", "1.5GB". */
+static void format_kb(long kb, char *buf, size_t n)
+{
+    if (kb < 1024)
+        snprintf(buf, n, "%ldKB", kb);
+    else if (kb < 1024L * 1024)
+        snprintf(buf, n, "%.1fMB", (double)kb / 1024);
+    else
+        snprintf(buf, n, "%.1fGB", (double)kb / (1024.0 * 1024));
+}
+
+static void format_bytes(unsigned long long bytes, char *buf, size_t n)
+{
+    if (bytes < 1024)
+        snprintf(buf, n, "%lluB", bytes);
+    else
+        format_kb((long)(bytes / 1024), buf, n);
+}
+
+/* Sum of the commands' usage; peak RSS is the largest of them. */
+static task_usage total_usage(const task_usage *u, size_t n)
+{
+    task_usage t = {0};
+    for (size_t i = 0; i < n; ++i)
+    {
+        t.wall_us += u[i].wall_us;
+        t.user_us += u[i].user_us;
+        t.sys_us += u[i].sys_us;
+        if (u[i].max_rss_kb > t.max_rss_kb)
+            t.max_rss_kb = u[i].max_rss_kb;
+        t.major_faults += u[i].major_faults;
+        t.vol_cs += u[i].vol_cs;
+        t.invol_cs += u[i].invol_cs;
+        t.in_blocks += u[i].in_blocks;
+        t.out_blocks += u[i].out_blocks;
+    }
+    return t;
+}
+
+static void print_usage_row(const char *label, const char *exit_code, const task_usage *u)
+{
+    char wall[64], user[64], sys[64], rss[32], cs[48], blocks[48];
+    format_span_us(u->wall_us, wall, sizeof(wall));
+    format_span_us(u->user_us, user, sizeof(user));
+    format_span_us(u->sys_us, sys, sizeof(sys));
+    format_kb(u->max_rss_kb, rss, sizeof(rss));
+    snprintf(cs, sizeof(cs), "%ld/%ld", u->vol_cs, u->invol_cs);
+    snprintf(blocks, sizeof(blocks), "%ld/%ld", u->in_blocks, u->out_blocks);
+    printf("  %-5s %-4s %-10s %-10s %-10s %-8s %-6ld %-13s %s\n", label, exit_code, wall, user,
+           sys, rss, u->major_faults, cs, blocks);
+}
+
 static void print_task_header(time_t exec_at, time_t now, const char *cwd)
 {
     char scheduled[64], duration[64];
@@ -25,53 +107,75 @@ static void print_task_header(time_t exec_at, time_t now, const char *cwd)
     printf("Working dir: %s\n", cwd);
 }
 
-/* Fork the daemon and wait for its readiness signal.
- * Return 0 if the daemon reported success, or 1 on failure. */
-static int spawn_task(time_t exec_at, time_t now, const char *cwd, const strvec *cmds)
+/* Fork a daemon for meta. Its readiness report arrives on *ready_fd; the child closes the
+ * nclose fds in close_fds first so other in-flight spawns don't leak into it.
+ * Return the child's pid, or -1 with the reason in errbuf. */
+static pid_t fork_daemon(const task_meta *meta, const strvec *cmds, int *ready_fd,
+                         const int *close_fds, size_t nclose, char *errbuf, size_t errsz)
 {
-    task_meta meta = {0};
-    generate_id(meta.id, sizeof(meta.id));
-    snprintf(meta.cwd, sizeof(meta.cwd), "%s", cwd);
-    meta.created_at = now;
-    meta.execute_at = exec_at;
-    meta.daemon_pid = -1;
-
     int pipefd[2];
     if (pipe(pipefd) < 0)
     {
-        fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
-        return 1;
+        snprintf(errbuf, errsz, "pipe: %s", strerror(errno));
+        return -1;
     }
 
     // drain stdio buffers before fork
     fflush(stdout);
     fflush(stderr);
 
+    long long spawned_us = mono_now_us();
     pid_t pid = fork();
     if (pid < 0)
     {
-        fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+        snprintf(errbuf, errsz, "fork: %s", strerror(errno));
         close(pipefd[0]);
         close(pipefd[1]);
-        return 1;
+        return -1;
     }
 
     // child: become the daemon
     if (pid == 0)
     {
         close(pipefd[0]);
-        daemon_run(meta, cmds->items, cmds->len, pipefd[1]);
+        for (size_t i = 0; i < nclose; ++i)
+            close(close_fds[i]);
+        daemon_run(*meta, cmds->items, cmds->len, pipefd[1], spawned_us);
         _exit(1);
     }
 
-    // parent: wait for the daemon to report readiness
     close(pipefd[1]);
+    *ready_fd = pipefd[0];
+    return pid;
+}
 
+/* Decode a daemon's readiness report. Return 0 for success, or -1 with the reason in errbuf. */
+static int parse_report(const char *report, size_t len, char *errbuf, size_t errsz)
+{
+    if (len > 0 && report[0] == 'k')
+        return 0;
+    if (len > 0 && report[0] == 'e')
+        snprintf(errbuf, errsz, "%.*s", (int)(len - 1), report + 1);
+    else
+        snprintf(errbuf, errsz, "daemon failed to start");
+    return -1;
+}
+
+/* Fork the daemon and wait for its readiness signal.
+ * Return 0 if the daemon reported success, or -1 with the reason in errbuf. */
+static int start_daemon(const task_meta *meta, const strvec *cmds, char *errbuf, size_t errsz)
+{
+    int ready_fd;
+    pid_t pid = fork_daemon(meta, cmds, &ready_fd, NULL, 0, errbuf, errsz);
+    if (pid < 0)
+        return -1;
+
+    // parent: wait for the daemon to report readiness
     char report[512];
     size_t off = 0;
     while (off < sizeof(report) - 1)
     {
-        ssize_t r = read(pipefd[0], report + off, sizeof(report) - 1 - off);
+        ssize_t r = read(ready_fd, report + off, sizeof(report) - 1 - off);
         if (r > 0)
         {
             off += (size_t)r;
@@ -81,23 +185,13 @@ static int spawn_task(time_t exec_at, time_t now, const char *cwd, const strvec
             continue;
         break;
     }
-    report[off] = '\0';
-    close(pipefd[0]);
-
-    if (off > 0 && report[0] == 'k')
-    {
-        printf("Task %s created\n", meta.id);
-        return 0;
-    }
-    if (off > 0 && report[0] == 'e')
-    {
-        fprintf(stderr, "Error: %s\n", report + 1);
-        return 1;
-    }
-    fprintf(stderr, "Error: daemon failed to start\n");
-    return 1;
+    close(ready_fd);
+    // the first child exits as soon as it has forked the daemon
+    waitpid(pid, NULL, 0);
+    return parse_report(report, off, errbuf, errsz);
 }
 
+/* resolve_id, printing why a task cannot be found. */
 static int resolve_or_error(const char *input, char *out, size_t n)
 {
     int rc = resolve_id(input, out, n);
@@ -108,6 +202,89 @@ static int resolve_or_error(const char *input, char *out, size_t n)
     return rc;
 }
 
+/* Resolve a comma-separated --after list into full ids. Return -1 after printing why not. */
+static int resolve_after(const char *list, char *out, size_t n)
+{
+    char buf[1024];
+    if (snprintf(buf, sizeof(buf), "%s", list) >= (int)sizeof(buf))
+    {
+        fprintf(stderr, "Error: --after list too long\n");
+        return -1;
+    }
+    size_t len = 0;
+    out[0] = '\0';
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ","))
+    {
+        char id[64];
+        if (resolve_or_error(tok, id, sizeof(id)) < 0)
+            return -1;
+        int w = snprintf(out + len, n - len, "%s%s", len ? "," : "", id);
+        if (w < 0 || (size_t)w >= n - len)
+        {
+            fprintf(stderr, "Error: --after list too long\n");
+            return -1;
+        }
+        len += (size_t)w;
+    }
+    if (len == 0)
+    {
+        fprintf(stderr, "Error: --after needs at least one task\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand the task to the supervisor if one runs, else to its own daemon.
+ * Return 0 on success, or 1 on failure. */
+static int spawn_task(time_t exec_at, int exec_ms, time_t now, const char *cwd,
+                      const strvec *cmds, const create_opts *opts)
+{
+    task_meta meta = {0};
+    generate_id(meta.id, sizeof(meta.id));
+    snprintf(meta.cwd, sizeof(meta.cwd), "%s", cwd);
+    meta.created_at = now;
+    meta.execute_at = exec_at;
+    meta.execute_ms = exec_ms;
+    meta.parallel = opts->parallel;
+    meta.one_shell = opts->one_shell;
+    meta.daemon_pid = -1;
+    if (opts->after && resolve_after(opts->after, meta.after, sizeof(meta.after)) < 0)
+        return 1;
+    meta.after_ok = opts->after_ok;
+    if (opts->queue)
+    {
+        snprintf(meta.queue, sizeof(meta.queue), "%s", opts->queue);
+        meta.priority = opts->priority;
+    }
+    if (opts->idle)
+        meta.idle = *opts->idle;
+    if (opts->log_max > 0)
+    {
+        meta.log_max = opts->log_max;
+        meta.log_policy = opts->log_policy;
+    }
+    meta.capture = opts->capture;
+    store_meta_set_commands(&meta, cmds->items, cmds->len);
+
+    char errbuf[512];
+    int rc = supervisor_add(&meta, cmds->items, cmds->len, errbuf, sizeof(errbuf));
+    if (rc > 0)
+        rc = start_daemon(&meta, cmds, errbuf, sizeof(errbuf));
+    if (rc < 0)
+    {
+        fprintf(stderr, "Error: %s\n", errbuf);
+        return 1;
+    }
+    // batched mode leaves syncing to the submitter; a single task is a batch of one
+    if (store_get_durability() == STORE_DURABILITY_BATCHED && store_sync() < 0)
+    {
+        fprintf(stderr, "Error: sync %s: %s\n", store_base_dir(), strerror(errno));
+        return 1;
+    }
+    printf("Task %s created\n", meta.id);
+    return 0;
+}
+
 /* Return 1 if any task's process group still has a live member. */
 static int any_group_alive(const strvec *tasks)
 {
@@ -134,7 +311,7 @@ static int kill_alive_groups(const strvec *tasks)
         if (store_task_group_alive(tasks->items[i]) &&
             store_read_meta(tasks->items[i], &meta) == 0 && meta.daemon_pid > 1)
         {
-            kill(-meta.daemon_pid, SIGKILL);
+            store_signal_task(&meta, SIGKILL);
             ++n;
         }
     }
@@ -161,7 +338,7 @@ static int wait_then_kill(const strvec *tasks)
     return forced;
 }
 
-int action_create(const char *time_str)
+int action_create(const char *time_str, const create_opts *opts)
 {
     if (store_ensure_base() < 0)
     {
@@ -171,7 +348,8 @@ int action_create(const char *time_str)
 
     char errbuf[256];
     time_t exec_at;
-    if (timefmt_parse_time(time_str, &exec_at, errbuf, sizeof(errbuf)) < 0)
+    int exec_ms;
+    if (timefmt_parse_time(time_str, &exec_at, &exec_ms, errbuf, sizeof(errbuf)) < 0)
     {
         fprintf(stderr, "Error: %s\n", errbuf);
         return 1;
@@ -202,106 +380,550 @@ int action_create(const char *time_str)
         return 1;
     }
 
-    int rc = spawn_task(exec_at, now, cwd, cmds);
+    int rc = spawn_task(exec_at, exec_ms, now, cwd, cmds, opts);
     strvec_free(&cmds);
     return rc;
 }
 
-int action_list(int verbose)
+// daemons started concurrently by --submit; each one costs two forks and a pipe
+#define SUBMIT_PARALLEL 64
+
+typedef struct
+{
+    task_meta meta;
+    int ok;
+    char error[512];
+} submit_result;
+
+typedef struct
+{
+    size_t idx; // into the manifest
+    pid_t pid;
+    char report[512];
+    size_t off;
+} submit_slot;
+
+/* Read what the slot's daemon has sent. Return 1 once the report is complete (EOF). */
+static int drain_slot(int fd, submit_slot *slot)
+{
+    while (1)
+    {
+        char tmp[512];
+        char *dst = slot->off < sizeof(slot->report) - 1 ? slot->report + slot->off : tmp;
+        size_t room = slot->off < sizeof(slot->report) - 1 ? sizeof(slot->report) - 1 - slot->off
+                                                             : sizeof(tmp);
+        ssize_t r = read(fd, dst, room);
+        if (r > 0)
+        {
+            if (dst != tmp)
+                slot->off += (size_t)r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN)
+            return 0;
+        return 1;
+    }
+}
+
+int action_submit(const char *path)
 {
     if (store_ensure_base() < 0)
+    {
+        fprintf(stderr, "Error: cannot create data dir at %s\n", store_base_dir());
         return 1;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        fprintf(stderr, "Error: getcwd: %s\n", strerror(errno));
+        return 1;
+    }
 
-    strvec *list = NULL;
-    if (store_list(&list) < 0)
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in)
     {
-        fprintf(stderr, "Error: cannot list tasks\n");
-        strvec_free(&list);
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
         return 1;
     }
-    if (list->len == 0)
+    manifest *m = NULL;
+    char errbuf[512];
+    int prc = manifest_parse(in, cwd, &m, errbuf, sizeof(errbuf));
+    if (in != stdin)
+        fclose(in);
+    if (prc < 0)
     {
-        printf("No tasks found\n");
-        strvec_free(&list);
-        return 0;
+        fprintf(stderr, "Error: %s: %s\n", path, errbuf);
+        return 1;
     }
 
+    submit_result *res = calloc(m->len ? m->len : 1, sizeof(*res));
+    if (!res)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        manifest_free(&m);
+        return 1;
+    }
+
+    // everything the daemons need is decided up front, in manifest order
+    time_t now = time(NULL);
+    for (size_t i = 0; i < m->len; ++i)
+    {
+        manifest_record *r = &m->items[i];
+        task_meta *meta = &res[i].meta;
+        if (timefmt_parse_time(r->time_spec, &meta->execute_at, &meta->execute_ms, res[i].error,
+                               sizeof(res[i].error)) < 0)
+            continue;
+        generate_id(meta->id, sizeof(meta->id));
+        snprintf(meta->cwd, sizeof(meta->cwd), "%s", r->cwd);
+        meta->created_at = now;
+        meta->daemon_pid = -1;
+        store_meta_set_commands(meta, r->cmds->items, r->cmds->len);
+    }
+
+    // keep up to SUBMIT_PARALLEL daemons starting at once and collect their reports as they
+    // arrive; fds[] doubles as the list a new child must close
+    struct pollfd pfds[SUBMIT_PARALLEL];
+    int fds[SUBMIT_PARALLEL];
+    submit_slot slots[SUBMIT_PARALLEL];
+    size_t active = 0, next = 0;
+    int supervised = 1;
+    while (next < m->len || active > 0)
+    {
+        while (active < SUBMIT_PARALLEL && next < m->len)
+        {
+            size_t i = next++;
+            if (res[i].error[0])
+                continue;
+            // a supervisor takes tasks without any fork; fall back once it is gone
+            if (supervised)
+            {
+                int rc = supervisor_add(&res[i].meta, m->items[i].cmds->items,
+                                        m->items[i].cmds->len, res[i].error, sizeof(res[i].error));
+                if (rc <= 0)
+                {
+                    res[i].ok = rc == 0;
+                    continue;
+                }
+                supervised = 0;
+            }
+            int fd;
+            pid_t pid = fork_daemon(&res[i].meta, m->items[i].cmds, &fd, fds, active,
+                                    res[i].error, sizeof(res[i].error));
+            if (pid < 0)
+                continue;
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            fds[active] = fd;
+            slots[active] = (submit_slot){.idx = i, .pid = pid};
+            ++active;
+        }
+        if (active == 0)
+            continue;
+
+        for (size_t k = 0; k < active; ++k)
+            pfds[k] = (struct pollfd){.fd = fds[k], .events = POLLIN};
+        if (poll(pfds, active, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+            break;
+        }
+
+        // walk backwards so finished slots can be swapped out with the last one
+        for (size_t k = active; k-- > 0;)
+        {
+            if (!pfds[k].revents || !drain_slot(fds[k], &slots[k]))
+                continue;
+            submit_slot *slot = &slots[k];
+            close(fds[k]);
+            waitpid(slot->pid, NULL, 0);
+            submit_result *r = &res[slot->idx];
+            r->ok = parse_report(slot->report, slot->off, r->error, sizeof(r->error)) == 0;
+            --active;
+            fds[k] = fds[active];
+            slots[k] = slots[active];
+        }
+    }
+
+    size_t created = 0;
+    for (size_t i = 0; i < m->len; ++i)
+        created += res[i].ok;
+    int sync_failed = created > 0 && store_get_durability() == STORE_DURABILITY_BATCHED &&
+                      store_sync() < 0;
+
+    for (size_t i = 0; i < m->len; ++i)
+    {
+        if (res[i].ok)
+            printf("Task %s created (line %zu)\n", res[i].meta.id, m->items[i].line);
+        else
+            fprintf(stderr, "Error: line %zu: %s\n", m->items[i].line,
+                    res[i].error[0] ? res[i].error : "not started");
+    }
+    if (sync_failed)
+        fprintf(stderr, "Error: sync %s: %s\n", store_base_dir(), strerror(errno));
+    printf("Submitted %zu of %zu task(s)\n", created, m->len);
+
+    int rc = (created == m->len && !sync_failed) ? 0 : 1;
+    free(res);
+    manifest_free(&m);
+    return rc;
+}
+
+static void print_list_header(int verbose)
+{
     if (verbose)
-        printf("%-3s %-10s %-20s %-20s %-5s %-25s %s\n", "#", "Status", "Created at", "Execute at",
-               "Cmds", "ID", "Preview");
+        printf("%-3s %-10s %-20s %-20s %-5s %-9s %-8s %-25s %s\n", "#", "Status", "Created at",
+               "Execute at", "Cmds", "CPU", "Max RSS", "ID", "Preview");
     else
         printf("%-3s %-10s %-20s %-20s %s\n", "#", "Status", "Created at", "Execute at", "Cmds");
+}
 
-    for (size_t i = 0; i < list->len; ++i)
+/* meta may be NULL when it was not needed for filtering; verbose rows read it on demand. */
+static void print_list_row(size_t ordinal, const catalog_entry *e, task_status st,
+                           const task_meta *meta, int verbose)
+{
+    const char *id = e->id;
+    char created[64], scheduled[64];
+    if (e->have_meta)
     {
-        const char *id = list->items[i];
-        task_status st = store_resolve_status(id);
+        timefmt_format_time(e->created_at, created, sizeof(created));
+        timefmt_format_time(e->execute_at, scheduled, sizeof(scheduled));
+    }
+    else
+    {
+        // orphan tasks have no meta; show them without meta info rather than hiding them
+        snprintf(created, sizeof(created), "-");
+        snprintf(scheduled, sizeof(scheduled), "-");
+    }
+    size_t ncmds = e->ncmds;
 
-        task_meta meta;
-        int have_meta = (store_read_meta(id, &meta) == 0);
-        char created[64], scheduled[64];
-        if (have_meta)
+    if (verbose)
+    {
+        // meta carries a preview; only tasks from older versions need the commands file
+        task_meta own;
+        strvec *cmds = NULL;
+        const char *first = "";
+        if (!meta && store_read_meta(id, &own) == 0)
+            meta = &own;
+        if (meta && meta->cmd_digest[0])
+            first = meta->cmd_preview;
+        else if (store_read_commands(id, &cmds) == 0 && cmds->len > 0)
+            first = cmds->items[0];
+        char preview[24] = "";
+        if (ncmds > 0)
+        {
+            snprintf(preview, sizeof(preview), "%.20s", first);
+            if (strlen(first) > 20)
+            {
+                preview[17] = '.';
+                preview[18] = '.';
+                preview[19] = '.';
+                preview[20] = '\0';
+            }
+        }
+        // resource columns for tasks that have run at least one command
+        char cpu[64] = "-", rss[32] = "-";
+        task_usage *usage = NULL;
+        size_t nusage = 0;
+        if (st != STATUS_PENDING && store_read_usage(id, &usage, &nusage) == 0 && nusage > 0)
         {
-            timefmt_format_time(meta.created_at, created, sizeof(created));
-            timefmt_format_time(meta.execute_at, scheduled, sizeof(scheduled));
+            task_usage total = total_usage(usage, nusage);
+            format_span_us(total.user_us + total.sys_us, cpu, sizeof(cpu));
+            format_kb(total.max_rss_kb, rss, sizeof(rss));
         }
+        free(usage);
+        printf("%-3zu %s%-10s%s %-20s %-20s %-5zu %-9s %-8s %-25s %s\n", ordinal,
+               store_status_color_prefix(st), store_status_name(st), store_status_color_suffix(),
+               created, scheduled, ncmds, cpu, rss, id, preview);
+        strvec_free(&cmds);
+    }
+    else
+    {
+        printf("%-3zu %s%-10s%s %-20s %-20s %zu\n", ordinal, store_status_color_prefix(st),
+               store_status_name(st), store_status_color_suffix(), created, scheduled, ncmds);
+    }
+}
+
+/* cwd equals dir or lies below it. */
+static int cwd_matches(const char *cwd, const char *dir)
+{
+    size_t n = strlen(dir);
+    while (n > 1 && dir[n - 1] == '/')
+        --n;
+    if (strncmp(cwd, dir, n) != 0)
+        return 0;
+    return cwd[n] == '\0' || cwd[n] == '/' || (n == 1 && dir[0] == '/');
+}
+
+/* Apply the list filters to e. On a match return 1 with its status in *st; *meta is filled
+ * (and *have_meta set) only if filtering had to read it. */
+static int entry_matches(catalog_entry *e, const list_opts *opts, const char *cwd_filter,
+                         const supervisor_task *held, size_t nheld, task_status *st,
+                         task_meta *meta, int *have_meta)
+{
+    // cheapest filters first: times are in the catalog, status may need the task dir,
+    // and only cwd needs meta
+    if (opts->since || opts->until)
+    {
+        time_t t;
+        if (opts->by_exec)
+            t = e->have_meta ? e->execute_at : 0;
         else
+            t = e->have_meta ? e->created_at : task_id_time(e->id);
+        if (t == 0 || (opts->since && t < opts->since) || (opts->until && t > opts->until))
+            return 0;
+    }
+
+    supervisor_task key;
+    snprintf(key.id, sizeof(key.id), "%s", e->id);
+    const supervisor_task *h =
+        nheld ? bsearch(&key, held, nheld, sizeof(*held), supervisor_task_cmp) : NULL;
+    *st = h ? (h->paused ? STATUS_PAUSED : STATUS_PENDING) : catalog_entry_status(e);
+    if (opts->status_mask && !(opts->status_mask & (1u << *st)))
+        return 0;
+
+    *have_meta = 0;
+    if (cwd_filter[0])
+    {
+        *have_meta = (store_read_meta(e->id, meta) == 0);
+        if (!*have_meta || !cwd_matches(meta->cwd, cwd_filter))
+            return 0;
+    }
+    return 1;
+}
+
+int action_list(const list_opts *opts)
+{
+    if (store_ensure_base() < 0)
+        return 1;
+
+    char cwd_filter[PATH_MAX] = "";
+    if (opts->cwd && !realpath(opts->cwd, cwd_filter))
+    {
+        fprintf(stderr, "Error: --cwd %s: %s\n", opts->cwd, strerror(errno));
+        return 1;
+    }
+
+    catalog *cat = NULL;
+    if (catalog_load(&cat) < 0)
+    {
+        fprintf(stderr, "Error: cannot list tasks\n");
+        catalog_free(&cat);
+        return 1;
+    }
+    if (cat->len == 0)
+    {
+        printf("No tasks found\n");
+        catalog_free(&cat);
+        return 0;
+    }
+
+    // tasks a supervisor is holding are pending or paused by definition; take that from its
+    // memory instead of probing their dirs
+    supervisor_task *held = NULL;
+    size_t nheld = 0;
+    supervisor_list(&held, &nheld);
+
+    // walk the sorted catalog from either end and stop as soon as the page is full, so the
+    // task dirs touched (status, meta) stay proportional to offset + limit
+    size_t shown = 0, skipped = 0;
+    for (size_t k = 0; k < cat->len; ++k)
+    {
+        if (opts->limit && shown == opts->limit)
+            break;
+        size_t i = opts->reverse ? cat->len - 1 - k : k;
+        catalog_entry *e = &cat->items[i];
+
+        task_status st;
+        task_meta meta;
+        int have_meta = 0;
+        if (!entry_matches(e, opts, cwd_filter, held, nheld, &st, &meta, &have_meta))
+            continue;
+
+        if (skipped < opts->offset)
         {
-            // orphan tasks have no meta; show them without meta info rather than hiding them
-            snprintf(created, sizeof(created), "-");
-            snprintf(scheduled, sizeof(scheduled), "-");
+            ++skipped;
+            continue;
         }
+        if (shown++ == 0)
+            print_list_header(opts->verbose);
+        // numbering stays the position in the full list, so it works with --show, --cancel...
+        print_list_row(i + 1, e, st, have_meta ? &meta : NULL, opts->verbose);
+        fflush(stdout);
+    }
+    if (shown == 0)
+        printf("No matching tasks\n");
+    free(held);
+    catalog_free(&cat);
+    return 0;
+}
 
-        strvec *cmds = NULL;
-        store_read_commands(id, &cmds);
-        size_t ncmds = cmds ? cmds->len : 0;
-        const char *first = (cmds && cmds->len > 0) ? cmds->items[0] : "";
+/* When the task was free to start: its scheduled time, or later if it waited for --after or
+ * for a queue slot. */
+static long long due_us(const task_meta *meta, const task_timing *t)
+{
+    long long scheduled = ((long long)meta->execute_at * 1000 + meta->execute_ms) * 1000;
+    return t->released_us > scheduled ? t->released_us : scheduled;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted v. */
+static long long percentile(const long long *v, size_t n, unsigned p)
+{
+    size_t rank = (n * p + 99) / 100;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_percentiles(const char *label, const long long *us, size_t n)
+{
+    char p50[64], p90[64], p99[64], max[64];
+    format_span_us(percentile(us, n, 50), p50, sizeof(p50));
+    format_span_us(percentile(us, n, 90), p90, sizeof(p90));
+    format_span_us(percentile(us, n, 99), p99, sizeof(p99));
+    format_span_us(us[n - 1], max, sizeof(max));
+    printf("%-12s p50 %s  p90 %s  p99 %s  max %s  (%zu task(s))\n", label, p50, p90, p99, max,
+           n);
+}
+
+int action_lag(const list_opts *opts)
+{
+    if (store_ensure_base() < 0)
+        return 1;
+
+    char cwd_filter[PATH_MAX] = "";
+    if (opts->cwd && !realpath(opts->cwd, cwd_filter))
+    {
+        fprintf(stderr, "Error: --cwd %s: %s\n", opts->cwd, strerror(errno));
+        return 1;
+    }
+    catalog *cat = NULL;
+    if (catalog_load(&cat) < 0)
+    {
+        fprintf(stderr, "Error: cannot list tasks\n");
+        catalog_free(&cat);
+        return 1;
+    }
+    supervisor_task *held = NULL;
+    size_t nheld = 0;
+    supervisor_list(&held, &nheld);
+
+    long long *lag = malloc((cat->len ? cat->len : 1) * sizeof(*lag));
+    long long *ready = malloc((cat->len ? cat->len : 1) * sizeof(*ready));
+    if (!lag || !ready)
+    {
+        fprintf(stderr, "Error: out of memory\n");
+        free(lag);
+        free(ready);
+        free(held);
+        catalog_free(&cat);
+        return 1;
+    }
+    size_t nlag = 0, nready = 0;
+    for (size_t i = 0; i < cat->len; ++i)
+    {
+        catalog_entry *e = &cat->items[i];
+        task_status st;
+        task_meta meta;
+        int have_meta = 0;
+        if (!entry_matches(e, opts, cwd_filter, held, nheld, &st, &meta, &have_meta))
+            continue;
+        // tasks that are still waiting have nothing to report yet
+        if (st == STATUS_PENDING || st == STATUS_QUEUED)
+            continue;
 
-        if (verbose)
+        task_timing t;
+        if (store_read_timing(e->id, &t) < 0)
+            continue;
+        if (t.ready_us >= 0)
+            ready[nready++] = t.ready_us;
+        // the catalog has only whole seconds; lag needs the scheduled millisecond from meta
+        if (t.start_us > 0 && (have_meta || store_read_meta(e->id, &meta) == 0))
+            lag[nlag++] = t.start_us - due_us(&meta, &t);
+        store_timing_free(&t);
+    }
+
+    if (nlag == 0 && nready == 0)
+    {
+        printf("No timing recorded for the matching tasks\n");
+    }
+    else
+    {
+        static const struct
+        {
+            long long below_us;
+            const char *label;
+        } buckets[] = {{1000, "< 1ms"},       {10000, "< 10ms"},   {100000, "< 100ms"},
+                       {1000000, "< 1s"},     {10000000, "< 10s"}, {60000000, "< 1m"},
+                       {LLONG_MAX, ">= 1m"}};
+        enum
         {
-            char preview[24] = "";
-            if (ncmds > 0)
+            NBUCKETS = sizeof(buckets) / sizeof(buckets[0]),
+            BAR_WIDTH = 40
+        };
+        size_t counts[NBUCKETS] = {0};
+        size_t most = 0;
+        for (size_t i = 0; i < nlag; ++i)
+        {
+            size_t b = 0;
+            while (lag[i] >= buckets[b].below_us)
+                ++b;
+            if (++counts[b] > most)
+                most = counts[b];
+        }
+        if (nlag > 0)
+        {
+            printf("Start lag (actual start - scheduled time):\n");
+            for (size_t b = 0; b < NBUCKETS; ++b)
             {
-                snprintf(preview, sizeof(preview), "%.20s", first);
-                if (strlen(first) > 20)
-                {
-                    preview[17] = '.';
-                    preview[18] = '.';
-                    preview[19] = '.';
-                    preview[20] = '\0';
-                }
+                size_t bar = most ? (counts[b] * BAR_WIDTH + most - 1) / most : 0;
+                printf("  %-8s %7zu%s%.*s\n", buckets[b].label, counts[b], bar ? " " : "",
+                       (int)bar, "########################################");
             }
-            printf("%-3zu %s%-10s%s %-20s %-20s %-5zu %-25s %s\n", i + 1,
-                   store_status_color_prefix(st), store_status_name(st),
-                   store_status_color_suffix(), created, scheduled, ncmds, id, preview);
+            qsort(lag, nlag, sizeof(*lag), cmp_ll);
+            print_percentiles("Start lag:", lag, nlag);
         }
-        else
+        if (nready > 0)
         {
-            printf("%-3zu %s%-10s%s %-20s %-20s %zu\n", i + 1, store_status_color_prefix(st),
-                   store_status_name(st), store_status_color_suffix(), created, scheduled, ncmds);
+            qsort(ready, nready, sizeof(*ready), cmp_ll);
+            print_percentiles("Ready after:", ready, nready);
         }
-        strvec_free(&cmds);
     }
-    strvec_free(&list);
+    free(lag);
+    free(ready);
+    free(held);
+    catalog_free(&cat);
     return 0;
 }
 
-int action_show(const char *id_input)
+int action_show(const char *id_input, int verbose)
 {
     char id[64];
     if (resolve_or_error(id_input, id, sizeof(id)) < 0)
         return 1;
 
-    task_meta meta;
-    if (store_read_meta(id, &meta) < 0)
+    task_snapshot snap;
+    if (store_snapshot(id, &snap) < 0 || !(snap.files & TASK_HAS_META))
     {
         fprintf(stderr, "Error: cannot read task %s\n", id);
         return 1;
     }
-    task_status st = store_resolve_status(id);
+    const task_meta meta = snap.meta;
+    task_status st = snap.status;
 
     char scheduled[64], duration[64], created[64];
     timefmt_format_time(meta.execute_at, scheduled, sizeof(scheduled));
+    if (meta.execute_ms > 0)
+    {
+        size_t len = strlen(scheduled);
+        snprintf(scheduled + len, sizeof(scheduled) - len, ".%03d", meta.execute_ms);
+    }
     timefmt_format_duration((long)(meta.execute_at - meta.created_at), duration, sizeof(duration));
     timefmt_format_time(meta.created_at, created, sizeof(created));
 
@@ -310,40 +932,160 @@ int action_show(const char *id_input)
            store_status_color_suffix());
     printf("Created at:  %s\n", created);
     printf("Execute at:  %s (%s)\n", scheduled, duration);
+
+    task_timing timing;
+    if (store_read_timing(id, &timing) < 0)
+        memset(&timing, 0, sizeof(timing));
+    char span[64];
+    if (timing.ready_us > 0)
+    {
+        format_span_us(timing.ready_us, span, sizeof(span));
+        printf("Ready after: %s\n", span);
+    }
+    if (timing.start_us > 0)
+    {
+        char started[64];
+        timefmt_format_time((time_t)(timing.start_us / 1000000), started, sizeof(started));
+        format_span_us(timing.start_us - due_us(&meta, &timing), span, sizeof(span));
+        printf("Started at:  %s.%03d (lag %s)\n", started, (int)(timing.start_us / 1000 % 1000),
+               span);
+    }
     printf("Working dir: %s\n", meta.cwd);
+    if (meta.parallel > 1)
+        printf("Parallel:    up to %d commands at once\n", meta.parallel);
+    if (meta.one_shell)
+        printf("Shell:       one for all commands\n");
+    if (meta.capture)
+        printf("Output:      captured per command and stream (--log --timestamps)\n");
+    if (meta.after[0])
+        printf("After:       %s (%s)\n", meta.after,
+               meta.after_ok ? "must all complete" : "once all have finished");
+    if (meta.idle.max_s > 0)
+    {
+        char spec[256];
+        idle_format(&meta.idle, spec, sizeof(spec));
+        printf("When idle:   %s\n", spec);
+    }
+    if (meta.queue[0])
+    {
+        int running = 0, waiting = 0;
+        queue_stat(meta.queue, &running, &waiting);
+        printf("Queue:       %s (priority %d; %d of %d slots in use, %d waiting)\n", meta.queue,
+               meta.priority, running, queue_get_limit(meta.queue), waiting);
+    }
+    if (meta.log_max > 0)
+    {
+        char max[32];
+        format_bytes(meta.log_max, max, sizeof(max));
+        printf("Log:         at most %s (%s)\n", max, store_log_policy_name(meta.log_policy));
+    }
 
     strvec *cmds = NULL;
     if (store_read_commands(id, &cmds) == 0)
     {
         printf("Commands:\n");
         for (size_t i = 0; i < cmds->len; ++i)
-            printf("  %zu. %s\n", i + 1, cmds->items[i]);
+        {
+            if (i < timing.ncmd_us && timing.cmd_us[i] > 0 && timing.start_us > 0)
+            {
+                format_span_us(timing.cmd_us[i] - timing.start_us, span, sizeof(span));
+                printf("  %zu. %s  (at +%s)\n", i + 1, cmds->items[i], span);
+            }
+            else
+            {
+                printf("  %zu. %s\n", i + 1, cmds->items[i]);
+            }
+        }
+
+        char digest[sizeof(meta.cmd_digest)];
+        store_commands_digest(cmds->items, cmds->len, digest, sizeof(digest));
+        if (meta.cmd_digest[0] && strcmp(digest, meta.cmd_digest) != 0)
+            fprintf(stderr, "Warning: commands file does not match the digest recorded in meta\n");
     }
     strvec_free(&cmds);
+    store_timing_free(&timing);
+
+    task_usage *usage = NULL;
+    size_t nusage = 0;
+    if (store_read_usage(id, &usage, &nusage) == 0 && nusage > 0)
+    {
+        printf("Resources:\n");
+        printf("  %-5s %-4s %-10s %-10s %-10s %-8s %-6s %-13s %s\n", "#", "Exit", "Wall", "User",
+               "Sys", "Max RSS", "MajFlt", "CtxSw vol/inv", "Blocks in/out");
+        for (size_t i = 0; i < nusage; ++i)
+        {
+            char label[24], rc[16];
+            snprintf(label, sizeof(label), "%zu", usage[i].cmd + 1);
+            snprintf(rc, sizeof(rc), "%d", usage[i].exit_code);
+            print_usage_row(label, rc, &usage[i]);
+        }
+        if (nusage > 1)
+        {
+            task_usage total = total_usage(usage, nusage);
+            print_usage_row("total", "", &total);
+        }
+    }
+    free(usage);
+
+    if (st == STATUS_FAILED && snap.error[0])
+        printf("Error: %s\n", snap.error);
 
-    if (st == STATUS_FAILED)
+    if (verbose)
     {
-        char err[512];
-        if (store_read_marker(id, "error", err, sizeof(err)) > 0)
-            printf("Error: %s\n", err);
+        printf("Meta:\n");
+        store_format_meta(&meta, stdout);
     }
     return 0;
 }
 
+/* A supervised task the supervisor no longer holds is being handed to its runner, which
+ * records its pid first thing. Wait briefly for that; return -1 if it never shows up. */
+static int wait_for_runner(const char *id, task_meta *meta)
+{
+    for (int waited = 0; waited < 2000; waited += 20)
+    {
+        if (store_read_meta(id, meta) == 0 && meta->daemon_pid > 0)
+            return 0;
+        sleep_ms(20);
+    }
+    return -1;
+}
+
+static void note_cancelled(const char *id, int captured)
+{
+    char path[PATH_MAX];
+    if (store_path_in_task(id, "log", path, sizeof(path)) == 0)
+    {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        const char *note = "Task cancelled by user.\n";
+        int rc = -1;
+        if (fd >= 0)
+        {
+            // a captured log takes it as one of later's own records
+            rc = captured ? capture_write_note(fd, note)
+                          : (write(fd, note, strlen(note)) == (ssize_t)strlen(note) ? 0 : -1);
+            close(fd);
+        }
+        if (rc < 0)
+            fprintf(stderr, "Warning: cannot append cancel note to log: %s", strerror(errno));
+    }
+}
+
 int action_cancel(const char *id_input)
 {
     char id[64];
     if (resolve_or_error(id_input, id, sizeof(id)) < 0)
         return 1;
 
-    task_meta meta;
-    if (store_read_meta(id, &meta) < 0)
+    task_snapshot snap;
+    if (store_snapshot(id, &snap) < 0 || !(snap.files & TASK_HAS_META))
     {
         fprintf(stderr, "Error: cannot read task %s\n", id);
         return 1;
     }
+    task_meta meta = snap.meta;
 
-    task_status st = store_resolve_status(id);
+    task_status st = snap.status;
     if (store_status_is_final(st))
     {
         printf("Task %s is already %s\n", id, store_status_name(st));
@@ -357,6 +1099,17 @@ int action_cancel(const char *id_input)
         return 1;
     }
 
+    // still waiting in the supervisor: dropping it there releases its lock, and the marker
+    // alone makes it cancelled
+    if (meta.supervised && meta.daemon_pid <= 0 &&
+        (supervisor_cancel(id) == 0 || wait_for_runner(id, &meta) < 0))
+    {
+        catalog_refresh(id);
+        note_cancelled(id, meta.capture);
+        printf("Task %s cancelled\n", id);
+        return 0;
+    }
+
     if (meta.daemon_pid <= 0)
     {
         store_remove_marker(id, "cancel");
@@ -365,12 +1118,14 @@ int action_cancel(const char *id_input)
     }
 
     // SIGCONT first in case the daemon is paused (SIGSTOP)
-    kill(-meta.daemon_pid, SIGCONT);
+    store_signal_task(&meta, SIGCONT);
 
-    if (kill(-meta.daemon_pid, SIGTERM) < 0)
+    if (store_signal_task(&meta, SIGTERM) < 0)
     {
         int saved = errno;
-        store_remove_marker(id, "cancel");
+        // a supervised runner exits on its own when it finds the marker; keep it
+        if (!meta.supervised)
+            store_remove_marker(id, "cancel");
         if (saved == ESRCH)
         {
             printf("Daemon %d already exited; nothing to cancel\n", meta.daemon_pid);
@@ -388,21 +1143,16 @@ int action_cancel(const char *id_input)
         stuck = any_group_alive(one);
     }
     strvec_free(&one);
-
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "log", path, sizeof(path)) == 0)
-    {
-        FILE *f = fopen(path, "a");
-        if (f)
-        {
-            fprintf(f, "Task cancelled by user.\n");
-            fclose(f);
-        }
-        else
-        {
-            fprintf(stderr, "Warning: cannot append cancel note to log: %s", strerror(errno));
-        }
-    }
+    // the daemon died before it could drop its -j commands' groups; they are gone now too
+    if (!stuck)
+        store_write_groups(id, NULL, 0);
+    catalog_refresh(id);
+
+    note_cancelled(id, meta.capture);
+    // a --log-max writer or capture process may still be storing what it has; leave that
+    // log for --compact
+    if (!stuck && !meta.log_max && !meta.capture)
+        tasklog_compress(id, NULL, NULL);
     printf("Task %s cancelled\n", id);
     if (stuck)
         fprintf(stderr,
@@ -442,6 +1192,16 @@ int action_pause(const char *id_input)
         fprintf(stderr, "Error: cannot record pause intent for %s: %s\n", id, strerror(errno));
         return 1;
     }
+
+    // the supervisor parks a paused task when it comes due instead of starting it
+    if (meta.supervised && meta.daemon_pid <= 0 &&
+        (supervisor_pause(id) == 0 || wait_for_runner(id, &meta) < 0))
+    {
+        catalog_set_status(id, STATUS_PAUSED);
+        printf("Task %s paused\n", id);
+        return 0;
+    }
+
     if (meta.daemon_pid <= 0)
     {
         store_remove_marker(id, "pause");
@@ -449,7 +1209,7 @@ int action_pause(const char *id_input)
         return 1;
     }
 
-    if (kill(-meta.daemon_pid, SIGSTOP) < 0)
+    if (store_signal_task(&meta, SIGSTOP) < 0)
     {
         int saved = errno;
         store_remove_marker(id, "pause");
@@ -461,6 +1221,7 @@ int action_pause(const char *id_input)
         fprintf(stderr, "Error: cannot signal daemon %d: %s\n", meta.daemon_pid, strerror(errno));
         return 1;
     }
+    catalog_set_status(id, STATUS_PAUSED);
     printf("Task %s paused\n", id);
     return 0;
 }
@@ -483,13 +1244,25 @@ int action_resume(const char *id_input)
         fprintf(stderr, "Error: task %s is not paused\n", id);
         return 1;
     }
+
+    if (meta.supervised && meta.daemon_pid <= 0)
+    {
+        // the supervisor checks the marker before it starts a task, so drop it first
+        store_remove_marker(id, "pause");
+        if (supervisor_resume(id) == 0 || wait_for_runner(id, &meta) < 0)
+        {
+            catalog_refresh(id);
+            printf("Task %s resumed\n", id);
+            return 0;
+        }
+    }
     if (meta.daemon_pid <= 0)
     {
         fprintf(stderr, "Error: task %s has no daemon pid recorded\n", id);
         return 1;
     }
 
-    if (kill(-meta.daemon_pid, SIGCONT) < 0)
+    if (store_signal_task(&meta, SIGCONT) < 0)
     {
         if (errno == ESRCH)
         {
@@ -500,6 +1273,7 @@ int action_resume(const char *id_input)
         return 1;
     }
     store_remove_marker(id, "pause");
+    catalog_refresh(id);
     printf("Task %s resumed\n", id);
     return 0;
 }
@@ -522,65 +1296,309 @@ int action_delete(const char *id_input)
         fprintf(stderr, "Error: failed to delete %s: %s\n", id, strerror(errno));
         return 1;
     }
+    catalog_remove(id);
     printf("Task %s deleted\n", id);
     return 0;
 }
 
-int action_log(const char *id_input, int verbose)
+enum
+{
+    LOG_TAIL_LINES = 100
+};
+
+/* Where --log sends the content of a log it has to read from the start (compressed, captured or
+ * --log-max): straight out with --verbose, otherwise line by line into a ring of the last
+ * ones. */
+typedef struct
+{
+    int verbose;
+    char **ring; // grows up to size as lines arrive; -n can be far more than the log has
+    size_t size, cap, head, count;
+    char *partial; // start of a line whose end has not been read yet
+    size_t partial_len;
+    int at_line_start;
+} log_out;
+
+static void log_push_line(log_out *o, char *line)
+{
+    if (o->count < o->size)
+    {
+        if (o->count == o->cap)
+        {
+            size_t cap = o->cap ? o->cap * 2 : 64;
+            if (cap > o->size)
+                cap = o->size;
+            char **ring = realloc(o->ring, cap * sizeof(*ring));
+            if (!ring)
+            {
+                free(line);
+                return;
+            }
+            o->ring = ring;
+            o->cap = cap;
+        }
+        o->ring[o->count++] = line;
+        o->head = o->count % o->size;
+        return;
+    }
+    free(o->ring[o->head]);
+    o->ring[o->head] = line;
+    o->head = (o->head + 1) % o->size;
+}
+
+/* Add n bytes of s to the line being collected; on a newline, finish it. */
+static void log_collect(log_out *o, const char *s, size_t n, int finish)
+{
+    char *line = realloc(o->partial, o->partial_len + n + 1);
+    if (!line)
+        return;
+    memcpy(line + o->partial_len, s, n);
+    o->partial_len += n;
+    line[o->partial_len] = '\0';
+    o->partial = line;
+    if (finish)
+    {
+        log_push_line(o, line);
+        o->partial = NULL;
+        o->partial_len = 0;
+    }
+}
+
+static void log_emit(log_out *o, const char *s, size_t n)
+{
+    if (n == 0)
+        return;
+    o->at_line_start = s[n - 1] == '\n';
+    if (o->verbose)
+    {
+        fwrite(s, 1, n, stdout);
+        return;
+    }
+    const char *end = s + n;
+    while (s < end)
+    {
+        const char *nl = memchr(s, '\n', (size_t)(end - s));
+        const char *stop = nl ? nl + 1 : end;
+        log_collect(o, s, (size_t)(stop - s), nl != NULL);
+        s = stop;
+    }
+}
+
+/* Stand-in for what --log-max left out, as a line of its own. */
+static void log_emit_note(log_out *o, const char *note)
+{
+    if (!o->at_line_start)
+        log_emit(o, "\n", 1);
+    log_emit(o, note, strlen(note));
+}
+
+/* Emit the content of r, and *note (then cleared) at offset at of the whole log once *pos
+ * reaches it. */
+static void log_stream(tasklog_reader *r, log_out *o, unsigned long long *pos,
+                       unsigned long long at, const char **note)
+{
+    static char buf[65536];
+    ssize_t got;
+    while ((got = tasklog_read(r, buf, sizeof(buf))) > 0)
+    {
+        size_t n = (size_t)got, off = 0;
+        if (*note && at < *pos + n)
+        {
+            // output is cut by size, which is usually mid-line
+            off = at > *pos ? (size_t)(at - *pos) : 0;
+            log_emit(o, buf, off);
+            log_emit_note(o, *note);
+            *note = NULL;
+        }
+        log_emit(o, buf + off, n - off);
+        *pos += n;
+    }
+}
+
+/* --log of a --capture task: the records rendered as plain text, with --stderr-only and
+ * --timestamps applied. */
+typedef struct
+{
+    log_out *out;
+    const log_opts *opts;
+    uint32_t cmd; // whose record came last
+    int stream;
+} capture_render;
+
+static void render_record(const capture_frame *f, const char *data, void *ctx)
+{
+    capture_render *c = ctx;
+    log_out *o = c->out;
+    if (c->opts->stderr_only && f->stream != CAPTURE_STDERR)
+        return;
+    if (!c->opts->timestamps)
+    {
+        log_emit(o, data, f->len);
+        return;
+    }
+
+    // a line cut short by a full buffer or another stream ends before the next one's prefix
+    if (!o->at_line_start && (f->cmd != c->cmd || f->stream != c->stream))
+        log_emit(o, "\n", 1);
+    c->cmd = f->cmd;
+    c->stream = f->stream;
+
+    // every line of a record gets the time its first byte was read
+    char when[32], prefix[64];
+    timefmt_format_time((time_t)(f->ts_us / 1000000), when, sizeof(when));
+    if (f->stream == CAPTURE_LATER)
+        snprintf(prefix, sizeof(prefix), "[%s.%03d] [later] ", when,
+                 (int)(f->ts_us / 1000 % 1000));
+    else
+        snprintf(prefix, sizeof(prefix), "[%s.%03d] [%u %s] ", when,
+                 (int)(f->ts_us / 1000 % 1000), f->cmd,
+                 f->stream == CAPTURE_STDERR ? "err" : "out");
+
+    const char *s = data, *end = data + f->len;
+    while (s < end)
+    {
+        if (o->at_line_start)
+            log_emit(o, prefix, strlen(prefix));
+        const char *nl = memchr(s, '\n', (size_t)(end - s));
+        const char *stop = nl ? nl + 1 : end;
+        log_emit(o, s, (size_t)(stop - s));
+        s = stop;
+    }
+}
+
+static int log_stream_captured(tasklog_reader *r, capture_render *c)
+{
+    static char buf[65536];
+    capture_reader cr = {0};
+    ssize_t got;
+    int rc = 0;
+    while ((got = tasklog_read(r, buf, sizeof(buf))) > 0)
+    {
+        if (capture_feed(&cr, buf, (size_t)got, render_record, c) < 0)
+        {
+            rc = -1;
+            break;
+        }
+    }
+    capture_reader_free(&cr);
+    return rc;
+}
+
+int action_log(const char *id_input, const log_opts *opts)
 {
     char id[64];
     if (resolve_or_error(id_input, id, sizeof(id)) < 0)
         return 1;
 
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "log", path, sizeof(path)) < 0)
+    task_meta meta;
+    int have_meta = store_read_meta(id, &meta) == 0;
+    int captured = have_meta && meta.capture;
+    if (!captured && (opts->stderr_only || opts->timestamps))
+    {
+        fprintf(stderr, "Error: %s was not started with --capture; its log has no streams or "
+                        "times\n", id);
         return 1;
+    }
 
-    FILE *f = fopen(path, "r");
-    if (!f)
+    // log.gz once the task is over, if it was compressed
+    tasklog_reader *r = tasklog_open(id, "log");
+    if (!r)
     {
-        fprintf(stderr, "Error: no log file for %s\n", id);
+        if (errno == ENOTSUP)
+            fprintf(stderr, "Error: the log of %s is compressed and this build has no zlib\n", id);
+        else
+            fprintf(stderr, "Error: no log file for %s\n", id);
         return 1;
     }
 
-    if (verbose)
+    // a plain log is searched back from its end and handed to stdout by the kernel, so a huge
+    // one costs only what is shown; the rest are read from the start
+    size_t lines = opts->lines ? opts->lines : LOG_TAIL_LINES;
+    off_t from;
+    tasklog_reader *plain = NULL;
+    if (!captured && !(have_meta && meta.log_max > 0))
+    {
+        if (tasklog_tail_start(r, opts->verbose ? 0 : lines, &from) == 0)
+            plain = r;
+        // compressed, but log.tail has its end; enough if the lines start inside it
+        else if (!opts->verbose && (plain = tasklog_open(id, "log.tail")) &&
+                 (tasklog_tail_start(plain, lines, &from) < 0 || from == 0))
+        {
+            tasklog_close(plain);
+            plain = NULL;
+        }
+    }
+    if (plain)
     {
-        char buf[4096];
-        size_t r;
-        while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
-            fwrite(buf, 1, r, stdout);
+        fflush(stdout);
+        int rc = tasklog_copy(plain, from, STDOUT_FILENO);
+        if (rc < 0)
+            fprintf(stderr, "Error: cannot write the log of %s: %s\n", id, strerror(errno));
+        if (plain != r)
+            tasklog_close(plain);
+        tasklog_close(r);
+        return rc < 0 ? 1 : 0;
+    }
+
+    log_out out = {0};
+    out.verbose = opts->verbose;
+    out.size = lines;
+    out.at_line_start = 1;
+    if (captured)
+    {
+        // --capture and --log-max do not go together: no log.1, nothing dropped
+        capture_render c = {&out, opts, 0, -1};
+        int rc = log_stream_captured(r, &c);
+        tasklog_close(r);
+        if (rc < 0)
+            fprintf(stderr, "Warning: the rest of the log of %s is damaged\n", id);
     }
     else
     {
-        enum
+        // with --log-max, log.1 holds what came before log, and log.dropped says what is
+        // missing
+        tasklog_reader *older = tasklog_open(id, "log.1");
+        unsigned long long dropped = 0, at = 0;
+        tasklog_read_dropped(id, &dropped, &at);
+        char note_buf[160];
+        const char *note = NULL;
+        if (dropped)
         {
-            TAIL_MAX = 100
-        };
-        char *ring[TAIL_MAX] = {0};
-        size_t head = 0, count = 0;
-        char *line = NULL;
-        size_t cap = 0;
-        ssize_t got;
-        while ((got = getline(&line, &cap, f)) > 0)
-        {
-            free(ring[head]);
-            ring[head] = strdup(line);
-            head = (head + 1) % TAIL_MAX;
-            if (count < TAIL_MAX)
-                ++count;
-        }
-        free(line);
-        size_t start = (count < TAIL_MAX) ? 0 : head;
-        for (size_t i = 0; i < count; ++i)
-        {
-            size_t k = (start + i) % TAIL_MAX;
-            if (ring[k])
-                fputs(ring[k], stdout);
-        }
-        for (size_t i = 0; i < TAIL_MAX; ++i)
-            free(ring[i]);
-    }
-    fclose(f);
+            char size[32], max[32];
+            format_bytes(dropped, size, sizeof(size));
+            format_bytes(have_meta ? meta.log_max : 0, max, sizeof(max));
+            snprintf(note_buf, sizeof(note_buf),
+                     "[later: %s of output dropped here (--log-max %s, %s)]\n", size, max,
+                     have_meta ? store_log_policy_name(meta.log_policy) : "?");
+            note = note_buf;
+        }
+
+        unsigned long long pos = 0;
+        if (older)
+        {
+            log_stream(older, &out, &pos, at, &note);
+            tasklog_close(older);
+        }
+        log_stream(r, &out, &pos, at, &note);
+        tasklog_close(r);
+        if (note)
+            log_emit_note(&out, note);
+    }
+
+    // head-tail and ring keep the end of the output in memory until the task is over
+    if (have_meta && meta.log_max > 0 &&
+        (meta.log_policy == LOG_HEAD_TAIL || meta.log_policy == LOG_RING) &&
+        !store_status_is_final(store_resolve_status(id)))
+        log_emit_note(&out, "[later: the rest of the output is written when the task ends]\n");
+
+    if (out.partial)
+        log_push_line(&out, out.partial);
+    size_t start = (out.count < out.size) ? 0 : out.head;
+    for (size_t i = 0; i < out.count; ++i)
+        fputs(out.ring[(start + i) % out.size], stdout);
+    for (size_t i = 0; i < out.count; ++i)
+        free(out.ring[i]);
+    free(out.ring);
     return 0;
 }
 
@@ -589,29 +1607,33 @@ int action_clean(void)
     if (store_ensure_base() < 0)
         return 1;
 
-    strvec *list = NULL;
-    if (store_list(&list) < 0)
+    catalog *cat = NULL;
+    if (catalog_load(&cat) < 0)
     {
         fprintf(stderr, "Error: cannot list tasks\n");
-        strvec_free(&list);
+        catalog_free(&cat);
         return 1;
     }
 
     int n = 0;
-    for (size_t i = 0; i < list->len; ++i)
+    for (size_t i = 0; i < cat->len; ++i)
     {
-        if (store_status_is_final(store_resolve_status(list->items[i])))
+        catalog_entry *e = &cat->items[i];
+        if (store_status_is_final(catalog_entry_status(e)))
         {
-            if (store_delete_task(list->items[i]) == 0)
+            if (store_delete_task(e->id) == 0)
+            {
+                catalog_remove(e->id);
                 ++n;
+            }
         }
     }
-    strvec_free(&list);
+    catalog_free(&cat);
     printf("Cleaned %d task(s)\n", n);
     return 0;
 }
 
-int action_retry(const char *id_input, const char *time_str)
+int action_retry(const char *id_input, const char *time_str, const create_opts *opts)
 {
     if (!time_str || !*time_str)
     {
@@ -641,7 +1663,8 @@ int action_retry(const char *id_input, const char *time_str)
 
     char errbuf[256];
     time_t exec_at;
-    if (timefmt_parse_time(time_str, &exec_at, errbuf, sizeof(errbuf)) < 0)
+    int exec_ms;
+    if (timefmt_parse_time(time_str, &exec_at, &exec_ms, errbuf, sizeof(errbuf)) < 0)
     {
         fprintf(stderr, "Error: %s\n", errbuf);
         strvec_free(&cmds);
@@ -663,13 +1686,39 @@ int action_retry(const char *id_input, const char *time_str)
     for (size_t i = 0; i < cmds->len; ++i)
         printf("  %zu. %s\n", i + 1, cmds->items[i]);
 
-    int rc = spawn_task(exec_at, now, cwd, cmds);
+    // a retry runs the way the original did unless --parallel, --queue, --when-idle,
+    // --log-max or --one-shell say otherwise
+    create_opts own = *opts;
+    task_meta orig;
+    int have_orig = store_read_meta(id, &orig) == 0;
+    if (own.parallel < 0)
+        own.parallel = have_orig ? orig.parallel : 0;
+    if (have_orig && orig.one_shell && own.parallel <= 1)
+        own.one_shell = 1;
+    if (!own.queue && have_orig && orig.queue[0])
+    {
+        own.queue = orig.queue;
+        own.priority = orig.priority;
+    }
+    if (!own.idle && have_orig && orig.idle.max_s > 0)
+        own.idle = &orig.idle;
+    if (!own.log_max && have_orig && orig.log_max > 0)
+    {
+        own.log_max = orig.log_max;
+        own.log_policy = orig.log_policy;
+    }
+    if (have_orig && orig.capture && !own.one_shell && !own.log_max)
+        own.capture = 1;
+    int rc = spawn_task(exec_at, exec_ms, now, cwd, cmds, &own);
     strvec_free(&cmds);
     return rc;
 }
 
 int action_purge(void)
 {
+    // the supervisor holds the locks of the tasks it keeps; let it go first
+    supervisor_stop(0);
+
     strvec *list = NULL;
     if (store_list(&list) < 0)
     {
@@ -687,8 +1736,8 @@ int action_purge(void)
         task_meta meta;
         if (store_read_meta(list->items[i], &meta) == 0 && meta.daemon_pid > 0)
         {
-            kill(-meta.daemon_pid, SIGCONT);
-            kill(-meta.daemon_pid, SIGTERM);
+            store_signal_task(&meta, SIGCONT);
+            store_signal_task(&meta, SIGTERM);
             ++stopped;
         }
     }
@@ -744,3 +1793,214 @@ int action_purge(void)
     strvec_free(&foreign);
     return failed > 0 ? 1 : 0;
 }
+
+int action_migrate(const char *layout)
+{
+    store_layout to;
+    if (strcmp(layout, "flat") == 0)
+        to = STORE_LAYOUT_FLAT;
+    else if (strcmp(layout, "sharded") == 0)
+        to = STORE_LAYOUT_SHARDED;
+    else
+    {
+        fprintf(stderr, "Error: unknown layout '%s' (expected flat or sharded)\n", layout);
+        return 1;
+    }
+
+    if (store_ensure_base() < 0)
+    {
+        fprintf(stderr, "Error: cannot create data dir at %s\n", store_base_dir());
+        return 1;
+    }
+
+    size_t moved, skipped;
+    if (store_migrate(to, &moved, &skipped) < 0)
+    {
+        fprintf(stderr, "Error: migration stopped after %zu task(s): %s\n", moved,
+                strerror(errno));
+        return 1;
+    }
+    printf("Moved %zu task(s) to the %s layout\n", moved, layout);
+    if (skipped > 0)
+        printf("Skipped %zu active task(s); run --migrate %s again once they finish\n", skipped,
+               layout);
+    return 0;
+}
+
+// --compact: worker processes, at most one per CPU
+#define COMPACT_MAX_WORKERS 32
+
+/* What one --compact worker did, sent back through a pipe. */
+typedef struct
+{
+    unsigned long long files, failed; // log files compressed, tasks that failed
+    unsigned long long before, after; // their sizes
+} compact_result;
+
+int action_compact(void)
+{
+    if (!tasklog_compression_available())
+    {
+        fprintf(stderr, "Error: this build of later has no zlib; logs cannot be compressed\n");
+        return 1;
+    }
+
+    catalog *cat = NULL;
+    strvec *ids = NULL;
+    if (store_ensure_base() < 0 || catalog_load(&cat) < 0 || strvec_init(&ids) < 0)
+    {
+        fprintf(stderr, "Error: cannot list tasks\n");
+        catalog_free(&cat);
+        return 1;
+    }
+    for (size_t i = 0; i < cat->len; ++i)
+    {
+        if (store_status_is_final(catalog_entry_status(&cat->items[i])) &&
+            !store_task_group_alive(cat->items[i].id))
+            strvec_push(ids, cat->items[i].id);
+    }
+    catalog_free(&cat);
+
+    // one worker per CPU, each taking every nth task; they report back through a pipe
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers = ncpu > 0 ? (size_t)ncpu : 1;
+    if (nworkers > COMPACT_MAX_WORKERS)
+        nworkers = COMPACT_MAX_WORKERS;
+    if (nworkers > ids->len)
+        nworkers = ids->len;
+    int report[2];
+    if (nworkers > 0 && pipe(report) < 0)
+    {
+        fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
+        strvec_free(&ids);
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    size_t started = 0;
+    for (size_t w = 0; w < nworkers; ++w)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (pid == 0)
+        {
+            close(report[0]);
+            compact_result res = {0};
+            for (size_t i = w; i < ids->len; i += nworkers)
+            {
+                int n = tasklog_compress(ids->items[i], &res.before, &res.after);
+                if (n < 0)
+                    ++res.failed;
+                else
+                    res.files += (unsigned long long)n;
+            }
+            _exit(write(report[1], &res, sizeof(res)) == (ssize_t)sizeof(res) ? 0 : 1);
+        }
+        ++started;
+    }
+    compact_result total = {0};
+    if (nworkers > 0)
+    {
+        close(report[1]);
+        compact_result res;
+        while (read(report[0], &res, sizeof(res)) == (ssize_t)sizeof(res))
+        {
+            total.files += res.files;
+            total.failed += res.failed;
+            total.before += res.before;
+            total.after += res.after;
+        }
+        close(report[0]);
+    }
+    for (size_t w = 0; w < started; ++w)
+        wait(NULL);
+    strvec_free(&ids);
+
+    if (started < nworkers)
+        fprintf(stderr, "Warning: only %zu of %zu workers started; run --compact again\n",
+                started, nworkers);
+    char before[32], after[32];
+    format_bytes(total.before, before, sizeof(before));
+    format_bytes(total.after, after, sizeof(after));
+    printf("Compressed %llu log file(s): %s -> %s\n", total.files, before, after);
+    if (total.failed)
+    {
+        fprintf(stderr, "Error: %llu task(s) could not be compressed\n", total.failed);
+        return 1;
+    }
+    return 0;
+}
+
+int action_supervisor(const char *cmd)
+{
+    if (strcmp(cmd, "start") == 0)
+        return supervisor_start() == 0 ? 0 : 1;
+
+    if (strcmp(cmd, "stop") == 0)
+    {
+        int rc = supervisor_stop(1);
+        if (rc > 0)
+            printf("Supervisor is not running\n");
+        else if (rc == 0)
+            printf("Supervisor stopped; pending tasks continue as their own daemons\n");
+        else
+            fprintf(stderr, "Error: supervisor did not exit\n");
+        return rc < 0 ? 1 : 0;
+    }
+
+    if (strcmp(cmd, "status") == 0)
+    {
+        pid_t pid;
+        size_t pending;
+        if (supervisor_status(&pid, &pending) < 0)
+            printf("Supervisor is not running\n");
+        else
+            printf("Supervisor running (pid %d, %zu pending task(s))\n", (int)pid, pending);
+        return 0;
+    }
+
+    fprintf(stderr, "Error: unknown supervisor command '%s' (expected start, stop or status)\n", cmd);
+    return 1;
+}
+
+int action_queue_limit(const char *spec)
+{
+    char name[QUEUE_NAME_MAX];
+    const char *eq = strchr(spec, '=');
+    size_t len = eq ? (size_t)(eq - spec) : strlen(spec);
+    if (len < sizeof(name))
+        snprintf(name, sizeof(name), "%.*s", (int)len, spec);
+    if (len >= sizeof(name) || !queue_name_valid(name))
+    {
+        fprintf(stderr, "Error: invalid queue name in '%s'\n", spec);
+        return 1;
+    }
+
+    if (eq)
+    {
+        char *end;
+        long limit = strtol(eq + 1, &end, 10);
+        if (!eq[1] || *end || limit < 1 || limit > QUEUE_MAX_LIMIT)
+        {
+            fprintf(stderr, "Error: queue limit must be between 1 and %d\n", QUEUE_MAX_LIMIT);
+            return 1;
+        }
+        if (queue_set_limit(name, (int)limit) < 0)
+        {
+            fprintf(stderr, "Error: cannot set limit of queue %s: %s\n", name, strerror(errno));
+            return 1;
+        }
+    }
+
+    int running = 0, waiting = 0;
+    if (queue_stat(name, &running, &waiting) < 0)
+    {
+        fprintf(stderr, "Error: cannot read queue %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    printf("Queue %s: %d of %d slots in use, %d waiting\n", name, running,
+           queue_get_limit(name), waiting);
+    return 0;
+}
@@ -1,16 +1,66 @@
 #ifndef LATER_ACTION_H_
 #define LATER_ACTION_H_
 
-int action_create(const char *time_str);
-int action_list(int verbose);
-int action_show(const char *id_input);
+#include "store.h"
+
+#include <time.h>
+
+typedef struct
+{
+    int verbose;
+    unsigned status_mask; // 1u << task_status for each status to show; 0 = all
+    time_t since;         // 0 = unbounded
+    time_t until;         // 0 = unbounded
+    int by_exec;          // since/until apply to execute_at instead of created_at
+    const char *cwd;      // only tasks whose working dir is this dir or below it
+    size_t limit;         // stop after this many rows; 0 = no limit
+    size_t offset;        // skip this many matching rows first
+    int reverse;          // newest first
+} list_opts;
+
+typedef struct
+{
+    int parallel;      // commands run at once (see exec.h); 0 = in order, < 0 = retry: as before
+    int one_shell;     // all commands in one shell (see exec.h); retry: also if the original did
+    const char *after; // comma-separated tasks (ids, numbers or prefixes) to wait for; or NULL
+    int after_ok;      // ...which must complete, or the new task fails without running
+    const char *queue; // named queue to wait in for a slot (see queue.h); or NULL
+    int priority;      // place in the queue's line, higher first
+    const task_idle *idle; // --when-idle thresholds (see idle.h); or NULL
+    unsigned long long log_max; // bytes of output the log keeps (see tasklog.h); 0 = all
+    task_log_policy log_policy; // how it stays under log_max
+    int capture;       // framed capture of each command's stdout and stderr (see capture.h)
+} create_opts;
+
+int action_create(const char *time_str, const create_opts *opts);
+/* Create every task in a manifest file (see manifest.h); path "-" reads stdin. */
+int action_submit(const char *path);
+int action_list(const list_opts *opts);
+/* Histogram and percentiles of start lag (and time to ready) over the tasks -l would show. */
+int action_lag(const list_opts *opts);
+int action_show(const char *id_input, int verbose);
 int action_cancel(const char *id_input);
 int action_pause(const char *id_input);
 int action_resume(const char *id_input);
 int action_delete(const char *id_input);
-int action_log(const char *id_input, int verbose);
+typedef struct
+{
+    int verbose;     // the whole log instead of its last lines
+    size_t lines;    // how many last lines; 0 for the default
+    int stderr_only; // captured logs: only what commands wrote to stderr
+    int timestamps;  // captured logs: prefix each line with when it was read and where from
+} log_opts;
+
+int action_log(const char *id_input, const log_opts *opts);
 int action_clean(void);
-int action_retry(const char *id_input, const char *time_str);
+int action_retry(const char *id_input, const char *time_str, const create_opts *opts);
 int action_purge(void);
+/* start, stop or status of the supervisor (see supervisor.h). */
+int action_supervisor(const char *cmd);
+int action_migrate(const char *layout);
+/* Compress the logs of every finished task (see tasklog.h). */
+int action_compact(void);
+/* "NAME=N" sets how many tasks of queue NAME run at once; "NAME" shows the queue. */
+int action_queue_limit(const char *spec);
 
 #endif // LATER_ACTION_H_
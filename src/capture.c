@@ -0,0 +1,634 @@
+#ifdef __linux__
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#endif
+
+#include "capture.h"
+
+#include "store.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <unistd.h>
+
+_Static_assert(sizeof(capture_frame) == 24, "capture_frame is stored on disk");
+
+// a command can run this far ahead of the capture process before its writes block
+#define CAPTURE_PIPE_SIZE (1 << 20)
+#define CAPTURE_CHUNK (256 * 1024)
+// how long the daemon waits for the capture process before reporting the task done
+#define CAPTURE_FLUSH_MS 2000
+#define CAPTURE_MAX_EVENTS 64
+// on the socket instead of a command's pipes: command (this bit cleared) has exited
+#define CAPTURE_SYNC 0x80000000u
+
+// the capture process, the socket that hands it each command's pipes, and a pipe that hangs
+// up when it exits
+static pid_t g_capture = -1;
+static int g_capture_sock = -1;
+static int g_capture_done = -1;
+
+/* One record in one write, so it never interleaves with a note appended by someone else. */
+static int write_record(int fd, uint32_t cmd, uint8_t stream, long long ts_us, const char *data,
+                        size_t n)
+{
+    capture_frame f;
+    memset(&f, 0, sizeof(f));
+    memcpy(f.magic, CAPTURE_MAGIC, sizeof(f.magic));
+    f.stream = stream;
+    f.cmd = cmd;
+    f.len = (uint32_t)n;
+    f.ts_us = ts_us;
+    struct iovec iov[2] = {{&f, sizeof(f)}, {(void *)data, n}};
+    ssize_t w;
+    do
+        w = writev(fd, iov, 2);
+    while (w < 0 && errno == EINTR);
+    if (w < 0)
+        return -1;
+    // a short write to a regular file: finish it by hand
+    size_t done = (size_t)w;
+    if (done < sizeof(f))
+        return write_all(fd, (const char *)&f + done, sizeof(f) - done) < 0 ||
+                       write_all(fd, data, n) < 0
+                   ? -1
+                   : 0;
+    return write_all(fd, data + (done - sizeof(f)), n - (done - sizeof(f)));
+}
+
+int capture_write_note(int fd, const char *text)
+{
+    return write_record(fd, 0, CAPTURE_LATER, wall_now_us(), text, strlen(text));
+}
+
+/* One stream being captured. Bytes after its last newline wait in buf for the rest of their
+ * line, unless buf fills up. */
+typedef struct
+{
+    int fd;
+    uint32_t cmd;
+    uint8_t stream;
+    char *buf;
+    size_t len;
+    long long first_us; // when the oldest byte in buf was read
+} source;
+
+typedef struct
+{
+    source *items;
+    size_t len, cap;
+    int log;
+#ifdef __linux__
+    int ep;
+#endif
+} capture_state;
+
+static int watch(capture_state *st, int fd)
+{
+#ifdef __linux__
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(st->ep, EPOLL_CTL_ADD, fd, &ev);
+#else
+    (void)st;
+    (void)fd;
+    return 0;
+#endif
+}
+
+static int add_source(capture_state *st, int fd, uint32_t cmd, uint8_t stream)
+{
+    if (st->len == st->cap)
+    {
+        size_t nc = st->cap ? st->cap * 2 : 16;
+        source *ni = realloc(st->items, nc * sizeof(*ni));
+        if (!ni)
+            return -1;
+        st->items = ni;
+        st->cap = nc;
+    }
+    source *s = &st->items[st->len];
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->cmd = cmd;
+    s->stream = stream;
+    s->buf = malloc(CAPTURE_CHUNK);
+    if (!s->buf)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (watch(st, fd) < 0)
+    {
+        free(s->buf);
+        return -1;
+    }
+    ++st->len;
+    return 0;
+}
+
+static void emit(capture_state *st, source *s, size_t n)
+{
+    write_record(st->log, s->cmd, s->stream, s->first_us, s->buf, n);
+    memmove(s->buf, s->buf + n, s->len - n);
+    s->len -= n;
+    s->first_us = wall_now_us();
+}
+
+/* One read from s. Return 1 if it read something, 0 if there was nothing to read, -1 once s
+ * is done (and flushed). */
+static int pump(capture_state *st, source *s)
+{
+    ssize_t r;
+    do
+        r = read(s->fd, s->buf + s->len, CAPTURE_CHUNK - s->len);
+    while (r < 0 && errno == EINTR);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0)
+    {
+        if (s->len)
+            emit(st, s, s->len);
+        return -1;
+    }
+
+    if (s->len == 0)
+        s->first_us = wall_now_us();
+    size_t old = s->len;
+    s->len += (size_t)r;
+    char *nl = NULL;
+    for (char *p = s->buf + s->len; p > s->buf + old;)
+    {
+        if (*--p == '\n')
+        {
+            nl = p;
+            break;
+        }
+    }
+    if (nl)
+        emit(st, s, (size_t)(nl - s->buf) + 1);
+    else if (s->len == CAPTURE_CHUNK)
+        emit(st, s, s->len);
+    return 1;
+}
+
+static void drop_source(capture_state *st, size_t k)
+{
+    close(st->items[k].fd); // also takes it out of the epoll set
+    free(st->items[k].buf);
+    st->items[k] = st->items[--st->len];
+}
+
+/* Command cmd has exited: log all it left in its pipes, up to EOF or, if a background child
+ * still holds them, as far as there is anything to read. Then tell the daemon. */
+static void sync_command(capture_state *st, int sock, uint32_t cmd)
+{
+    for (size_t k = 0; k < st->len;)
+    {
+        source *s = &st->items[k];
+        if (s->cmd != cmd || s->stream == CAPTURE_LATER)
+        {
+            ++k;
+            continue;
+        }
+        int r;
+        while ((r = pump(st, s)) > 0)
+            ;
+        if (r < 0)
+        {
+            drop_source(st, k);
+            continue;
+        }
+        if (s->len)
+            emit(st, s, s->len);
+        ++k;
+    }
+    ssize_t w;
+    do
+        w = send(sock, &cmd, sizeof(cmd), 0);
+    while (w < 0 && errno == EINTR);
+}
+
+/* Take the pipes of a command the daemon is about to start, or a CAPTURE_SYNC for one that
+ * ended. Return -1 once the daemon has closed the socket. */
+static int receive_command(capture_state *st, int sock)
+{
+    uint32_t cmd;
+    union
+    {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    struct iovec iov = {&cmd, sizeof(cmd)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    ssize_t r;
+    do
+        r = recvmsg(sock, &msg, 0);
+    while (r < 0 && errno == EINTR);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0)
+        return -1;
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (r == sizeof(cmd) && !c && (cmd & CAPTURE_SYNC))
+    {
+        sync_command(st, sock, cmd & ~CAPTURE_SYNC);
+        return 0;
+    }
+    if (r != sizeof(cmd) || !c || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return 0;
+    int fds[2];
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+    if (add_source(st, fds[0], cmd, CAPTURE_STDOUT) < 0)
+        close(fds[0]);
+    if (add_source(st, fds[1], cmd, CAPTURE_STDERR) < 0)
+        close(fds[1]);
+    return 0;
+}
+
+/* The capture process: until later's own output, the socket and every command's pipes have
+ * all been closed. */
+static void run_capture(int own_fd, int sock, int log)
+{
+    capture_state st = {0};
+    st.log = log;
+#ifdef __linux__
+    st.ep = epoll_create1(EPOLL_CLOEXEC);
+    if (st.ep < 0)
+        return;
+#endif
+    if (add_source(&st, own_fd, 0, CAPTURE_LATER) < 0)
+        return;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    if (watch(&st, sock) < 0)
+        return;
+
+    int *ready = NULL;
+    size_t ready_cap = 0;
+    while (st.len > 0 || sock >= 0)
+    {
+        // room for every fd that can be ready at once
+        size_t want = st.len + 1 > CAPTURE_MAX_EVENTS ? st.len + 1 : CAPTURE_MAX_EVENTS;
+        if (want > ready_cap)
+        {
+            int *nr = realloc(ready, want * sizeof(*nr));
+            if (!nr)
+                break;
+            ready = nr;
+            ready_cap = want;
+        }
+        size_t nready = 0;
+#ifdef __linux__
+        struct epoll_event evs[CAPTURE_MAX_EVENTS];
+        int n = epoll_wait(st.ep, evs, CAPTURE_MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; ++i)
+            ready[nready++] = evs[i].data.fd;
+#else
+        struct pollfd *pfds = malloc(want * sizeof(*pfds));
+        if (!pfds)
+            break;
+        nfds_t npfd = 0;
+        if (sock >= 0)
+            pfds[npfd++] = (struct pollfd){.fd = sock, .events = POLLIN};
+        for (size_t k = 0; k < st.len; ++k)
+            pfds[npfd++] = (struct pollfd){.fd = st.items[k].fd, .events = POLLIN};
+        int n = poll(pfds, npfd, -1);
+        for (nfds_t i = 0; n > 0 && i < npfd; ++i)
+            if (pfds[i].revents)
+                ready[nready++] = pfds[i].fd;
+        free(pfds);
+        if (n < 0 && errno != EINTR)
+            break;
+#endif
+
+        // later's own messages first, then newly started commands, then their output: a
+        // command's progress line, written before its pipes were handed over, is logged before
+        // anything it wrote in the same round. What is said after it exits waits for
+        // capture_sync_command() instead.
+        for (int pass = 0; pass < 3; ++pass)
+        {
+            for (size_t i = 0; i < nready; ++i)
+            {
+                int fd = ready[i];
+                if (pass == 1)
+                {
+                    if (fd == sock && receive_command(&st, sock) < 0)
+                    {
+                        close(sock);
+                        sock = -1;
+                    }
+                    continue;
+                }
+                if (fd == sock)
+                    continue;
+                for (size_t k = 0; k < st.len; ++k)
+                {
+                    source *s = &st.items[k];
+                    if (s->fd != fd || (pass == 0) != (s->stream == CAPTURE_LATER))
+                        continue;
+                    if (pump(&st, s) < 0)
+                        drop_source(&st, k);
+                    break;
+                }
+            }
+        }
+    }
+    free(ready);
+    for (size_t k = 0; k < st.len; ++k)
+    {
+        if (st.items[k].len)
+            emit(&st, &st.items[k], st.items[k].len);
+    }
+}
+
+int capture_start(const char *id)
+{
+    char path[PATH_MAX];
+    if (store_path_in_task(id, "log", path, sizeof(path)) < 0)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int log = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log < 0)
+        return -1;
+    int own[2] = {-1, -1}, sock[2] = {-1, -1}, done[2] = {-1, -1};
+    if (pipe(own) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, sock) < 0 || pipe(done) < 0)
+    {
+        int saved = errno;
+        int all[] = {log, own[0], own[1], sock[0], sock[1], done[0], done[1]};
+        for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i)
+            if (all[i] >= 0)
+                close(all[i]);
+        errno = saved;
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // out of the task's group, like the --log-max writer: a cancel must not lose output
+        setpgid(0, 0);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        const int keep[] = {own[0], sock[1], done[1], log};
+        close_others(keep, sizeof(keep) / sizeof(keep[0]));
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO)
+                close(devnull);
+        }
+        run_capture(own[0], sock[1], log);
+        _exit(0);
+    }
+
+    int saved = errno;
+    close(log);
+    close(own[0]);
+    close(sock[1]);
+    close(done[1]);
+    if (pid < 0)
+    {
+        close(own[1]);
+        close(sock[0]);
+        close(done[0]);
+        errno = saved;
+        return -1;
+    }
+#ifdef __linux__
+    fcntl(own[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+#endif
+    fcntl(own[1], F_SETFD, FD_CLOEXEC);
+    fcntl(sock[0], F_SETFD, FD_CLOEXEC);
+    fcntl(done[0], F_SETFD, FD_CLOEXEC);
+    g_capture = pid;
+    g_capture_sock = sock[0];
+    g_capture_done = done[0];
+    return own[1];
+}
+
+int capture_open_command(size_t i, int *out_fd, int *err_fd)
+{
+    if (g_capture_sock < 0)
+        return -1;
+    int out[2], err[2];
+    if (pipe(out) < 0)
+        return -1;
+    if (pipe(err) < 0)
+    {
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    int all[] = {out[0], out[1], err[0], err[1]};
+    for (size_t k = 0; k < 4; ++k)
+        fcntl(all[k], F_SETFD, FD_CLOEXEC); // a sibling started later must not hold them
+#ifdef __linux__
+    fcntl(out[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+    fcntl(err[1], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+#endif
+
+    uint32_t cmd = (uint32_t)i + 1;
+    union
+    {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = {&cmd, sizeof(cmd)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int pass[2] = {out[0], err[0]};
+    memcpy(CMSG_DATA(c), pass, sizeof(pass));
+    ssize_t r;
+    do
+        r = sendmsg(g_capture_sock, &msg, 0);
+    while (r < 0 && errno == EINTR);
+    close(out[0]);
+    close(err[0]);
+    if (r != sizeof(cmd))
+    {
+        close(out[1]);
+        close(err[1]);
+        return -1;
+    }
+    *out_fd = out[1];
+    *err_fd = err[1];
+    return 0;
+}
+
+int capture_sync_command(size_t i)
+{
+    if (g_capture_sock < 0)
+        return 0;
+    uint32_t cmd = (uint32_t)i + 1, sync = cmd | CAPTURE_SYNC;
+    ssize_t w;
+    do
+        w = send(g_capture_sock, &sync, sizeof(sync), 0);
+    while (w < 0 && errno == EINTR);
+    if (w != sizeof(sync))
+        return -1;
+
+    // an answer left over from a sync that timed out is skipped
+    for (;;)
+    {
+        struct pollfd p = {g_capture_sock, POLLIN, 0};
+        int n;
+        do
+            n = poll(&p, 1, CAPTURE_FLUSH_MS);
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return -1;
+        uint32_t done;
+        ssize_t r;
+        do
+            r = recv(g_capture_sock, &done, sizeof(done), 0);
+        while (r < 0 && errno == EINTR);
+        if (r != sizeof(done))
+            return -1;
+        if (done == cmd)
+            return 0;
+    }
+}
+
+int capture_finish(void)
+{
+    if (g_capture < 0)
+        return 0;
+    fflush(stdout);
+    fflush(stderr);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull >= 0)
+    {
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+    close(g_capture_sock);
+
+    // a background child still holding a pipe keeps the capture process going; not us
+    struct pollfd p = {g_capture_done, POLLIN, 0};
+    int n;
+    do
+        n = poll(&p, 1, CAPTURE_FLUSH_MS);
+    while (n < 0 && errno == EINTR);
+    waitpid(g_capture, NULL, WNOHANG);
+    close(g_capture_done);
+    g_capture = -1;
+    g_capture_sock = -1;
+    g_capture_done = -1;
+    return n > 0 ? 0 : -1;
+}
+
+/* Call fn for every whole record in data; return the bytes used, or -1 on a bad record. */
+static long long parse_records(const char *data, size_t n, capture_record_fn fn, void *ctx)
+{
+    size_t off = 0;
+    while (n - off >= sizeof(capture_frame))
+    {
+        capture_frame f;
+        memcpy(&f, data + off, sizeof(f));
+        if (memcmp(f.magic, CAPTURE_MAGIC, sizeof(f.magic)) != 0)
+            return -1;
+        if (n - off - sizeof(f) < f.len)
+            break;
+        fn(&f, data + off + sizeof(f), ctx);
+        off += sizeof(f) + f.len;
+    }
+    return (long long)off;
+}
+
+int capture_feed(capture_reader *r, const char *data, size_t n, capture_record_fn fn, void *ctx)
+{
+    // finish the record carried over, then take the rest straight from data
+    while (r->len > 0 && n > 0)
+    {
+        capture_frame f;
+        size_t need = sizeof(f);
+        if (r->len >= sizeof(f))
+        {
+            memcpy(&f, r->buf, sizeof(f));
+            need += f.len;
+        }
+        size_t take = need - r->len < n ? need - r->len : n;
+        if (r->len + take > r->cap)
+        {
+            char *nb = realloc(r->buf, r->len + take);
+            if (!nb)
+                return -1;
+            r->buf = nb;
+            r->cap = r->len + take;
+        }
+        memcpy(r->buf + r->len, data, take);
+        r->len += take;
+        data += take;
+        n -= take;
+        if (r->len < sizeof(f))
+            continue;
+        memcpy(&f, r->buf, sizeof(f));
+        if (memcmp(f.magic, CAPTURE_MAGIC, sizeof(f.magic)) != 0)
+            return -1;
+        if (r->len == sizeof(f) + f.len)
+        {
+            fn(&f, r->buf + sizeof(f), ctx);
+            r->len = 0;
+        }
+    }
+
+    long long used = parse_records(data, n, fn, ctx);
+    if (used < 0)
+        return -1;
+    size_t rest = n - (size_t)used;
+    if (rest > 0)
+    {
+        if (rest > r->cap)
+        {
+            char *nb = realloc(r->buf, rest);
+            if (!nb)
+                return -1;
+            r->buf = nb;
+            r->cap = rest;
+        }
+        memcpy(r->buf, data + used, rest);
+        r->len = rest;
+    }
+    return 0;
+}
+
+void capture_reader_free(capture_reader *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+    r->len = r->cap = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef LATER_CAPTURE_H_
+#define LATER_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * --capture: every command gets a stdout and a stderr pipe of its own, read by a capture
+ * process that writes the task's log as a sequence of records, each a capture_frame followed
+ * by len bytes: what one read of one stream returned, cut at its last newline. later's own
+ * messages (progress, exit codes) are records of command 0. The capture process waits in
+ * epoll on Linux (poll elsewhere) with 1MB pipes and 256KB reads, so a chatty command is
+ * limited by the disk rather than by us.
+ *
+ * The records are in host byte order, like the meta file. --log renders them as plain text.
+ */
+
+#define CAPTURE_MAGIC "\x1eL"
+
+enum
+{
+    CAPTURE_LATER,  // later's own messages
+    CAPTURE_STDOUT,
+    CAPTURE_STDERR
+};
+
+typedef struct
+{
+    char magic[2];    // CAPTURE_MAGIC
+    uint8_t stream;   // CAPTURE_*
+    uint8_t reserved;
+    uint32_t cmd;     // 1-based command number; 0 for later's own messages
+    uint32_t len;     // bytes of output that follow
+    uint32_t reserved2;
+    int64_t ts_us;    // wall clock when the first of them was read
+} capture_frame;
+
+/* Start the capture process for task id and return the fd later's own stdout and stderr
+ * should go to; -1 with errno set if it cannot be started. */
+int capture_start(const char *id);
+/* Pipes for command i (0-based): the write ends are returned for its stdout and stderr, the
+ * read ends are handed to the capture process. Return -1 if capture_start() was not called
+ * or the pipes cannot be made. */
+int capture_open_command(size_t i, int *out_fd, int *err_fd);
+/* Command i has exited: wait until the capture process has logged what it wrote, so that
+ * what later says about it comes after. Return -1 if that takes too long. */
+int capture_sync_command(size_t i);
+/* Point stdout and stderr at /dev/null and give the capture process a moment to write what it
+ * has. Return 0 once it is done (or was never started), -1 if it is still running. */
+int capture_finish(void);
+
+/* Append text to a captured log (fd opened for appending) as a message of later's own. */
+int capture_write_note(int fd, const char *text);
+
+/* Splits a captured log, read in pieces of any size, back into records. */
+typedef void (*capture_record_fn)(const capture_frame *f, const char *data, void *ctx);
+typedef struct
+{
+    char *buf; // an incomplete record carried over to the next piece
+    size_t len, cap;
+} capture_reader;
+
+/* Call fn for each record completed by the n bytes of data. Return -1 if the data is not a
+ * captured log. */
+int capture_feed(capture_reader *r, const char *data, size_t n, capture_record_fn fn,
+                 void *ctx);
+void capture_reader_free(capture_reader *r);
+
+#endif // LATER_CAPTURE_H_
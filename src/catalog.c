@@ -0,0 +1,522 @@
+#include "catalog.h"
+
+#include "store.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st).st_mtimespec)
+#else
+#define ST_MTIM(st) ((st).st_mtim)
+#endif
+
+typedef struct
+{
+    size_t *slots; // index + 1 into catalog.items, 0 = empty
+    size_t cap;
+} id_index;
+
+static uint64_t hash_id(const char *id)
+{
+    return hash_fnv1a(id, strlen(id), HASH_FNV1A_INIT);
+}
+
+static int index_grow(id_index *ix, const catalog *c)
+{
+    size_t nc = ix->cap ? ix->cap * 2 : 256;
+    size_t *ns = calloc(nc, sizeof(*ns));
+    if (!ns)
+        return -1;
+    for (size_t i = 0; i < ix->cap; ++i)
+    {
+        if (!ix->slots[i])
+            continue;
+        size_t k = hash_id(c->items[ix->slots[i] - 1].id) & (nc - 1);
+        while (ns[k])
+            k = (k + 1) & (nc - 1);
+        ns[k] = ix->slots[i];
+    }
+    free(ix->slots);
+    ix->slots = ns;
+    ix->cap = nc;
+    return 0;
+}
+
+/* Return the slot holding id, or the empty slot where it belongs. Deleted entries keep their
+ * slot with an emptied id, so probing walks past them. */
+static size_t *index_find(id_index *ix, const catalog *c, const char *id)
+{
+    size_t k = hash_id(id) & (ix->cap - 1);
+    while (ix->slots[k] && strcmp(c->items[ix->slots[k] - 1].id, id) != 0)
+        k = (k + 1) & (ix->cap - 1);
+    return &ix->slots[k];
+}
+
+static catalog_entry *catalog_push(catalog *c)
+{
+    if (c->len == c->cap)
+    {
+        size_t nc = c->cap ? c->cap * 2 : 64;
+        catalog_entry *ni = realloc(c->items, nc * sizeof(*ni));
+        if (!ni)
+            return NULL;
+        c->items = ni;
+        c->cap = nc;
+    }
+    catalog_entry *e = &c->items[c->len++];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const catalog_entry *ea = a;
+    const catalog_entry *eb = b;
+    if (!ea->have_meta && !eb->have_meta)
+        return strcmp(ea->id, eb->id);
+    if (!ea->have_meta)
+        return 1;
+    if (!eb->have_meta)
+        return -1;
+    if (ea->created_at < eb->created_at)
+        return -1;
+    if (ea->created_at > eb->created_at)
+        return 1;
+    return strcmp(ea->id, eb->id);
+}
+
+static int lock_catalog(int op)
+{
+    int base = store_base_fd();
+    if (base < 0)
+        return -1;
+    int fd = openat(base, "catalog.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    while (flock(fd, op) < 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Append one record. A missing catalog is left missing: the next load rebuilds it from the
+ * task dirs, which is the only way it can know about every task. */
+static int append_record(const char *line, size_t len, int wait)
+{
+    int lock_fd = lock_catalog(wait ? LOCK_SH : (LOCK_SH | LOCK_NB));
+    if (lock_fd < 0)
+        return (errno == EWOULDBLOCK || errno == EAGAIN) ? 0 : -1;
+
+    int rc = -1;
+    int fd = openat(store_base_fd(), "catalog", O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        rc = write_all(fd, line, len);
+        close(fd);
+    }
+    else if (errno == ENOENT)
+    {
+        rc = 0;
+    }
+    close(lock_fd);
+    return rc;
+}
+
+static int format_add(char *buf, size_t n, const catalog_entry *e)
+{
+    int w;
+    if (e->have_meta)
+        w = snprintf(buf, n, "+ %s %lld %lld %zu %s\n", e->id, (long long)e->created_at,
+                     (long long)e->execute_at, e->ncmds, store_status_name(e->status));
+    else
+        w = snprintf(buf, n, "+ %s - - %zu %s\n", e->id, e->ncmds, store_status_name(e->status));
+    return (w < 0 || (size_t)w >= n) ? -1 : w;
+}
+
+static int parse_ll(const char *s, long long *out)
+{
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || *end)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+/* Apply one record (without its '\n') to c. Malformed records are ignored. */
+static void apply_record(catalog *c, id_index *ix, char *rec)
+{
+    char *fields[6];
+    size_t nf = 0;
+    for (char *tok = strtok(rec, " "); tok && nf < 6; tok = strtok(NULL, " "))
+        fields[nf++] = tok;
+    if (nf < 2 || strlen(fields[0]) != 1 || !is_task_id(fields[1]) ||
+        strlen(fields[1]) >= sizeof(c->items[0].id))
+        return;
+
+    char op = fields[0][0];
+    task_status st;
+    if (op == '+')
+    {
+        long long created = 0, exec = 0, ncmds;
+        if (nf != 6)
+            return;
+        int have_meta = strcmp(fields[2], "-") != 0;
+        if (parse_ll(fields[4], &ncmds) < 0 || ncmds < 0 ||
+            store_status_from_name(fields[5], &st) < 0)
+            return;
+        if (have_meta && (parse_ll(fields[2], &created) < 0 || parse_ll(fields[3], &exec) < 0))
+            return;
+
+        if (c->len * 2 >= ix->cap && index_grow(ix, c) < 0)
+            return;
+        size_t *slot = index_find(ix, c, fields[1]);
+        catalog_entry *e;
+        if (*slot)
+        {
+            e = &c->items[*slot - 1];
+        }
+        else
+        {
+            if (!(e = catalog_push(c)))
+                return;
+            *slot = c->len;
+            snprintf(e->id, sizeof(e->id), "%s", fields[1]);
+        }
+        e->have_meta = have_meta;
+        e->created_at = (time_t)created;
+        e->execute_at = (time_t)exec;
+        e->ncmds = (size_t)ncmds;
+        e->status = st;
+        return;
+    }
+
+    if (!ix->cap)
+        return;
+    size_t *slot = index_find(ix, c, fields[1]);
+    if (!*slot)
+        return;
+    catalog_entry *e = &c->items[*slot - 1];
+    if (op == '=' && nf == 3 && store_status_from_name(fields[2], &st) == 0)
+        e->status = st;
+    else if (op == '-' && nf == 2)
+        e->id[0] = '\0';
+}
+
+static int read_file(int dir_fd, const char *name, char **out, size_t *len)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t cap = (size_t)st.st_size + 1;
+    char *buf = malloc(cap);
+    if (!buf)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t off = 0;
+    while (1)
+    {
+        if (off + 1 >= cap)
+        {
+            char *nb = realloc(buf, cap * 2);
+            if (!nb)
+            {
+                free(buf);
+                close(fd);
+                return -1;
+            }
+            buf = nb;
+            cap *= 2;
+        }
+        ssize_t r = read(fd, buf + off, cap - 1 - off);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        if (r == 0)
+            break;
+        off += (size_t)r;
+    }
+    close(fd);
+    buf[off] = '\0';
+    *out = buf;
+    *len = off;
+    return 0;
+}
+
+/* Parse the catalog file into c (sorted, deleted entries dropped); count records in *nrec. */
+static int parse_catalog(catalog *c, size_t *nrec)
+{
+    char *buf;
+    size_t len;
+    if (read_file(store_base_fd(), "catalog", &buf, &len) < 0)
+        return -1;
+
+    id_index ix = {0};
+    *nrec = 0;
+    char *p = buf;
+    char *end = buf + len;
+    while (p < end)
+    {
+        char *nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl)
+            break; // torn tail
+        *nl = '\0';
+        // a crash can leave NUL-filled garbage in place of a record
+        if ((size_t)(nl - p) == strlen(p))
+            apply_record(c, &ix, p);
+        ++*nrec;
+        p = nl + 1;
+    }
+    free(ix.slots);
+    free(buf);
+
+    size_t w = 0;
+    for (size_t i = 0; i < c->len; ++i)
+    {
+        if (c->items[i].id[0])
+            c->items[w++] = c->items[i];
+    }
+    c->len = w;
+    qsort(c->items, c->len, sizeof(*c->items), cmp_entry);
+    return 0;
+}
+
+static void entry_from_snapshot(catalog_entry *e, const task_snapshot *snap)
+{
+    e->have_meta = (snap->files & TASK_HAS_META) != 0;
+    e->created_at = snap->meta.created_at;
+    e->execute_at = snap->meta.execute_at;
+    e->ncmds = snap->ncmds;
+    e->status = snap->status;
+}
+
+static int scan_one(const char *id, void *ctx)
+{
+    catalog *c = ctx;
+    task_snapshot snap;
+    if (store_snapshot(id, &snap) < 0)
+        return 0; // deleted mid-scan
+    catalog_entry *e = catalog_push(c);
+    if (!e)
+        return -1;
+    snprintf(e->id, sizeof(e->id), "%s", id);
+    entry_from_snapshot(e, &snap);
+    return 0;
+}
+
+/* Replace the catalog with exactly the entries in c. */
+static int write_catalog(const catalog *c)
+{
+    int base = store_base_fd();
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "catalog.tmp.%d", (int)getpid());
+    int fd = openat(base, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    FILE *f = fdopen(fd, "w");
+    if (!f)
+    {
+        close(fd);
+        unlinkat(base, tmp, 0);
+        return -1;
+    }
+    for (size_t i = 0; i < c->len; ++i)
+    {
+        char line[256];
+        if (format_add(line, sizeof(line), &c->items[i]) > 0)
+            fputs(line, f);
+    }
+    int werr = ferror(f);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+        werr = 1;
+    if (werr || renameat(base, tmp, base, "catalog") < 0)
+    {
+        fclose(f);
+        unlinkat(base, tmp, 0);
+        return -1;
+    }
+    // the rename bumped the base dir mtime; stamp the catalog after it so it reads as fresh
+    futimens(fileno(f), NULL);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* The catalog is stale if it is missing or the base dir changed after the last append. */
+static int catalog_is_stale(void)
+{
+    int base = store_base_fd();
+    struct stat cs, bs;
+    if (base < 0 || fstatat(base, "catalog", &cs, 0) < 0 || fstat(base, &bs) < 0)
+        return 1;
+    if (ST_MTIM(bs).tv_sec != ST_MTIM(cs).tv_sec)
+        return ST_MTIM(bs).tv_sec > ST_MTIM(cs).tv_sec;
+    return ST_MTIM(bs).tv_nsec > ST_MTIM(cs).tv_nsec;
+}
+
+static void catalog_clear(catalog *c)
+{
+    free(c->items);
+    memset(c, 0, sizeof(*c));
+}
+
+int catalog_load(catalog **cat)
+{
+    *cat = calloc(1, sizeof(catalog));
+    if (!*cat)
+        return -1;
+    catalog *c = *cat;
+
+    if (store_base_fd() < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (catalog_is_stale())
+    {
+        int lock_fd = lock_catalog(LOCK_EX);
+        // someone else may have rebuilt it while we waited for the lock
+        if (lock_fd < 0 || catalog_is_stale())
+        {
+            int rc = store_scan(scan_one, c);
+            if (rc == 0)
+            {
+                qsort(c->items, c->len, sizeof(*c->items), cmp_entry);
+                // read-only or full disk: still answer from the scan
+                write_catalog(c);
+            }
+            if (lock_fd >= 0)
+                close(lock_fd);
+            return rc;
+        }
+        close(lock_fd);
+    }
+
+    size_t nrec;
+    if (parse_catalog(c, &nrec) < 0)
+    {
+        catalog_clear(c);
+        if (store_scan(scan_one, c) < 0)
+            return -1;
+        qsort(c->items, c->len, sizeof(*c->items), cmp_entry);
+        return 0;
+    }
+
+    if (nrec > 2 * c->len + 64)
+    {
+        // compact; re-read under the lock so no append lands between read and rename
+        int lock_fd = lock_catalog(LOCK_EX | LOCK_NB);
+        if (lock_fd >= 0)
+        {
+            catalog fresh = {0};
+            if (parse_catalog(&fresh, &nrec) == 0 && write_catalog(&fresh) == 0)
+            {
+                catalog_clear(c);
+                *c = fresh;
+            }
+            else
+            {
+                catalog_clear(&fresh);
+            }
+            close(lock_fd);
+        }
+    }
+    return 0;
+}
+
+void catalog_free(catalog **cat)
+{
+    if (!cat || !*cat)
+        return;
+    free((*cat)->items);
+    free(*cat);
+    *cat = NULL;
+}
+
+int catalog_add(const task_meta *meta, size_t ncmds, task_status st)
+{
+    catalog_entry e = {0};
+    snprintf(e.id, sizeof(e.id), "%s", meta->id);
+    e.have_meta = 1;
+    e.created_at = meta->created_at;
+    e.execute_at = meta->execute_at;
+    e.ncmds = ncmds;
+    e.status = st;
+    char line[256];
+    int n = format_add(line, sizeof(line), &e);
+    if (n < 0)
+        return -1;
+    return append_record(line, (size_t)n, 1);
+}
+
+int catalog_set_status(const char *id, task_status st)
+{
+    char line[128];
+    int n = snprintf(line, sizeof(line), "= %s %s\n", id, store_status_name(st));
+    if (n < 0 || (size_t)n >= sizeof(line))
+        return -1;
+    return append_record(line, (size_t)n, 0);
+}
+
+int catalog_remove(const char *id)
+{
+    char line[128];
+    int n = snprintf(line, sizeof(line), "- %s\n", id);
+    if (n < 0 || (size_t)n >= sizeof(line))
+        return -1;
+    return append_record(line, (size_t)n, 1);
+}
+
+int catalog_refresh(const char *id)
+{
+    return catalog_set_status(id, store_resolve_status(id));
+}
+
+task_status catalog_entry_status(catalog_entry *e)
+{
+    if (e->have_meta && store_status_is_final(e->status))
+        return e->status;
+
+    task_snapshot snap;
+    if (store_snapshot(e->id, &snap) < 0)
+        return STATUS_FAILED;
+    if (!e->have_meta && (snap.files & TASK_HAS_META))
+    {
+        // the rebuild caught this task before its daemon wrote meta
+        entry_from_snapshot(e, &snap);
+        catalog_add(&snap.meta, snap.ncmds, snap.status);
+    }
+    else if (snap.status != e->status)
+    {
+        e->status = snap.status;
+        catalog_set_status(e->id, snap.status);
+    }
+    return snap.status;
+}
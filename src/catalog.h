@@ -0,0 +1,56 @@
+#ifndef LATER_CATALOG_H_
+#define LATER_CATALOG_H_
+
+#include "store.h"
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Append-only task index: $XDG_DATA_HOME/later/catalog, one record per line
+ *   + <id> <created_at> <execute_at> <ncmds> <status>   task created (created_at "-" if no meta)
+ *   = <id> <status>                                     last known status
+ *   - <id>                                              task deleted
+ * The last record for an id wins. Each record is written with a single O_APPEND write, and
+ * torn or unparsable lines are skipped, so a crash can only lose records, never corrupt others.
+ * The catalog is rebuilt from the task dirs when it is missing or older than the base dir,
+ * and rewritten in place once dead records outnumber live ones.
+ *
+ * catalog.lock serialises rebuilds (exclusive) against create/delete appends (shared).
+ * Status appends never wait on a rebuild: a lost one is healed the next time it is resolved.
+ */
+
+typedef struct
+{
+    char id[64];
+    int have_meta;
+    time_t created_at;
+    time_t execute_at;
+    size_t ncmds;
+    task_status status;
+} catalog_entry;
+
+typedef struct
+{
+    catalog_entry *items;
+    size_t len;
+    size_t cap;
+} catalog;
+
+/* Allocate *cat with every known task sorted by created_at (the order `later -l` numbers).
+ * *cat must be NULL on entry. Return 0 on success, -1 on failure. */
+int catalog_load(catalog **cat);
+void catalog_free(catalog **cat);
+
+int catalog_add(const task_meta *meta, size_t ncmds, task_status st);
+int catalog_set_status(const char *id, task_status st);
+int catalog_remove(const char *id);
+
+/* Record whatever store_resolve_status() currently says about id. */
+int catalog_refresh(const char *id);
+
+/* Final statuses are trusted as recorded; anything else is re-resolved from the task dir and
+ * recorded if it changed. */
+task_status catalog_entry_status(catalog_entry *e);
+
+#endif // LATER_CATALOG_H_
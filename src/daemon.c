@@ -1,62 +1,351 @@
 #include "daemon.h"
 
+#include "capture.h"
+#include "catalog.h"
 #include "exec.h"
+#include "idle.h"
+#include "queue.h"
 #include "store.h"
+#include "tasklog.h"
+#include "timefmt.h"
+#include "util.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-static void write_all(int fd, const char *data, size_t len)
+// --after: how often to re-check upstream tasks without inotify, and with it as a safety net
+#define UPSTREAM_POLL_MS 1000
+#define UPSTREAM_RECHECK_MS 60000
+
+static void report_and_exit(int ready_fd, const char *msg)
+{
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "e%s", msg);
+    if (n > 0)
+        write_all(ready_fd, buf, (size_t)n);
+    close(ready_fd);
+    _exit(1);
+}
+
+/* Send stdin to /dev/null and stdout/stderr to the task log, or to the process that writes
+ * it for --capture or --log-max. */
+static int redirect_stdio(const task_meta *meta, char *err, size_t errsz)
 {
-    size_t off = 0;
-    while (off < len)
+    int devnull_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull_fd < 0)
+    {
+        snprintf(err, errsz, "open /dev/null");
+        return -1;
+    }
+    if (dup2(devnull_fd, STDIN_FILENO) < 0)
+    {
+        close(devnull_fd);
+        snprintf(err, errsz, "dup2 stdin");
+        return -1;
+    }
+    close(devnull_fd);
+
+    int log_fd;
+    if (meta->capture)
+        log_fd = capture_start(meta->id);
+    else if (meta->log_max > 0)
+        log_fd = tasklog_start(meta->id, meta->log_policy, meta->log_max);
+    else
     {
-        ssize_t n = write(fd, data + off, len - off);
-        if (n > 0)
+        char log_path[PATH_MAX];
+        if (store_path_in_task(meta->id, "log", log_path, sizeof(log_path)) < 0)
         {
-            off += (size_t)n;
-            continue;
+            snprintf(err, errsz, "log path too long");
+            return -1;
+        }
+        log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (log_fd < 0)
+    {
+        snprintf(err, errsz, "%s", strerror(errno));
+        return -1;
+    }
+    if (dup2(log_fd, STDOUT_FILENO) < 0 || dup2(log_fd, STDERR_FILENO) < 0)
+    {
+        close(log_fd);
+        snprintf(err, errsz, "dup2 log");
+        return -1;
+    }
+    close(log_fd);
+    return 0;
+}
+
+/* Make the task dir and take its lock. Return the lock fd, or -1 with err set. */
+static int claim_task_dir(const char *id, char *err, size_t errsz)
+{
+    char dir[PATH_MAX];
+    if (store_task_dir(id, dir, sizeof(dir)) < 0)
+    {
+        snprintf(err, errsz, "task path too long");
+        return -1;
+    }
+    if (store_create_task_dir(id) < 0)
+    {
+        snprintf(err, errsz, "mkdir %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    int lock_fd = store_acquire_lock(id);
+    if (lock_fd < 0)
+        snprintf(err, errsz, "failed to acquire lock");
+    return lock_fd;
+}
+
+/* Persist meta and commands and announce the task. */
+static int persist_task(const task_meta *meta, char *const *cmds, size_t ncmds, char *err,
+                        size_t errsz)
+{
+    if (store_write_meta(meta) < 0)
+    {
+        snprintf(err, errsz, "write meta");
+        return -1;
+    }
+    if (store_write_commands(meta->id, cmds, ncmds) < 0)
+    {
+        snprintf(err, errsz, "write commands");
+        return -1;
+    }
+    // the catalog heals itself from the task dir, so a failed append is not fatal
+    catalog_add(meta, ncmds, STATUS_PENDING);
+
+    // relaxed mode skipped the per-file fsyncs above; one filesystem sync covers them all
+    if (store_get_durability() == STORE_DURABILITY_RELAXED && store_sync() < 0)
+    {
+        snprintf(err, errsz, "sync store");
+        return -1;
+    }
+    return 0;
+}
+
+static void note_command_start(size_t i, void *ctx)
+{
+    store_append_command_start((const char *)ctx, i, wall_now_us());
+}
+
+static void note_command_done(size_t i, const task_usage *u, void *ctx)
+{
+    (void)i;
+    store_append_usage((const char *)ctx, u);
+}
+
+static void note_command_groups(const pid_t *pgids, size_t n, void *ctx)
+{
+    store_write_groups((const char *)ctx, pgids, n);
+}
+
+static int open_command_output(size_t i, int *out_fd, int *err_fd, void *ctx)
+{
+    (void)ctx;
+    return capture_open_command(i, out_fd, err_fd);
+}
+
+static void flush_command_output(size_t i, void *ctx)
+{
+    (void)ctx;
+    capture_sync_command(i);
+}
+
+/* Block until every task in meta->after has reached a final status, as store_resolve_status
+ * sees it (a dead daemon counts as failed, a deleted task too). With after_ok, return -1 with
+ * msg set as soon as one of them ended any other way than completed. */
+static int wait_for_upstream(const task_meta *meta, char *msg, size_t msgsz)
+{
+    char list[sizeof(meta->after)];
+    snprintf(list, sizeof(list), "%s", meta->after);
+    const char *ids[64];
+    size_t n = 0;
+    for (char *tok = strtok(list, ","); tok && n < sizeof(ids) / sizeof(ids[0]);
+         tok = strtok(NULL, ","))
+        ids[n++] = tok;
+
+    // watch before the first check so a marker created in between still wakes us
+    int wfd = -1;
+#ifdef __linux__
+    wfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    for (size_t i = 0; wfd >= 0 && i < n; ++i)
+    {
+        char dir[PATH_MAX];
+        // markers appear as creates; a daemon that dies closes its lock (opened for writing)
+        if (store_task_dir(ids[i], dir, sizeof(dir)) == 0)
+            inotify_add_watch(wfd, dir,
+                              IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF |
+                                  IN_MOVE_SELF);
+    }
+#endif
+
+    int rc = 0;
+    for (;;)
+    {
+        size_t waiting = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            task_status st = store_resolve_status(ids[i]);
+            if (!store_status_is_final(st))
+                ++waiting;
+            else if (meta->after_ok && st != STATUS_COMPLETED)
+            {
+                snprintf(msg, msgsz, "upstream task %s %s", ids[i], store_status_name(st));
+                rc = -1;
+                break;
+            }
         }
-        if (n < 0 && errno == EINTR)
+        if (rc < 0 || waiting == 0)
+            break;
+
+        if (wfd < 0)
+        {
+            sleep_until_wall(wall_now_ms() + UPSTREAM_POLL_MS);
             continue;
-        return;
+        }
+        // the timeout only guards against a missed event; status is always re-resolved
+        struct pollfd p = {wfd, POLLIN, 0};
+        poll(&p, 1, UPSTREAM_RECHECK_MS);
+        char events[4096];
+        while (read(wfd, events, sizeof(events)) > 0)
+            ;
     }
+    if (wfd >= 0)
+        close(wfd);
+    return rc;
 }
 
-static void report_and_exit(int ready_fd, const char *msg)
+/* --when-idle: hold the start until the thresholds are met or the task has waited idle.max_s,
+ * noting either outcome in the log. */
+static void wait_for_idle(const task_meta *meta)
 {
-    char buf[512];
-    int n = snprintf(buf, sizeof(buf), "e%s", msg);
-    if (n > 0)
-        write_all(ready_fd, buf, (size_t)n);
-    close(ready_fd);
+    char why[128];
+    if (idle_check(&meta->idle, why, sizeof(why)))
+        return;
+
+    long long since = wall_now_ms();
+    fprintf(stderr, "Waiting for the system to be idle: %s\n", why);
+    int idle = idle_wait(&meta->idle, since + meta->idle.max_s * 1000LL);
+    char span[64];
+    timefmt_format_duration((long)((wall_now_ms() - since) / 1000), span, sizeof(span));
+    if (idle)
+        fprintf(stderr, "System idle after %s\n", span);
+    else
+        fprintf(stderr, "Still busy after %s, starting anyway\n", span);
+    store_append_timing(meta->id, "released_us", wall_now_us());
+}
+
+/* Take a slot in the task's queue, showing it as queued while it has to wait. The slot is
+ * held until the daemon exits. Return 0 once held, -1 on error. */
+static int wait_for_slot(const task_meta *meta)
+{
+    long long due_ms = (long long)meta->execute_at * 1000 + meta->execute_ms;
+    int rc = queue_try_acquire(meta->queue, meta->id, meta->priority, due_ms);
+    if (rc <= 0)
+        return rc;
+
+    store_create_marker(meta->id, "queued");
+    catalog_set_status(meta->id, STATUS_QUEUED);
+    rc = queue_acquire(meta->queue, meta->id, meta->priority, due_ms);
+    store_remove_marker(meta->id, "queued");
+    if (rc == 0)
+        store_append_timing(meta->id, "released_us", wall_now_us());
+    return rc;
+}
+
+/* The task ends before its first command: say why in the log, let the --log-max writer or
+ * capture process store it, then record the failure. Never returns. */
+static void fail_not_started(const task_meta *meta, int lock_fd, const char *msg)
+{
+    fprintf(stderr, "Not started: %s\n", msg);
+    tasklog_finish();
+    capture_finish();
+    store_create_marker_with_content(meta->id, "error", msg);
+    catalog_set_status(meta->id, STATUS_FAILED);
+    close(lock_fd);
     _exit(1);
 }
 
-// sleep until the wall-clock deadline
-static void sleep_until_wall(time_t deadline)
+/* Run the commands once execute_at has come and record the outcome. Never returns. */
+static void execute_task(const task_meta *meta, char *const *cmds, size_t ncmds, int lock_fd)
 {
-    while (1)
+    sleep_until_wall((long long)meta->execute_at * 1000 + meta->execute_ms);
+
+    if (meta->after[0])
     {
-        time_t now = time(NULL);
-        if (now >= deadline)
-            return;
-        struct timespec ts;
-        ts.tv_sec = deadline - now;
-        ts.tv_nsec = 0;
-        nanosleep(&ts, NULL);
+        char msg[512];
+        if (wait_for_upstream(meta, msg, sizeof(msg)) < 0)
+            fail_not_started(meta, lock_fd, msg);
+        // lag is measured from whichever came last, the scheduled time or this
+        store_append_timing(meta->id, "released_us", wall_now_us());
+    }
+
+    // wait for a quiet machine before taking a queue slot, so a deferred task holds none
+    if (meta->idle.max_s > 0)
+        wait_for_idle(meta);
+
+    if (meta->queue[0] && wait_for_slot(meta) < 0)
+        fail_not_started(meta, lock_fd, "failed to join queue");
+
+    // the start time is what lag is measured against, so take it before any other work
+    store_append_timing(meta->id, "start_us", wall_now_us());
+
+    // mark running before the first command starts
+    if (store_create_marker(meta->id, "running") < 0)
+        fail_not_started(meta, lock_fd, "failed to create running marker");
+    catalog_set_status(meta->id, STATUS_RUNNING);
+
+    const exec_hooks hooks = {note_command_start, note_command_done,
+                              meta->capture ? open_command_output : NULL,
+                              meta->capture ? flush_command_output : NULL, note_command_groups,
+                              (void *)meta->id};
+    int rc = exec_run_commands(cmds, ncmds, meta->cwd, meta->parallel, meta->one_shell,
+                               &hooks);
+    int exec_errno = errno;
+
+    queue_release();
+    // the log is complete before the task shows as finished; it is compressed after that, so
+    // the status is not held up by it, unless a background child is still writing to it
+    int log_done = tasklog_finish() == 0;
+    log_done = capture_finish() == 0 && log_done;
+    if (rc == 0)
+    {
+        store_create_marker(meta->id, "done");
+        catalog_set_status(meta->id, STATUS_COMPLETED);
+        if (log_done)
+            tasklog_compress(meta->id, NULL, NULL);
+        close(lock_fd);
+        _exit(0);
+    }
+    else
+    {
+        char msg[256];
+        if (rc < 0)
+            snprintf(msg, sizeof(msg), "execution error: %s", strerror(exec_errno));
+        else
+            snprintf(msg, sizeof(msg), "Exit code: %d", rc);
+        store_create_marker_with_content(meta->id, "error", msg);
+        catalog_set_status(meta->id, STATUS_FAILED);
+        if (log_done)
+            tasklog_compress(meta->id, NULL, NULL);
+        close(lock_fd);
+        _exit(1);
     }
 }
 
-void daemon_run(task_meta meta, char *const *cmds, size_t ncmds, int ready_fd)
+void daemon_run(task_meta meta, char *const *cmds, size_t ncmds, int ready_fd,
+                long long spawned_us)
 {
     if (setsid() < 0)
         report_and_exit(ready_fd, strerror(errno));
@@ -74,80 +363,94 @@ void daemon_run(task_meta meta, char *const *cmds, size_t ncmds, int ready_fd)
     // own a process group
     setpgid(0, 0);
 
-    // make the task directory
-    char dir[PATH_MAX];
-    if (store_task_dir(meta.id, dir, sizeof(dir)) < 0)
-        report_and_exit(ready_fd, "task path too long");
-    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
-    {
-        char msg[PATH_MAX + 64];
-        snprintf(msg, sizeof(msg), "mkdir %s: %s", dir, strerror(errno));
-        report_and_exit(ready_fd, msg);
-    }
-
-    int lock_fd = store_acquire_lock(meta.id);
+    char err[PATH_MAX + 64];
+    int lock_fd = claim_task_dir(meta.id, err, sizeof(err));
     if (lock_fd < 0)
-        report_and_exit(ready_fd, "failed to acquire lock");
+        report_and_exit(ready_fd, err);
 
     if (chdir("/") < 0)
         report_and_exit(ready_fd, strerror(errno));
     umask(0022);
 
-    // redirect stdin to /dev/null
-    int devnull_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
-    if (devnull_fd < 0)
-        report_and_exit(ready_fd, "open /dev/null");
-    if (dup2(devnull_fd, STDIN_FILENO) < 0)
-        report_and_exit(ready_fd, "dup2 stdin");
-    close(devnull_fd);
-    // redirect stdout/stderr to log file
-    char log_path[PATH_MAX];
-    if (store_path_in_task(meta.id, "log", log_path, sizeof(log_path)) < 0)
-        report_and_exit(ready_fd, "log path too long");
-    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
-    if (log_fd < 0)
-        report_and_exit(ready_fd, strerror(errno));
-    if (dup2(log_fd, STDOUT_FILENO) < 0 || dup2(log_fd, STDERR_FILENO) < 0)
-        report_and_exit(ready_fd, "dup2 log");
-    close(log_fd);
-
-    // persist meta and commands
-    if (store_write_meta(&meta) < 0)
-        report_and_exit(ready_fd, "write meta");
-    if (store_write_commands(meta.id, cmds, ncmds) < 0)
-        report_and_exit(ready_fd, "write commands");
+    if (redirect_stdio(&meta, err, sizeof(err)) < 0 ||
+        persist_task(&meta, cmds, ncmds, err, sizeof(err)) < 0)
+        report_and_exit(ready_fd, err);
 
     // readiness
+    store_append_timing(meta.id, "ready_us", mono_now_us() - spawned_us);
     write_all(ready_fd, "k", 1);
     close(ready_fd);
 
-    sleep_until_wall(meta.execute_at);
+    execute_task(&meta, cmds, ncmds, lock_fd);
+}
 
-    // mark running before the first command starts
-    if (store_create_marker(meta.id, "running") < 0)
+int daemon_prepare_supervised(task_meta *meta, char *const *cmds, size_t ncmds, char *err,
+                              size_t errsz)
+{
+    meta->daemon_pid = 0;
+    meta->supervised = 1;
+    int lock_fd = claim_task_dir(meta->id, err, errsz);
+    if (lock_fd < 0)
+        return -1;
+
+    // --log works before the task fires, as it does for a daemon-backed task
+    char log_path[PATH_MAX];
+    int log_fd = -1;
+    if (store_path_in_task(meta->id, "log", log_path, sizeof(log_path)) == 0)
+        log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd >= 0)
+        close(log_fd);
+
+    if (persist_task(meta, cmds, ncmds, err, errsz) < 0)
     {
-        store_create_marker_with_content(meta.id, "error", "failed to create running marker");
         close(lock_fd);
-        _exit(1);
+        return -1;
     }
+    return lock_fd;
+}
 
-    int rc = exec_run_commands(cmds, ncmds, meta.cwd);
+void daemon_run_supervised(const char *id, int lock_fd)
+{
+    setsid();
 
-    if (rc == 0)
+    // the supervisor ignores these; commands should not inherit that
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+
+    task_meta meta;
+    strvec *cmds = NULL;
+    if (store_read_meta(id, &meta) < 0 || store_read_commands(id, &cmds) < 0)
     {
-        store_create_marker(meta.id, "done");
-        close(lock_fd);
-        _exit(0);
+        store_create_marker_with_content(id, "error", "cannot read task");
+        catalog_set_status(id, STATUS_FAILED);
+        _exit(1);
     }
-    else
+
+    // from here on the task is signalled through its own process group like any other
+    meta.daemon_pid = getpid();
+    if (store_write_meta(&meta) < 0)
     {
-        char msg[256];
-        if (rc < 0)
-            snprintf(msg, sizeof(msg), "execution error: %s", strerror(errno));
-        else
-            snprintf(msg, sizeof(msg), "Exit code: %d", rc);
-        store_create_marker_with_content(meta.id, "error", msg);
-        close(lock_fd);
+        store_create_marker_with_content(id, "error", "write meta");
+        catalog_set_status(id, STATUS_FAILED);
+        _exit(1);
+    }
+    // a cancel that raced the hand-over already recorded its marker
+    if (store_has_marker(id, "cancel") == 1)
+        _exit(0);
+
+    char err[PATH_MAX + 64];
+    if (chdir("/") < 0 || redirect_stdio(&meta, err, sizeof(err)) < 0)
+    {
+        store_create_marker_with_content(id, "error", "cannot set up task output");
+        catalog_set_status(id, STATUS_FAILED);
         _exit(1);
     }
+    umask(0022);
+
+    // handed back while paused: stay frozen like a paused daemon until --resume
+    if (store_has_marker(id, "pause") == 1)
+        raise(SIGSTOP);
+
+    execute_task(&meta, cmds->items, cmds->len, lock_fd);
 }
@@ -3,6 +3,18 @@
 
 #include "store.h"
 
-void daemon_run(task_meta meta, char *const *cmds, size_t ncmds, int ready_fd);
+/* Become meta's daemon and report readiness on ready_fd. spawned_us is mono_now_us() taken
+ * just before the fork, so the daemon can record how long the task took to become ready. */
+void daemon_run(task_meta meta, char *const *cmds, size_t ncmds, int ready_fd,
+                long long spawned_us);
+
+/* Create a task the supervisor will run: write its dir, meta (supervised, no daemon pid) and
+ * commands. Return the held lock fd to hand over, or -1 with err set. */
+int daemon_prepare_supervised(task_meta *meta, char *const *cmds, size_t ncmds, char *err,
+                              size_t errsz);
+
+/* Runner forked by the supervisor: become the task's daemon (own session, pid in meta) and
+ * run it once execute_at has passed, keeping lock_fd. Never returns. */
+void daemon_run_supervised(const char *id, int lock_fd);
 
 #endif // LATER_DAEMON_H_
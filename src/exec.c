@@ -1,60 +1,337 @@
+#ifdef __linux__
+#define _GNU_SOURCE // posix_spawn_file_actions_addchdir_np
+#endif
+
 #include "exec.h"
 
 #include "timefmt.h"
+#include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-static int run_one(const char *cmd, const char *cwd)
+extern char **environ;
+
+// characters that make sh do more than run one program with literal arguments
+static const char k_shell_chars[] = "|&;<>()$`\\*?[]#~{}!\n";
+
+// first words sh runs itself, or reads as syntax rather than as a program to start; the
+// builtins that also exist in PATH (echo, printf, test, ...) are here too, since the binaries
+// differ from them (/bin/echo takes -e, dash's echo prints it)
+static const char *const k_shell_words[] = {
+    "!",      "{",      "}",        "case",    "do",      "done",     "elif",    "else",
+    "esac",   "fi",     "for",      "if",      "in",      "then",     "until",   "while",
+    ".",      ":",      "[",        "alias",   "bg",      "break",    "cd",      "command",
+    "continue", "echo", "eval",     "exec",    "exit",    "export",   "false",   "fc",
+    "fg",     "getopts", "hash",    "jobs",    "kill",    "local",    "printf",  "pwd",
+    "read",   "readonly", "return", "set",     "shift",   "source",   "test",    "times",
+    "trap",   "true",   "type",     "ulimit",  "umask",   "unalias",  "unset",   "wait",
+    NULL};
+
+// written from SIGCHLD so the parallel loop's poll() wakes when a command exits
+static int g_child_pipe[2] = {-1, -1};
+
+static void on_sigchld(int sig)
 {
-    pid_t pid = fork();
-    if (pid < 0)
+    (void)sig;
+    int saved = errno;
+    ssize_t r = write(g_child_pipe[1], "c", 1);
+    (void)r;
+    errno = saved;
+}
+
+static int open_child_pipe(void)
+{
+    if (pipe(g_child_pipe) < 0)
         return -1;
-    if (pid == 0)
+    for (int k = 0; k < 2; ++k)
+    {
+        fcntl(g_child_pipe[k], F_SETFD, FD_CLOEXEC);
+        fcntl(g_child_pipe[k], F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+static void close_child_pipe(void)
+{
+    close(g_child_pipe[0]);
+    close(g_child_pipe[1]);
+    g_child_pipe[0] = g_child_pipe[1] = -1;
+}
+
+static long long tv_us(struct timeval tv)
+{
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void fill_usage(task_usage *u, const struct rusage *ru)
+{
+    u->user_us = tv_us(ru->ru_utime);
+    u->sys_us = tv_us(ru->ru_stime);
+#ifdef __APPLE__
+    u->max_rss_kb = ru->ru_maxrss / 1024; // bytes on macOS
+#else
+    u->max_rss_kb = ru->ru_maxrss;
+#endif
+    u->major_faults = ru->ru_majflt;
+    u->vol_cs = ru->ru_nvcsw;
+    u->invol_cs = ru->ru_nivcsw;
+    u->in_blocks = ru->ru_inblock;
+    u->out_blocks = ru->ru_oublock;
+}
+
+/* Split cmd into argv (words stored in buf, which needs strlen(cmd) + 1 bytes) if sh would
+ * just run one program with those arguments: words, '...' and "..." without $, ` or \ in
+ * them, no other shell syntax and no builtin or keyword first. Return argc, or 0 if cmd
+ * needs the shell. */
+static size_t split_simple(const char *cmd, char *buf, char **argv, size_t max)
+{
+    size_t argc = 0;
+    char *out = buf;
+    const char *p = cmd;
+    for (;;)
     {
-        if (cwd && cwd[0] && chdir(cwd) < 0)
+        while (*p == ' ' || *p == '\t')
+            ++p;
+        if (!*p)
+            break;
+        if (argc + 1 >= max)
+            return 0;
+        argv[argc++] = out;
+        while (*p && *p != ' ' && *p != '\t')
         {
-            fprintf(stderr, "Failed to chdir to %s: %s\n", cwd, strerror(errno));
-            _exit(126);
+            if (*p == '\'')
+            {
+                const char *end = strchr(p + 1, '\'');
+                if (!end)
+                    return 0;
+                memcpy(out, p + 1, (size_t)(end - p - 1));
+                out += end - p - 1;
+                p = end + 1;
+            }
+            else if (*p == '"')
+            {
+                for (++p; *p != '"'; ++p)
+                {
+                    if (!*p || strchr("$`\\!", *p))
+                        return 0;
+                    *out++ = *p;
+                }
+                ++p;
+            }
+            else
+            {
+                // NAME=value before the program is an assignment
+                if (strchr(k_shell_chars, *p) || (argc == 1 && *p == '='))
+                    return 0;
+                *out++ = *p++;
+            }
         }
-        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
-        fprintf(stderr, "Failed to exec /bin/sh: %s\n", strerror(errno));
-        _exit(127);
+        *out++ = '\0';
+    }
+    argv[argc] = NULL;
+    if (argc == 0)
+        return 0;
+    for (size_t i = 0; k_shell_words[i]; ++i)
+    {
+        if (strcmp(argv[0], k_shell_words[i]) == 0)
+            return 0;
     }
+    return argc;
+}
 
-    int status;
-    while (waitpid(pid, &status, 0) < 0)
+/* How start_one sets up a -j command: a process group of its own, and the signal mask to
+ * start with (run_parallel holds off termination signals while it launches). */
+typedef struct
+{
+    int own_group;
+    const sigset_t *mask;
+} start_opts;
+
+/* posix_spawnp cmd without a shell if split_simple allows it. Return the pid, or -1 if cmd
+ * needs the shell or could not be spawned this way (the shell then reports why). */
+static pid_t spawn_direct(const char *cmd, const char *cwd, int out_fd, int err_fd,
+                          const start_opts *so)
+{
+    size_t len = strlen(cmd);
+    size_t max = len / 2 + 2;
+    char *buf = malloc(len + 1);
+    char **argv = malloc(max * sizeof(*argv));
+    pid_t pid = -1;
+    if (buf && argv && split_simple(cmd, buf, argv, max) > 0)
     {
-        if (errno != EINTR)
-            return -1;
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        if (posix_spawnattr_init(&attr) == 0 && posix_spawn_file_actions_init(&fa) == 0)
+        {
+            int ok = 1;
+            if (out_fd >= 0)
+                ok = posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO) == 0 &&
+                     posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO) == 0 &&
+                     (out_fd <= STDERR_FILENO ||
+                      posix_spawn_file_actions_addclose(&fa, out_fd) == 0) &&
+                     (err_fd <= STDERR_FILENO || err_fd == out_fd ||
+                      posix_spawn_file_actions_addclose(&fa, err_fd) == 0);
+            if (ok && cwd && cwd[0])
+                ok = posix_spawn_file_actions_addchdir_np(&fa, cwd) == 0;
+            if (ok && so)
+            {
+                short flags = (short)((so->own_group ? POSIX_SPAWN_SETPGROUP : 0) |
+                                      (so->mask ? POSIX_SPAWN_SETSIGMASK : 0));
+                ok = posix_spawnattr_setflags(&attr, flags) == 0 &&
+                     posix_spawnattr_setpgroup(&attr, 0) == 0 &&
+                     (!so->mask || posix_spawnattr_setsigmask(&attr, so->mask) == 0);
+            }
+            if (ok && posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ) != 0)
+                pid = -1;
+            posix_spawn_file_actions_destroy(&fa);
+            posix_spawnattr_destroy(&attr);
+        }
     }
+    free(buf);
+    free(argv);
+    return pid;
+}
+
+/* Start cmd in cwd, directly when it has no shell syntax and via `sh -c` otherwise; with
+ * out_fd >= 0 its stdout goes there and its stderr to err_fd. so may be NULL. */
+static pid_t start_one(const char *cmd, const char *cwd, int out_fd, int err_fd,
+                       const start_opts *so)
+{
+    // one process instead of two: sh would only have exec'd the program anyway
+    pid_t pid = spawn_direct(cmd, cwd, out_fd, err_fd, so);
+    if (pid > 0)
+        return pid;
+
+    pid = fork();
+    if (pid != 0)
+    {
+        // both sides set the group, so it is in place whichever runs first
+        if (pid > 0 && so && so->own_group)
+            setpgid(pid, pid);
+        return pid;
+    }
+
+    if (so && so->own_group)
+        setpgid(0, 0);
+    if (so && so->mask)
+        sigprocmask(SIG_SETMASK, so->mask, NULL);
+
+    if (out_fd >= 0)
+    {
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        if (out_fd > STDERR_FILENO)
+            close(out_fd);
+        if (err_fd > STDERR_FILENO && err_fd != out_fd)
+            close(err_fd);
+    }
+    if (cwd && cwd[0] && chdir(cwd) < 0)
+    {
+        fprintf(stderr, "Failed to chdir to %s: %s\n", cwd, strerror(errno));
+        _exit(126);
+    }
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    fprintf(stderr, "Failed to exec /bin/sh: %s\n", strerror(errno));
+    _exit(127);
+}
+
+/* Exit code of a reaped command, 128 + signal for a killed one. */
+static int exit_code(int status, const char *prefix)
+{
     if (WIFEXITED(status))
         return WEXITSTATUS(status);
     if (WIFSIGNALED(status))
     {
         int sig = WTERMSIG(status);
-        fprintf(stderr, "Command killed by signal %d\n", sig);
+        fprintf(stderr, "%sCommand killed by signal %d\n", prefix, sig);
         return 128 + sig;
     }
     return -1;
 }
 
-int exec_run_commands(char *const *cmds, size_t n, const char *cwd)
+static void print_progress(size_t i, size_t n, const char *cmd)
+{
+    char buf[64];
+    timefmt_format_time(time(NULL), buf, sizeof(buf));
+    printf("[%s] [%zu/%zu] %s\n", buf, i + 1, n, cmd);
+    fflush(stdout);
+}
+
+/* Ask the hooks for command i's own stdout and stderr; -1 in both to share ours. */
+static void open_output(const exec_hooks *hooks, size_t i, int *out_fd, int *err_fd)
+{
+    *out_fd = *err_fd = -1;
+    if (hooks && hooks->open_output && hooks->open_output(i, out_fd, err_fd, hooks->ctx) < 0)
+        *out_fd = *err_fd = -1;
+}
+
+static void close_output(int out_fd, int err_fd)
+{
+    if (out_fd >= 0)
+        close(out_fd);
+    if (err_fd >= 0 && err_fd != out_fd)
+        close(err_fd);
+}
+
+/* Run cmd and fill u; wait4 reports its usage including every descendant it reaped. */
+static int run_one(const char *cmd, const char *cwd, int out_fd, int err_fd, task_usage *u,
+                   const exec_hooks *hooks)
+{
+    long long began = mono_now_us();
+    pid_t pid = start_one(cmd, cwd, out_fd, err_fd, NULL);
+    int saved = errno;
+    close_output(out_fd, err_fd);
+    if (pid < 0)
+    {
+        errno = saved;
+        return -1;
+    }
+
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    u->wall_us = mono_now_us() - began;
+    fill_usage(u, &ru);
+    if (hooks && hooks->on_exited)
+        hooks->on_exited(u->cmd, hooks->ctx);
+    return exit_code(status, "");
+}
+
+static int run_sequential(char *const *cmds, size_t n, const char *cwd, const exec_hooks *hooks)
 {
     for (size_t i = 0; i < n; ++i)
     {
-        char buf[64];
-        timefmt_format_time(time(NULL), buf, sizeof(buf));
-        printf("[%s] [%zu/%zu] %s\n", buf, i + 1, n, cmds[i]);
-        fflush(stdout);
+        print_progress(i, n, cmds[i]);
 
-        int rc = run_one(cmds[i], cwd);
+        if (hooks && hooks->on_start)
+            hooks->on_start(i, hooks->ctx);
+        task_usage u = {0};
+        u.cmd = i;
+        int out_fd, err_fd;
+        open_output(hooks, i, &out_fd, &err_fd);
+        int rc = run_one(cmds[i], cwd, out_fd, err_fd, &u, hooks);
         if (rc < 0)
             return -1;
+        u.exit_code = rc;
+        if (hooks && hooks->on_done)
+            hooks->on_done(i, &u, hooks->ctx);
         if (rc != 0)
         {
             fprintf(stderr, "Command failed with exit code: %d\n", rc);
@@ -62,13 +339,392 @@ int exec_run_commands(char *const *cmds, size_t n, const char *cwd)
             return rc;
         }
     }
+    return 0;
+}
+
+/*
+ * One shell for the whole task: sh reads one command per line from a pipe, evals it with
+ * the pipes closed, and writes its status as a line to a second pipe, which is what we wait
+ * on. cd, variables and functions carry over from one command to the next, and the commands'
+ * stdin stays the daemon's. Only the shell is a child of ours, so the per-command usage
+ * has wall time and exit code alone.
+ */
+static int run_in_shell(char *const *cmds, size_t n, const char *cwd, const exec_hooks *hooks)
+{
+    int in[2], st[2];
+    if (pipe(in) < 0)
+        return -1;
+    if (pipe(st) < 0)
+    {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    // only the shell's ends may reach it
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(st[0], F_SETFD, FD_CLOEXEC);
+
+    char script[256];
+    snprintf(script, sizeof(script),
+             "while IFS= read -r __later_cmd <&%d; do eval \"$__later_cmd\" %d<&- %d>&-; "
+             "echo $? >&%d; done",
+             in[0], in[0], st[1], st[1]);
+    pid_t pid = start_one(script, cwd, -1, -1, NULL);
+    close(in[0]);
+    close(st[1]);
+    FILE *status = pid > 0 ? fdopen(st[0], "r") : NULL;
+    if (!status)
+    {
+        if (pid > 0)
+            kill(pid, SIGKILL);
+        close(st[0]);
+        close(in[1]);
+        return -1;
+    }
+
+    // a shell that exited must not take the daemon with it when we write the next command
+    struct sigaction ign, old_pipe;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGPIPE, &ign, &old_pipe);
+
+    int rc = 0;
+    size_t i;
+    task_usage u = {0};
+    for (i = 0; i < n; ++i)
+    {
+        print_progress(i, n, cmds[i]);
+        if (hooks && hooks->on_start)
+            hooks->on_start(i, hooks->ctx);
+        memset(&u, 0, sizeof(u));
+        u.cmd = i;
+        long long began = mono_now_us();
+
+        char line[32];
+        if (write_all(in[1], cmds[i], strlen(cmds[i])) < 0 || write_all(in[1], "\n", 1) < 0 ||
+            !fgets(line, sizeof(line), status))
+        {
+            u.wall_us = mono_now_us() - began;
+            break; // the shell is gone (`exit`, a syntax error...); its status is this command's
+        }
+        u.wall_us = mono_now_us() - began;
+        rc = u.exit_code = (int)strtol(line, NULL, 10);
+        if (hooks && hooks->on_done)
+            hooks->on_done(i, &u, hooks->ctx);
+        if (rc != 0)
+            break;
+    }
+
+    // EOF ends the read loop
+    close(in[1]);
+    int wstatus;
+    pid_t r;
+    while ((r = waitpid(pid, &wstatus, 0)) < 0 && errno == EINTR)
+        ;
+    fclose(status);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+
+    if (i < n && rc == 0)
+    {
+        rc = r == pid ? exit_code(wstatus, "") : -1;
+        u.exit_code = rc;
+        if (hooks && hooks->on_done)
+            hooks->on_done(i, &u, hooks->ctx);
+        if (rc == 0 && i + 1 < n)
+        {
+            fprintf(stderr, "Shell exited after command %zu of %zu\n", i + 1, n);
+            rc = 1;
+        }
+    }
+    if (rc > 0)
+    {
+        fprintf(stderr, "Command failed with exit code: %d\n", rc);
+        fflush(stderr);
+    }
+    return rc;
+}
+
+int exec_is_barrier(const char *cmd)
+{
+    while (*cmd == ' ' || *cmd == '\t')
+        ++cmd;
+    if (strncmp(cmd, "wait", 4) != 0)
+        return 0;
+    for (cmd += 4; *cmd == ' ' || *cmd == '\t'; ++cmd)
+        ;
+    return *cmd == '\0';
+}
+
+/* One command of a parallel group, its output arriving on a pipe. */
+typedef struct
+{
+    size_t idx;
+    pid_t pid;
+    int fd; // -1 once the pipe is closed
+    long long began;
+    size_t len; // bytes of an unfinished line in buf
+    char buf[4096];
+} slot;
+
+/* Copy complete lines from s->buf to the log as "[i] line"; with flush, the rest as well. */
+static void emit_lines(slot *s, int flush)
+{
+    char prefix[32];
+    int plen = snprintf(prefix, sizeof(prefix), "[%zu] ", s->idx + 1);
+    size_t off = 0;
+    while (off < s->len)
+    {
+        char *nl = memchr(s->buf + off, '\n', s->len - off);
+        // a line longer than the whole buffer is cut rather than held back
+        if (!nl && !flush && (off > 0 || s->len < sizeof(s->buf)))
+            break;
+        size_t end = nl ? (size_t)(nl - s->buf) + 1 : s->len;
+        write_all(STDOUT_FILENO, prefix, (size_t)plen);
+        write_all(STDOUT_FILENO, s->buf + off, end - off);
+        if (!nl)
+            write_all(STDOUT_FILENO, "\n", 1);
+        off = end;
+    }
+    memmove(s->buf, s->buf + off, s->len - off);
+    s->len -= off;
+}
 
-    if (n > 0)
+/* Read what the command has written and close the pipe at EOF. With drain the command has
+ * exited: stop at the first would-block too, since whatever still holds the pipe open (a
+ * background child) is not waited for. */
+static void read_output(slot *s, int drain)
+{
+    while (s->fd >= 0)
+    {
+        ssize_t r = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+        if (r > 0)
+        {
+            s->len += (size_t)r;
+            emit_lines(s, 0);
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !drain)
+            return;
+        close(s->fd);
+        s->fd = -1;
+    }
+    emit_lines(s, 1);
+}
+
+static int launch(slot *s, size_t i, char *const *cmds, size_t n, const char *cwd,
+                  const exec_hooks *hooks, const start_opts *so)
+{
+    print_progress(i, n, cmds[i]);
+    if (hooks && hooks->on_start)
+        hooks->on_start(i, hooks->ctx);
+    s->idx = i;
+    s->len = 0;
+    s->fd = -1;
+    s->began = mono_now_us();
+
+    // output the hooks take care of needs no "[i] " prefix from us
+    int out_fd, err_fd, saved;
+    open_output(hooks, i, &out_fd, &err_fd);
+    if (out_fd >= 0)
+    {
+        s->pid = start_one(cmds[i], cwd, out_fd, err_fd, so);
+        saved = errno;
+        close_output(out_fd, err_fd);
+        errno = saved;
+        return s->pid < 0 ? -1 : 0;
+    }
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+        return -1;
+    // keep a sibling's pipe from leaking into this command, which would hold it open
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    s->pid = start_one(cmds[i], cwd, pipefd[1], pipefd[1], so);
+    saved = errno;
+    close(pipefd[1]);
+    if (s->pid < 0)
+    {
+        close(pipefd[0]);
+        errno = saved;
+        return -1;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    s->fd = pipefd[0];
+    return 0;
+}
+
+/* Tell the hooks which process groups are running now. */
+static void report_groups(const slot *slots, size_t active, const exec_hooks *hooks)
+{
+    if (!hooks || !hooks->on_groups)
+        return;
+    pid_t pgids[TASK_MAX_PARALLEL];
+    for (size_t k = 0; k < active; ++k)
+        pgids[k] = slots[k].pid;
+    hooks->on_groups(pgids, active, hooks->ctx);
+}
+
+/* SIGTERM the process groups of every command still running but one (SIZE_MAX for none). */
+static void stop_others(const slot *slots, size_t active, size_t except)
+{
+    for (size_t j = 0; j < active; ++j)
+        if (j != except)
+            kill(-slots[j].pid, SIGTERM);
+}
+
+/*
+ * Commands between barriers run up to `parallel` at a time, each line of their output
+ * prefixed with the command's number. Each command leads a process group of its own, listed
+ * through hooks->on_groups so that signals for the task can reach it. The first failure stops
+ * further launches and sends SIGTERM to the groups still running, which also reaches what
+ * `sh -c "a; b"` started; they are reaped before the failure is returned.
+ */
+static int run_parallel(char *const *cmds, size_t n, const char *cwd, int parallel,
+                        const exec_hooks *hooks)
+{
+    slot *slots = calloc((size_t)parallel, sizeof(*slots));
+    struct pollfd *pfds = calloc((size_t)parallel + 1, sizeof(*pfds));
+    if (!slots || !pfds || open_child_pipe() < 0)
+    {
+        free(slots);
+        free(pfds);
+        return -1;
+    }
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, &old_sa);
+
+    // a cancel between starting a command and listing its group would miss the command; hold
+    // it off until the list is written, and start the commands with the mask we run with
+    sigset_t hold, run_mask;
+    sigemptyset(&hold);
+    sigaddset(&hold, SIGTERM);
+    sigaddset(&hold, SIGINT);
+    sigaddset(&hold, SIGHUP);
+    sigprocmask(SIG_SETMASK, NULL, &run_mask);
+    const start_opts so = {1, &run_mask};
+
+    size_t next = 0, active = 0;
+    int failed = 0, fail_errno = 0;
+    for (;;)
+    {
+        size_t launched = active;
+        sigprocmask(SIG_BLOCK, &hold, NULL);
+        while (!failed && next < n && active < (size_t)parallel)
+        {
+            if (exec_is_barrier(cmds[next]))
+            {
+                if (active > 0)
+                    break; // the group before the barrier has to finish first
+                // it keeps its place in the [i/n] lines like any other command
+                print_progress(next, n, cmds[next]);
+                ++next;
+                continue;
+            }
+            if (launch(&slots[active], next, cmds, n, cwd, hooks, &so) < 0)
+            {
+                fail_errno = errno;
+                fprintf(stderr, "[%zu] Failed to start: %s\n", next + 1, strerror(fail_errno));
+                failed = -1;
+                stop_others(slots, active, SIZE_MAX);
+                break;
+            }
+            ++active;
+            ++next;
+        }
+        if (active != launched)
+            report_groups(slots, active, hooks);
+        sigprocmask(SIG_SETMASK, &run_mask, NULL);
+        if (active == 0)
+            break;
+
+        nfds_t npfd = 0;
+        pfds[npfd++] = (struct pollfd){.fd = g_child_pipe[0], .events = POLLIN};
+        for (size_t k = 0; k < active; ++k)
+            if (slots[k].fd >= 0)
+                pfds[npfd++] = (struct pollfd){.fd = slots[k].fd, .events = POLLIN};
+        poll(pfds, npfd, -1);
+        char drain[64];
+        while (read(g_child_pipe[0], drain, sizeof(drain)) > 0)
+            ;
+        for (size_t k = 0; k < active; ++k)
+            read_output(&slots[k], 0);
+
+        // walk backwards so finished slots can be swapped out with the last one
+        size_t before = active;
+        for (size_t k = active; k-- > 0;)
+        {
+            slot *s = &slots[k];
+            int status;
+            struct rusage ru;
+            pid_t r = wait4(s->pid, &status, WNOHANG, &ru);
+            if (r == 0 || (r < 0 && errno == EINTR))
+                continue;
+            if (r < 0 && !failed)
+                fail_errno = errno;
+            read_output(s, 1);
+            if (hooks && hooks->on_exited)
+                hooks->on_exited(s->idx, hooks->ctx);
+
+            char prefix[32];
+            snprintf(prefix, sizeof(prefix), "[%zu] ", s->idx + 1);
+            int rc = -1;
+            if (r > 0)
+            {
+                task_usage u = {0};
+                u.cmd = s->idx;
+                u.wall_us = mono_now_us() - s->began;
+                fill_usage(&u, &ru);
+                rc = u.exit_code = exit_code(status, prefix);
+                if (hooks && hooks->on_done)
+                    hooks->on_done(s->idx, &u, hooks->ctx);
+            }
+            if (rc != 0 && !failed)
+            {
+                failed = rc;
+                fprintf(stderr, "%sCommand failed with exit code: %d\n", prefix, rc);
+                if (active > 1)
+                    fprintf(stderr, "Stopping %zu other running command(s)\n", active - 1);
+                fflush(stderr);
+                stop_others(slots, active, k);
+            }
+            slots[k] = slots[--active];
+        }
+        if (active != before)
+            report_groups(slots, active, hooks);
+    }
+    sigaction(SIGCHLD, &old_sa, NULL);
+    close_child_pipe();
+    free(slots);
+    free(pfds);
+    // the daemon reports why a command could not be started or waited for
+    if (failed == -1)
+        errno = fail_errno;
+    return failed;
+}
+
+int exec_run_commands(char *const *cmds, size_t n, const char *cwd, int parallel, int one_shell,
+                      const exec_hooks *hooks)
+{
+    int rc;
+    if (one_shell)
+        rc = run_in_shell(cmds, n, cwd, hooks);
+    else if (parallel > 1)
+        rc = run_parallel(cmds, n, cwd, parallel, hooks);
+    else
+        rc = run_sequential(cmds, n, cwd, hooks);
+    if (rc == 0 && n > 0)
     {
         char buf[64];
         timefmt_format_time(time(NULL), buf, sizeof(buf));
         printf("[%s] All commands completed successfully\n", buf);
         fflush(stdout);
     }
-    return 0;
+    return rc;
 }
@@ -1,11 +1,41 @@
 #ifndef LATER_EXEC_H_
 #define LATER_EXEC_H_
 
+#include "store.h"
+
 #include <stddef.h>
+#include <sys/types.h>
+
+/* Optional callbacks around each command (0-based index i); any member may be NULL. */
+typedef struct
+{
+    void (*on_start)(size_t i, void *ctx);
+    // u has the command's exit code, wall time and rusage as reported by wait4
+    void (*on_done)(size_t i, const task_usage *u, void *ctx);
+    // give the command its own stdout and stderr (closed here once it has started); return -1
+    // to have it share ours
+    int (*open_output)(size_t i, int *out_fd, int *err_fd, void *ctx);
+    // the command has been reaped; nothing has been said yet about how it ended
+    void (*on_exited)(size_t i, void *ctx);
+    // with parallel > 1: the process groups of the commands running now, each time they change
+    void (*on_groups)(const pid_t *pgids, size_t n, void *ctx);
+    void *ctx;
+} exec_hooks;
 
-/* Run each command via /bin/sh -c with cwd as the working directory.
+/* Run each command with cwd as the working directory; hooks may be NULL. A command that is
+ * only words and simple quotes is spawned directly, anything else runs via /bin/sh -c.
+ * With parallel > 1, up to that many commands run at once and a `wait` line is a barrier:
+ * everything before it finishes before anything after it starts. Their output is prefixed
+ * with "[i] " per line unless open_output gives them their own. Each runs in a process group
+ * of its own, and the first failure terminates the others' groups (fail-fast, as in order).
+ * With one_shell, the commands run in order in a single shell instead, so state such as cd
+ * and variables carries over (parallel is ignored).
  * Return 0 if all commands succeed, -1 on fork/wait failure, or the exit code of the failed
  * command. */
-int exec_run_commands(char *const *cmds, size_t n, const char *cwd);
+int exec_run_commands(char *const *cmds, size_t n, const char *cwd, int parallel, int one_shell,
+                      const exec_hooks *hooks);
+
+/* A `wait` line; only parallel runs treat it specially (in order it is a no-op command). */
+int exec_is_barrier(const char *cmd);
 
 #endif // LATER_EXEC_H_
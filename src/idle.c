@@ -0,0 +1,351 @@
+#include "idle.h"
+
+#include "timefmt.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// how often to look again when there is no trigger to wait on
+#define IDLE_SAMPLE_MS 5000
+// a trigger reports at most once per window and a little after it ends; quiet means a window
+// plus this without a report
+#define IDLE_SLACK_MS 2000
+
+static const char *const k_resources[] = {"cpu", "memory", "io"};
+#define NRESOURCES (sizeof(k_resources) / sizeof(k_resources[0]))
+
+static int *threshold_of(task_idle *idle, size_t r)
+{
+    return r == 0 ? &idle->cpu : r == 1 ? &idle->memory : &idle->io;
+}
+
+static int threshold(const task_idle *idle, size_t r)
+{
+    return r == 0 ? idle->cpu : r == 1 ? idle->memory : idle->io;
+}
+
+static int parse_percent(const char *v, int *out)
+{
+    char *end;
+    long p = strtol(v, &end, 10);
+    if (end == v || (*end && strcmp(end, "%") != 0) || p < 1 || p > 99)
+        return -1;
+    *out = (int)p;
+    return 0;
+}
+
+static int parse_size_kb(const char *v, long long *out)
+{
+    char *end;
+    long long n = strtoll(v, &end, 10);
+    if (end == v || n <= 0)
+        return -1;
+    long long mult;
+    if (*end == '\0' || strcmp(end, "M") == 0)
+        mult = 1024;
+    else if (strcmp(end, "K") == 0)
+        mult = 1;
+    else if (strcmp(end, "G") == 0)
+        mult = 1024 * 1024;
+    else
+        return -1;
+    if (n > (1LL << 40) / mult)
+        return -1;
+    *out = n * mult;
+    return 0;
+}
+
+int idle_parse(const char *spec, task_idle *idle, char *errbuf, size_t errsz)
+{
+    memset(idle, 0, sizeof(*idle));
+    idle->max_s = IDLE_DEFAULT_MAX_S;
+
+    char buf[256];
+    if (snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+    {
+        snprintf(errbuf, errsz, "--when-idle spec too long");
+        return -1;
+    }
+    int any = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *v = strchr(tok, '=');
+        if (!v)
+        {
+            snprintf(errbuf, errsz, "expected key=value in --when-idle, got '%s'", tok);
+            return -1;
+        }
+        *v++ = '\0';
+
+        int known = 0;
+        for (size_t r = 0; r < NRESOURCES; ++r)
+        {
+            if (strcmp(tok, k_resources[r]) != 0)
+                continue;
+            if (parse_percent(v, threshold_of(idle, r)) < 0)
+            {
+                snprintf(errbuf, errsz, "%s= takes a percentage from 1 to 99, got '%s'", tok, v);
+                return -1;
+            }
+            known = any = 1;
+        }
+        if (known)
+            continue;
+
+        if (strcmp(tok, "mem") == 0)
+        {
+            if (parse_size_kb(v, &idle->mem_kb) < 0)
+            {
+                snprintf(errbuf, errsz, "mem= takes a size such as 512M or 2G, got '%s'", v);
+                return -1;
+            }
+            any = 1;
+        }
+        else if (strcmp(tok, "max") == 0)
+        {
+            // reuse the relative time syntax: max=1h30m is "+1h30m" from now
+            char rel[64];
+            time_t now = time(NULL), at;
+            snprintf(rel, sizeof(rel), "+%s", v);
+            if (timefmt_parse_time(rel, &at, NULL, errbuf, errsz) < 0 || at - now < 1 ||
+                at - now > 7 * 86400)
+            {
+                snprintf(errbuf, errsz, "max= takes a duration from 1s to 7d, got '%s'", v);
+                return -1;
+            }
+            idle->max_s = (int)(at - now);
+        }
+        else
+        {
+            snprintf(errbuf, errsz, "unknown --when-idle key '%s' (expected cpu, memory, io, mem "
+                     "or max)", tok);
+            return -1;
+        }
+    }
+    if (!any)
+    {
+        snprintf(errbuf, errsz, "--when-idle needs at least one of cpu, memory, io or mem");
+        return -1;
+    }
+    return 0;
+}
+
+void idle_format(const task_idle *idle, char *buf, size_t n)
+{
+    size_t off = 0;
+    buf[0] = '\0';
+    for (size_t r = 0; r < NRESOURCES && off < n; ++r)
+    {
+        if (threshold(idle, r))
+            off += (size_t)snprintf(buf + off, n - off, "%s%s<%d%%", off ? ", " : "",
+                                    k_resources[r], threshold(idle, r));
+    }
+    if (idle->mem_kb && off < n)
+    {
+        long long kb = idle->mem_kb;
+        if (kb % (1024 * 1024) == 0)
+            off += (size_t)snprintf(buf + off, n - off, "%smem>=%lldG", off ? ", " : "",
+                                    kb / (1024 * 1024));
+        else if (kb % 1024 == 0)
+            off += (size_t)snprintf(buf + off, n - off, "%smem>=%lldM", off ? ", " : "", kb / 1024);
+        else
+            off += (size_t)snprintf(buf + off, n - off, "%smem>=%lldK", off ? ", " : "", kb);
+    }
+    if (off < n)
+    {
+        char span[64];
+        timefmt_format_duration(idle->max_s, span, sizeof(span));
+        snprintf(buf + off, n - off, "; at most %s", span);
+    }
+}
+
+/* "some avg10" of /proc/pressure/<res> in percent, or -1 if it cannot be read. */
+static double read_pressure(const char *res)
+{
+    char path[64], buf[256];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", res);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    double avg10;
+    return sscanf(buf, "some avg10=%lf", &avg10) == 1 ? avg10 : -1;
+}
+
+/* MemAvailable in kB, or -1 if it cannot be read. */
+static long long read_mem_available(void)
+{
+    FILE *f = fopen("/proc/meminfo", "re");
+    if (!f)
+        return -1;
+    char line[128];
+    long long kb = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+int idle_pressure_available(const task_idle *idle)
+{
+    for (size_t r = 0; r < NRESOURCES; ++r)
+    {
+        if (threshold(idle, r) && read_pressure(k_resources[r]) < 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int memory_ok(const task_idle *idle, char *why, size_t n)
+{
+    if (!idle->mem_kb)
+        return 1;
+    long long kb = read_mem_available();
+    if (kb < 0 || kb >= idle->mem_kb)
+        return 1;
+    snprintf(why, n, "MemAvailable %lldM, want %lldM", kb / 1024, idle->mem_kb / 1024);
+    return 0;
+}
+
+int idle_check(const task_idle *idle, char *why, size_t n)
+{
+    for (size_t r = 0; r < NRESOURCES; ++r)
+    {
+        if (!threshold(idle, r))
+            continue;
+        double p = read_pressure(k_resources[r]);
+        if (p >= threshold(idle, r))
+        {
+            snprintf(why, n, "%s pressure %.1f%%, want below %d%%", k_resources[r], p,
+                     threshold(idle, r));
+            return 0;
+        }
+    }
+    return memory_ok(idle, why, n);
+}
+
+/* A PSI trigger that polls POLLPRI whenever some task stalled on res for more than pct percent
+ * of an IDLE_WINDOW_S window; -1 where that is not available. Unprivileged users may only use
+ * windows that are a multiple of 2s. */
+static int open_trigger(const char *res, int pct)
+{
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", res);
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    long long window_us = IDLE_WINDOW_S * 1000000LL;
+    char trig[64];
+    int len = snprintf(trig, sizeof(trig), "some %lld %lld", window_us * pct / 100, window_us);
+    if (write(fd, trig, (size_t)len + 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)res;
+    (void)pct;
+    return -1;
+#endif
+}
+
+/* Sleep until deadline_ms or for at most ms. */
+static void nap(long long ms, long long deadline_ms)
+{
+    long long left = deadline_ms - wall_now_ms();
+    sleep_until_wall(wall_now_ms() + (ms < left ? ms : left));
+}
+
+int idle_wait(const task_idle *idle, long long deadline_ms)
+{
+    char why[128];
+    if (idle_check(idle, why, sizeof(why)))
+        return 1;
+
+    struct pollfd fds[NRESOURCES];
+    size_t nfds = 0;
+    int usable = 1;
+    for (size_t r = 0; r < NRESOURCES && usable; ++r)
+    {
+        if (!threshold(idle, r))
+            continue;
+        fds[nfds].fd = open_trigger(k_resources[r], threshold(idle, r));
+        fds[nfds].events = POLLPRI;
+        if (fds[nfds].fd < 0)
+            usable = 0;
+        else
+            ++nfds;
+    }
+    if (!usable || nfds == 0)
+    {
+        for (size_t i = 0; i < nfds; ++i)
+            close(fds[i].fd);
+        nfds = 0;
+    }
+
+    int idle_now = 0;
+    long long quiet_since = mono_now_us();
+    while (!idle_now && wall_now_ms() < deadline_ms)
+    {
+        if (nfds == 0)
+        {
+            // no triggers (mem= only, or no PSI): sample
+            nap(IDLE_SAMPLE_MS, deadline_ms);
+            idle_now = idle_check(idle, why, sizeof(why));
+            continue;
+        }
+
+        // a window with no trigger event means every resource stayed below its threshold
+        long long quiet_ms = (mono_now_us() - quiet_since) / 1000;
+        long long need_ms = IDLE_WINDOW_S * 1000LL + IDLE_SLACK_MS;
+        if (quiet_ms >= need_ms)
+        {
+            if (memory_ok(idle, why, sizeof(why)))
+                idle_now = 1;
+            else
+                nap(IDLE_SAMPLE_MS, deadline_ms);
+            continue;
+        }
+
+        long long timeout = need_ms - quiet_ms;
+        long long left = deadline_ms - wall_now_ms();
+        if (left < timeout)
+            timeout = left;
+        int n = poll(fds, nfds, (int)(timeout > 0 ? timeout : 0));
+        if (n < 0 && errno != EINTR)
+            break;
+        for (size_t i = 0; n > 0 && i < nfds; ++i)
+        {
+            if (fds[i].revents & POLLPRI)
+                quiet_since = mono_now_us();
+            if (fds[i].revents & (POLLERR | POLLNVAL))
+            {
+                // the trigger went away; fall back to sampling
+                for (size_t k = 0; k < nfds; ++k)
+                    close(fds[k].fd);
+                nfds = 0;
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < nfds; ++i)
+        close(fds[i].fd);
+    return idle_now;
+}
@@ -0,0 +1,39 @@
+#ifndef LATER_IDLE_H_
+#define LATER_IDLE_H_
+
+#include "store.h"
+
+#include <stddef.h>
+
+/*
+ * --when-idle: a due task waits until the machine is quiet before it starts. The spec is a
+ * comma-separated list of
+ *   cpu=P, memory=P, io=P   share of time (percent) some task stalled on that resource, as
+ *                           /proc/pressure (PSI) reports it; must stay below P
+ *   mem=SIZE                MemAvailable must be at least SIZE (K, M or G; default M)
+ *   max=DURATION            run anyway after waiting this long (30m, 2h...; default 1h)
+ *
+ * On Linux the wait arms PSI triggers and sleeps in poll: the kernel wakes the daemon at most
+ * once per IDLE_WINDOW_S while a resource is busy, and a whole window without an event means
+ * it has been quiet. mem= alone, or a kernel without PSI, falls back to sampling. Thresholds
+ * this system cannot measure count as met.
+ */
+
+#define IDLE_DEFAULT_MAX_S 3600
+#define IDLE_WINDOW_S 10
+
+/* Parse spec into *idle. On error, write a message into errbuf and return -1. */
+int idle_parse(const char *spec, task_idle *idle, char *errbuf, size_t errsz);
+/* "cpu<20%, mem>=2G; at most 1h 0m 0s" */
+void idle_format(const task_idle *idle, char *buf, size_t n);
+
+/* Return 1 if the PSI thresholds of idle can be measured here, 0 if they will be ignored. */
+int idle_pressure_available(const task_idle *idle);
+/* Return 1 if every threshold is met right now; otherwise 0 with the first one that is not
+ * described in why. */
+int idle_check(const task_idle *idle, char *why, size_t n);
+/* Block until every threshold is met (return 1) or the wall clock reaches deadline_ms
+ * (return 0). */
+int idle_wait(const task_idle *idle, long long deadline_ms);
+
+#endif // LATER_IDLE_H_
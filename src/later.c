@@ -1,22 +1,66 @@
 #include "action.h"
 
+#include "idle.h"
+#include "queue.h"
+#include "store.h"
+#include "tasklog.h"
+#include "timefmt.h"
+#include "util.h"
+
 #include "3rdparty/argparse/argparse.h"
 
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char *const usages[] = {
-    "later [<time>]   schedule commands (e.g. 17:30, +15m, +2h, +1d, 2026-01-01T09:30:00)",
+    "later [<time>]   schedule commands (e.g. 17:30, +15m, +2h, +1d, +500ms, 2026-01-01T09:30:00)",
     "later <option>   inspect or manage tasks",
     NULL};
 
+/* "running,paused" -> status bit mask. Return -1 on an unknown name. */
+static int parse_status_mask(const char *input, unsigned *mask)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", input);
+    *mask = 0;
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ","))
+    {
+        task_status st;
+        if (store_status_from_name(tok, &st) < 0)
+        {
+            fprintf(stderr,
+                    "Error: unknown status '%s' (expected pending, queued, running, paused, "
+                    "completed, failed or cancelled)\n",
+                    tok);
+            return -1;
+        }
+        *mask |= 1u << st;
+    }
+    return 0;
+}
+
+static int parse_bound(const char *opt, const char *input, time_t *out)
+{
+    char errbuf[256];
+    if (timefmt_parse_bound(input, out, errbuf, sizeof(errbuf)) < 0)
+    {
+        fprintf(stderr, "Error: %s: %s\n", opt, errbuf);
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, const char *argv[])
 {
     int version_flag = 0;
     int list_flag = 0;
+    int lag_flag = 0;
     int clean_flag = 0;
     int purge_flag = 0;
     int verbose_flag = 0;
+    int compact_flag = 0;
 
     const char *show_id = NULL;
     const char *cancel_id = NULL;
@@ -25,12 +69,40 @@ int main(int argc, const char *argv[])
     const char *delete_id = NULL;
     const char *log_id = NULL;
     const char *retry_id = NULL;
+    const char *migrate_layout = NULL;
+
+    const char *status_filter = NULL;
+    const char *since_str = NULL;
+    const char *until_str = NULL;
+    const char *cwd_filter = NULL;
+    int exec_time_flag = 0;
+    int limit = INT_MIN; // not given
+    int lines = INT_MIN; // -n; with -l it stands for --limit
+    int offset = 0;
+    int reverse_flag = 0;
+    int parallel = INT_MIN; // not given
+    int one_shell = 0;
+    const char *after = NULL;
+    const char *after_ok = NULL;
+    const char *queue = NULL;
+    int priority = 0;
+    const char *queue_limit = NULL;
+    const char *when_idle = NULL;
+    const char *log_max = NULL;
+    const char *log_policy = NULL;
+    int capture = 0;
+    int stderr_only = 0;
+    int timestamps = 0;
+    const char *durability = NULL;
+    const char *submit_path = NULL;
+    const char *supervisor_cmd = NULL;
 
     struct argparse_option options[] = {
         OPT_HELP(),
         OPT_BOOLEAN('l', "list", &list_flag, "list all tasks", NULL, 0, 0),
         OPT_STRING('s', "show", &show_id, "show task details", NULL, 0, 0),
         OPT_STRING('L', "log", &log_id, "show task log output", NULL, 0, 0),
+        OPT_BOOLEAN(0, "lag", &lag_flag, "start lag histogram (takes the -l filters)", NULL, 0, 0),
         OPT_BOOLEAN(0, "version", &version_flag, "print version and exit", NULL, 0, 0),
         OPT_STRING(0, "cancel", &cancel_id, "cancel a pending/running task", NULL, 0, 0),
         OPT_STRING(0, "pause", &pause_id, "pause a pending/running task", NULL, 0, 0),
@@ -38,7 +110,62 @@ int main(int argc, const char *argv[])
         OPT_STRING(0, "delete", &delete_id, "delete a finished task", NULL, 0, 0),
         OPT_STRING(0, "retry", &retry_id, "rerun an existing task's commands", NULL, 0, 0),
         OPT_BOOLEAN(0, "clean", &clean_flag, "remove all finished tasks", NULL, 0, 0),
+        OPT_BOOLEAN(0, "compact", &compact_flag, "compress the logs of all finished tasks", NULL, 0,
+                    0),
         OPT_BOOLEAN(0, "purge", &purge_flag, "cancel all tasks and erase the data dir", NULL, 0, 0),
+        OPT_STRING(0, "status", &status_filter, "with -l: only these statuses (comma-separated)",
+                   NULL, 0, 0),
+        OPT_STRING(0, "since", &since_str, "with -l: created at or after (e.g. -2h, 2026-01-01)",
+                   NULL, 0, 0),
+        OPT_STRING(0, "until", &until_str, "with -l: created at or before", NULL, 0, 0),
+        OPT_BOOLEAN(0, "exec-time", &exec_time_flag, "with -l: --since/--until use execute time",
+                    NULL, 0, 0),
+        OPT_STRING(0, "cwd", &cwd_filter, "with -l: only tasks run in this dir or below it", NULL,
+                   0, 0),
+        OPT_INTEGER(0, "limit", &limit, "with -l: show at most N tasks", NULL, 0, 0),
+        OPT_INTEGER('n', "lines", &lines,
+                    "with --log: show the last N lines (default 100); with -l: --limit N", NULL,
+                    0, 0),
+        OPT_INTEGER(0, "offset", &offset, "with -l: skip the first N matching tasks", NULL, 0, 0),
+        OPT_BOOLEAN('r', "reverse", &reverse_flag, "with -l: newest first", NULL, 0, 0),
+        OPT_INTEGER('j', "parallel", &parallel,
+                    "run up to N commands at once; a 'wait' line waits for those before it", NULL,
+                    0, 0),
+        OPT_BOOLEAN(0, "one-shell", &one_shell,
+                    "run the commands in one shell, so cd and variables carry over", NULL, 0, 0),
+        OPT_STRING(0, "after", &after, "start once these tasks (comma-separated) have finished",
+                   NULL, 0, 0),
+        OPT_STRING(0, "after-ok", &after_ok, "like --after, but only if they all completed", NULL,
+                   0, 0),
+        OPT_STRING(0, "queue", &queue, "wait for a slot in this named queue before starting", NULL,
+                   0, 0),
+        OPT_INTEGER(0, "priority", &priority, "with --queue: higher goes first (default 0)", NULL,
+                    0, 0),
+        OPT_STRING(0, "queue-limit", &queue_limit, "NAME=N: let N tasks of queue NAME run at once",
+                   NULL, 0, 0),
+        OPT_STRING(0, "when-idle", &when_idle,
+                   "wait for low pressure, e.g. cpu=20,io=10,mem=2G,max=2h (see README)", NULL, 0,
+                   0),
+        OPT_STRING(0, "log-max", &log_max, "keep at most SIZE of output in the log (e.g. 64K, 10M)",
+                   NULL, 0, 0),
+        OPT_STRING(0, "log-policy", &log_policy,
+                   "with --log-max: rotate (default), head-tail or ring", NULL, 0, 0),
+        OPT_BOOLEAN(0, "capture", &capture,
+                    "log stdout and stderr of each command apart, with times", NULL, 0, 0),
+        OPT_BOOLEAN(0, "stderr-only", &stderr_only, "with --log: only stderr (--capture tasks)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "timestamps", &timestamps,
+                    "with --log: prefix lines with time, command and stream (--capture tasks)",
+                    NULL, 0, 0),
+        OPT_STRING(0, "submit", &submit_path, "create the tasks listed in a manifest file (- = stdin)",
+                   NULL, 0, 0),
+        OPT_STRING(0, "supervisor", &supervisor_cmd,
+                   "start, stop or status: one process keeps all pending tasks", NULL, 0, 0),
+        OPT_STRING(0, "durability", &durability,
+                   "strict, relaxed or batched fsync on create (default $LATER_DURABILITY or strict)",
+                   NULL, 0, 0),
+        OPT_STRING(0, "migrate", &migrate_layout, "move tasks to the flat or sharded layout", NULL,
+                   0, 0),
         OPT_BOOLEAN(0, "verbose", &verbose_flag, "show detailed output", NULL, 0, 0),
         OPT_END()};
 
@@ -47,15 +174,95 @@ int main(int argc, const char *argv[])
     argparse_describe(&ap, "\nlater - schedule commands for later execution", NULL);
     argc = argparse_parse(&ap, argc, argv);
 
+    if (!durability)
+        durability = getenv("LATER_DURABILITY");
+    if (durability && durability[0])
+    {
+        store_durability d;
+        if (store_durability_from_name(durability, &d) < 0)
+        {
+            fprintf(stderr, "Error: unknown durability '%s' (expected strict, relaxed or batched)\n",
+                    durability);
+            return 1;
+        }
+        store_set_durability(d);
+    }
+
+    if (parallel == INT_MIN)
+        parallel = -1; // in order, or on --retry as the original ran
+    else if (parallel < 0 || parallel > TASK_MAX_PARALLEL)
+    {
+        fprintf(stderr, "Error: --parallel must be between 0 and %d\n", TASK_MAX_PARALLEL);
+        return 1;
+    }
+
+    if (one_shell && parallel > 1)
+    {
+        fprintf(stderr, "Error: --one-shell runs commands in order; it cannot be used with -j\n");
+        return 1;
+    }
+
+    if (capture && one_shell)
+    {
+        fprintf(stderr, "Error: --capture needs the commands apart; it cannot be used with "
+                        "--one-shell\n");
+        return 1;
+    }
+    if (capture && (log_max || log_policy))
+    {
+        fprintf(stderr, "Error: --capture cannot be used with --log-max\n");
+        return 1;
+    }
+
+    if (queue && !queue_name_valid(queue))
+    {
+        fprintf(stderr, "Error: queue names are letters, digits, '-' and '_' (at most %d)\n",
+                QUEUE_NAME_MAX - 1);
+        return 1;
+    }
+    if (priority && !queue)
+    {
+        fprintf(stderr, "Error: --priority needs --queue\n");
+        return 1;
+    }
+    if (priority < QUEUE_MIN_PRIORITY || priority > QUEUE_MAX_PRIORITY)
+    {
+        fprintf(stderr, "Error: --priority must be between %d and %d\n", QUEUE_MIN_PRIORITY,
+                QUEUE_MAX_PRIORITY);
+        return 1;
+    }
+
     if (version_flag)
     {
         printf("later 0.2.0\n");
         return 0;
     }
-    if (list_flag)
-        return action_list(verbose_flag);
+    if (list_flag || lag_flag)
+    {
+        list_opts opts = {0};
+        opts.verbose = verbose_flag;
+        opts.by_exec = exec_time_flag;
+        opts.cwd = cwd_filter;
+        opts.reverse = reverse_flag;
+        if (limit == INT_MIN)
+            limit = lines == INT_MIN ? 0 : lines;
+        if (limit < 0 || offset < 0)
+        {
+            fprintf(stderr, "Error: -n/--limit and --offset must not be negative\n");
+            return 1;
+        }
+        opts.limit = (size_t)limit;
+        opts.offset = (size_t)offset;
+        if (status_filter && parse_status_mask(status_filter, &opts.status_mask) < 0)
+            return 1;
+        if (since_str && parse_bound("--since", since_str, &opts.since) < 0)
+            return 1;
+        if (until_str && parse_bound("--until", until_str, &opts.until) < 0)
+            return 1;
+        return lag_flag ? action_lag(&opts) : action_list(&opts);
+    }
     if (show_id)
-        return action_show(show_id);
+        return action_show(show_id, verbose_flag);
     if (cancel_id)
         return action_cancel(cancel_id);
     if (pause_id)
@@ -65,16 +272,82 @@ int main(int argc, const char *argv[])
     if (delete_id)
         return action_delete(delete_id);
     if (log_id)
-        return action_log(log_id, verbose_flag);
+    {
+        if (limit != INT_MIN)
+        {
+            fprintf(stderr, "Error: --limit counts tasks for -l; use -n/--lines with --log\n");
+            return 1;
+        }
+        if (lines == INT_MIN)
+            lines = 0;
+        if (lines < 0)
+        {
+            fprintf(stderr, "Error: -n/--lines must not be negative\n");
+            return 1;
+        }
+        log_opts opts = {verbose_flag, (size_t)lines, stderr_only, timestamps};
+        return action_log(log_id, &opts);
+    }
     if (clean_flag)
         return action_clean();
+    if (compact_flag)
+        return action_compact();
     if (purge_flag)
         return action_purge();
+    if (migrate_layout)
+        return action_migrate(migrate_layout);
+    if (supervisor_cmd)
+        return action_supervisor(supervisor_cmd);
+    if (submit_path)
+        return action_submit(submit_path);
+    if (queue_limit)
+        return action_queue_limit(queue_limit);
+    task_idle idle;
+    if (when_idle)
+    {
+        char errbuf[256];
+        if (idle_parse(when_idle, &idle, errbuf, sizeof(errbuf)) < 0)
+        {
+            fprintf(stderr, "Error: %s\n", errbuf);
+            return 1;
+        }
+        if (!idle_pressure_available(&idle))
+            fprintf(stderr, "Warning: /proc/pressure is not available here; only mem= will be "
+                            "checked\n");
+    }
+    create_opts copts = {parallel, one_shell, after_ok ? after_ok : after, after_ok != NULL, queue,
+                         priority, when_idle ? &idle : NULL, 0, LOG_ROTATE, capture};
+    if (log_policy && !log_max)
+    {
+        fprintf(stderr, "Error: --log-policy needs --log-max\n");
+        return 1;
+    }
+    if (log_max && (parse_size(log_max, &copts.log_max) < 0 || copts.log_max < TASKLOG_MIN_MAX))
+    {
+        fprintf(stderr, "Error: --log-max takes a size of at least 1K, such as 64K or 10M\n");
+        return 1;
+    }
+    if (log_policy && store_log_policy_from_name(log_policy, &copts.log_policy) < 0)
+    {
+        fprintf(stderr, "Error: unknown log policy '%s' (expected rotate, head-tail or ring)\n",
+                log_policy);
+        return 1;
+    }
+    if (after && after_ok)
+    {
+        fprintf(stderr, "Error: use either --after or --after-ok\n");
+        return 1;
+    }
     if (retry_id)
-        return action_retry(retry_id, argc >= 1 ? argv[0] : NULL);
+        return action_retry(retry_id, argc >= 1 ? argv[0] : NULL, &copts);
 
+    if (copts.parallel < 0)
+        copts.parallel = 0;
     if (argc >= 1)
-        return action_create(argv[0]);
+        return action_create(argv[0], &copts);
+    // a dependent task usually has no time of its own
+    if (copts.after)
+        return action_create("+0s", &copts);
 
     argparse_usage(&ap);
 
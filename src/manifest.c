@@ -0,0 +1,161 @@
+#include "manifest.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static manifest_record *manifest_push(manifest *m)
+{
+    if (m->len == m->cap)
+    {
+        size_t nc = m->cap ? m->cap * 2 : 64;
+        manifest_record *ni = realloc(m->items, nc * sizeof(*ni));
+        if (!ni)
+            return NULL;
+        m->items = ni;
+        m->cap = nc;
+    }
+    manifest_record *r = &m->items[m->len];
+    memset(r, 0, sizeof(*r));
+    if (strvec_init(&r->cmds) < 0)
+        return NULL;
+    ++m->len;
+    return r;
+}
+
+static char *skip_space(char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        ++p;
+    return p;
+}
+
+/* "@ <time> [cwd]" */
+static int parse_header(char *p, size_t lineno, const char *default_cwd, manifest_record *r,
+                        char *errbuf, size_t errsz)
+{
+    p = skip_space(p + 1);
+    char *t = p;
+    while (*p && *p != ' ' && *p != '\t')
+        ++p;
+    size_t tlen = (size_t)(p - t);
+    if (tlen == 0)
+    {
+        snprintf(errbuf, errsz, "line %zu: missing time after '@'", lineno);
+        return -1;
+    }
+    if (tlen >= sizeof(r->time_spec))
+    {
+        snprintf(errbuf, errsz, "line %zu: time too long", lineno);
+        return -1;
+    }
+    memcpy(r->time_spec, t, tlen);
+    r->time_spec[tlen] = '\0';
+
+    char *dir = skip_space(p);
+    int n;
+    if (!*dir)
+        n = snprintf(r->cwd, sizeof(r->cwd), "%s", default_cwd);
+    else if (dir[0] == '/')
+        n = snprintf(r->cwd, sizeof(r->cwd), "%s", dir);
+    else
+        n = snprintf(r->cwd, sizeof(r->cwd), "%s/%s", default_cwd, dir);
+    if (n < 0 || (size_t)n >= sizeof(r->cwd))
+    {
+        snprintf(errbuf, errsz, "line %zu: working dir too long", lineno);
+        return -1;
+    }
+    r->line = lineno;
+    return 0;
+}
+
+int manifest_parse(FILE *in, const char *default_cwd, manifest **out, char *errbuf, size_t errsz)
+{
+    assert(out != NULL);
+    assert(*out == NULL);
+    manifest *m = calloc(1, sizeof(*m));
+    if (!m)
+    {
+        snprintf(errbuf, errsz, "out of memory");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    size_t lineno = 0;
+    manifest_record *cur = NULL;
+    int rc = 0;
+    while (rc == 0 && (n = getline(&line, &cap, in)) >= 0)
+    {
+        ++lineno;
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' ' ||
+                         line[n - 1] == '\t'))
+            line[--n] = '\0';
+        char *p = skip_space(line);
+        if (!*p || *p == '#')
+            continue;
+
+        if (*p == '@')
+        {
+            if (cur && cur->cmds->len == 0)
+            {
+                snprintf(errbuf, errsz, "line %zu: task has no commands", cur->line);
+                rc = -1;
+            }
+            else if (!(cur = manifest_push(m)))
+            {
+                snprintf(errbuf, errsz, "out of memory");
+                rc = -1;
+            }
+            else
+            {
+                rc = parse_header(p, lineno, default_cwd, cur, errbuf, errsz);
+            }
+            continue;
+        }
+
+        if (!cur)
+        {
+            snprintf(errbuf, errsz, "line %zu: command before the first '@ <time>' line", lineno);
+            rc = -1;
+        }
+        else if (strvec_push(cur->cmds, p) < 0)
+        {
+            snprintf(errbuf, errsz, "line %zu: too many commands", lineno);
+            rc = -1;
+        }
+    }
+    free(line);
+
+    if (rc == 0 && ferror(in))
+    {
+        snprintf(errbuf, errsz, "read error");
+        rc = -1;
+    }
+    if (rc == 0 && cur && cur->cmds->len == 0)
+    {
+        snprintf(errbuf, errsz, "line %zu: task has no commands", cur->line);
+        rc = -1;
+    }
+    if (rc < 0)
+    {
+        manifest_free(&m);
+        return -1;
+    }
+    *out = m;
+    return 0;
+}
+
+void manifest_free(manifest **m)
+{
+    if (!m || !*m)
+        return;
+    for (size_t i = 0; i < (*m)->len; ++i)
+        strvec_free(&(*m)->items[i].cmds);
+    free((*m)->items);
+    free(*m);
+    *m = NULL;
+}
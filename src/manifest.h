@@ -0,0 +1,44 @@
+#ifndef LATER_MANIFEST_H_
+#define LATER_MANIFEST_H_
+
+#include "strvec.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Bulk submission file for `later --submit`. Each record starts with a header line
+ *   @ <time> [cwd]
+ * where <time> is anything timefmt_parse_time() accepts and cwd (the rest of the line,
+ * spaces allowed) defaults to the submitter's working dir; a relative cwd is taken from
+ * there too. The non-empty lines up to the next header are the record's commands.
+ * Lines starting with '#' are comments.
+ *
+ *   @ +10m
+ *   make -j8
+ *   @ 02:00 /srv/backup
+ *   ./rotate.sh
+ */
+
+typedef struct
+{
+    size_t line; // of the header, for messages
+    char time_spec[64];
+    char cwd[PATH_MAX];
+    strvec *cmds;
+} manifest_record;
+
+typedef struct
+{
+    manifest_record *items;
+    size_t len;
+    size_t cap;
+} manifest;
+
+/* Parse in into *out (which must be NULL on entry). Syntax errors stop the parse: write a
+ * message with the line number into errbuf and return -1. Times are not validated here. */
+int manifest_parse(FILE *in, const char *default_cwd, manifest **out, char *errbuf, size_t errsz);
+void manifest_free(manifest **m);
+
+#endif // LATER_MANIFEST_H_
@@ -0,0 +1,360 @@
+#include "queue.h"
+
+#include "store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+// without inotify, how often a waiter looks again; with it, a guard against a missed event
+#define QUEUE_POLL_MS 1000
+#define QUEUE_RECHECK_MS 60000
+// a dying holder's close is reported a moment before its lock goes; look again this soon
+#define QUEUE_SETTLE_MS 20
+
+// the slot this process holds: the locked fd, and the one whose close wakes the waiters
+static int g_slot_fd = -1;
+static int g_slot_wfd = -1;
+
+int queue_name_valid(const char *name)
+{
+    size_t n = strlen(name);
+    if (n == 0 || n >= QUEUE_NAME_MAX)
+        return 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '-' || c == '_'))
+            return 0;
+    }
+    return 1;
+}
+
+/* Open (creating it if needed) the queue's directory. */
+static int open_queue_dir(const char *name)
+{
+    int base = store_base_fd();
+    if (base < 0 || !queue_name_valid(name))
+        return -1;
+    if (mkdirat(base, "queues", 0755) < 0 && errno != EEXIST)
+        return -1;
+    char rel[64];
+    snprintf(rel, sizeof(rel), "queues/%s", name);
+    if (mkdirat(base, rel, 0755) < 0 && errno != EEXIST)
+        return -1;
+    return openat(base, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static int read_limit_at(int qfd)
+{
+    int fd = openat(qfd, "limit", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 1;
+    char buf[32];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    buf[n] = '\0';
+    long v = strtol(buf, NULL, 10);
+    return (v >= 1 && v <= QUEUE_MAX_LIMIT) ? (int)v : 1;
+}
+
+int queue_set_limit(const char *name, int limit)
+{
+    if (limit < 1 || limit > QUEUE_MAX_LIMIT || store_ensure_base() < 0)
+        return -1;
+    int qfd = open_queue_dir(name);
+    if (qfd < 0)
+        return -1;
+
+    // a rename is what waiters watch for, and never shows them a half-written file
+    char tmp[64], text[32];
+    snprintf(tmp, sizeof(tmp), "limit.tmp.%d", (int)getpid());
+    int len = snprintf(text, sizeof(text), "%d\n", limit);
+    int fd = openat(qfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0)
+    {
+        rc = write(fd, text, (size_t)len) == len ? 0 : -1;
+        close(fd);
+        if (rc == 0)
+            rc = renameat(qfd, tmp, qfd, "limit");
+        if (rc < 0)
+            unlinkat(qfd, tmp, 0);
+    }
+    close(qfd);
+    return rc;
+}
+
+int queue_get_limit(const char *name)
+{
+    int qfd = open_queue_dir(name);
+    if (qfd < 0)
+        return 1;
+    int limit = read_limit_at(qfd);
+    close(qfd);
+    return limit;
+}
+
+/* Whether a flock on qfd/name is held by someone, i.e. a slot is taken or a waiter is alive.
+ * Opened read-only so the probe's close is not mistaken for a release by the watchers. */
+static int held_at(int qfd, const char *name)
+{
+    int fd = openat(qfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int held = flock(fd, LOCK_SH | LOCK_NB) < 0 && errno == EWOULDBLOCK;
+    close(fd);
+    return held;
+}
+
+/* Try every slot below the limit. On success the slot stays locked until queue_release() or
+ * the process exits: the locking fd is read-only, and a second fd opened for writing makes the
+ * release visible to inotify as IN_CLOSE_WRITE. */
+static int take_slot(int qfd)
+{
+    int limit = read_limit_at(qfd);
+    for (int k = 0; k < limit; ++k)
+    {
+        char slot[32];
+        snprintf(slot, sizeof(slot), "slot.%d", k);
+        int fd = openat(qfd, slot, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+        {
+            g_slot_wfd = openat(qfd, slot, O_WRONLY | O_CLOEXEC);
+            if (g_slot_wfd < 0)
+            {
+                close(fd);
+                return -1;
+            }
+            g_slot_fd = fd;
+            return 0;
+        }
+        close(fd);
+    }
+    return 1;
+}
+
+typedef struct
+{
+    int priority;
+    long long due_ms;
+    char id[64];
+} waiter;
+
+/* Order of service: higher priority, then earlier due time, then id. */
+static int waiter_cmp(const waiter *a, const waiter *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority ? -1 : 1;
+    if (a->due_ms != b->due_ms)
+        return a->due_ms < b->due_ms ? -1 : 1;
+    return strcmp(a->id, b->id);
+}
+
+static int parse_wait_name(const char *name, waiter *w)
+{
+    int used = 0;
+    if (sscanf(name, "wait.%d.%lld.%n", &w->priority, &w->due_ms, &used) != 2 || used == 0)
+        return -1;
+    snprintf(w->id, sizeof(w->id), "%s", name + used);
+    return w->id[0] ? 0 : -1;
+}
+
+/* Return 1 if no live waiter is ahead of me; dead waiters' files are removed on the way. */
+static int first_in_line(int qfd, const waiter *me)
+{
+    // a dup would share (and leave at the end) the position of qfd, which is scanned again
+    int dfd = openat(qfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+    if (!d)
+    {
+        if (dfd >= 0)
+            close(dfd);
+        return 1;
+    }
+    int first = 1;
+    struct dirent *e;
+    while (first && (e = readdir(d)))
+    {
+        waiter w;
+        if (parse_wait_name(e->d_name, &w) < 0 || waiter_cmp(&w, me) >= 0)
+            continue;
+        if (held_at(qfd, e->d_name))
+            first = 0;
+        else
+            unlinkat(qfd, e->d_name, 0);
+    }
+    closedir(d);
+    return first;
+}
+
+static int wait_name(const waiter *me, char *buf, size_t n)
+{
+    int w = snprintf(buf, n, "wait.%d.%lld.%s", me->priority, me->due_ms, me->id);
+    return (w < 0 || (size_t)w >= n) ? -1 : 0;
+}
+
+int queue_try_acquire(const char *name, const char *id, int priority, long long due_ms)
+{
+    int qfd = open_queue_dir(name);
+    if (qfd < 0)
+        return -1;
+    waiter me = {priority, due_ms, ""};
+    snprintf(me.id, sizeof(me.id), "%s", id);
+    int rc = first_in_line(qfd, &me) ? take_slot(qfd) : 1;
+    close(qfd);
+    return rc;
+}
+
+/* Read all pending inotify events; return 1 if a slot was closed for writing. */
+static int drain_events(int wfd)
+{
+    int slot_closed = 0;
+#ifdef __linux__
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(wfd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + n;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if ((ev->mask & IN_CLOSE_WRITE) && ev->len && strncmp(ev->name, "slot.", 5) == 0)
+                slot_closed = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+#else
+    (void)wfd;
+#endif
+    return slot_closed;
+}
+
+int queue_acquire(const char *name, const char *id, int priority, long long due_ms)
+{
+    int qfd = open_queue_dir(name);
+    if (qfd < 0)
+        return -1;
+    waiter me = {priority, due_ms, ""};
+    snprintf(me.id, sizeof(me.id), "%s", id);
+    char ticket[128];
+    if (wait_name(&me, ticket, sizeof(ticket)) < 0)
+    {
+        close(qfd);
+        return -1;
+    }
+
+    // watch before taking a place in line, so no release between a check and the wait is lost
+    int wfd = -1;
+#ifdef __linux__
+    wfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (wfd >= 0)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/queues/%s", store_base_dir(), name);
+        if (inotify_add_watch(wfd, path, IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO) < 0)
+        {
+            close(wfd);
+            wfd = -1;
+        }
+    }
+#endif
+
+    // locked before it appears under its real name, or a waiter behind could take it for stale
+    char tmp[160];
+    snprintf(tmp, sizeof(tmp), "tmp.%s", ticket);
+    int tfd = openat(qfd, tmp, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (tfd < 0 || flock(tfd, LOCK_EX) < 0 || renameat(qfd, tmp, qfd, ticket) < 0)
+    {
+        if (tfd >= 0)
+        {
+            unlinkat(qfd, tmp, 0);
+            close(tfd);
+        }
+        if (wfd >= 0)
+            close(wfd);
+        close(qfd);
+        return -1;
+    }
+
+    int rc, timeout = QUEUE_RECHECK_MS;
+    for (;;)
+    {
+        rc = first_in_line(qfd, &me) ? take_slot(qfd) : 1;
+        if (rc <= 0)
+            break;
+        if (wfd < 0)
+        {
+            struct timespec ts = {QUEUE_POLL_MS / 1000, (QUEUE_POLL_MS % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        struct pollfd p = {wfd, POLLIN, 0};
+        poll(&p, 1, timeout);
+        timeout = drain_events(wfd) ? QUEUE_SETTLE_MS : QUEUE_RECHECK_MS;
+    }
+
+    // leaving the line (IN_DELETE, then IN_CLOSE_WRITE) is what wakes the next waiter
+    unlinkat(qfd, ticket, 0);
+    close(tfd);
+    if (wfd >= 0)
+        close(wfd);
+    close(qfd);
+    return rc;
+}
+
+void queue_release(void)
+{
+    // unlock before the close that wakes the next waiter
+    if (g_slot_fd >= 0)
+        close(g_slot_fd);
+    if (g_slot_wfd >= 0)
+        close(g_slot_wfd);
+    g_slot_fd = g_slot_wfd = -1;
+}
+
+int queue_stat(const char *name, int *running, int *waiting)
+{
+    *running = 0;
+    *waiting = 0;
+    int qfd = open_queue_dir(name);
+    if (qfd < 0)
+        return -1;
+    int dfd = openat(qfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = dfd >= 0 ? fdopendir(dfd) : NULL;
+    if (!d)
+    {
+        if (dfd >= 0)
+            close(dfd);
+        close(qfd);
+        return -1;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        waiter w;
+        if (strncmp(e->d_name, "slot.", 5) == 0)
+            *running += held_at(qfd, e->d_name);
+        else if (parse_wait_name(e->d_name, &w) == 0)
+            *waiting += held_at(qfd, e->d_name);
+    }
+    closedir(d);
+    close(qfd);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef LATER_QUEUE_H_
+#define LATER_QUEUE_H_
+
+/*
+ * Named queues bound how many of their tasks run at once (`later --queue NAME`). Each queue is
+ * a directory $base/queues/<name>/ holding
+ *   limit                      how many tasks may run at once, one decimal line (default 1)
+ *   slot.<k>                   k < limit; a task runs while its daemon holds a flock on one
+ *   wait.<prio>.<due>.<id>     a daemon waiting for a slot, flocked by it for as long as it waits
+ *
+ * Waiters are ordered by priority (higher first), then due time (epoch ms), then id. Only the
+ * first live waiter tries for a slot; taking one removes its wait file, which lets the next
+ * one try. Every lock is a flock, so a daemon that dies gives its slot or its place back.
+ * On Linux waiters sleep on inotify for slot releases (a holder's slot fd is the only one
+ * opened for writing, so its close is the event), wait files leaving and limit changes;
+ * elsewhere they re-check once a second.
+ */
+
+#define QUEUE_NAME_MAX 32
+#define QUEUE_MAX_LIMIT 1024
+#define QUEUE_MIN_PRIORITY -1000
+#define QUEUE_MAX_PRIORITY 1000
+
+/* Letters, digits, '-' and '_', shorter than QUEUE_NAME_MAX. */
+int queue_name_valid(const char *name);
+
+int queue_set_limit(const char *name, int limit);
+/* The configured limit, or 1 if the queue has none yet. */
+int queue_get_limit(const char *name);
+
+/* Take a slot right away if this task is first in line and one is free. Return 0 if it now
+ * holds one, 1 if it has to wait, -1 on error. */
+int queue_try_acquire(const char *name, const char *id, int priority, long long due_ms);
+/* Wait in line until the task holds a slot. Return 0 then, -1 on error. */
+int queue_acquire(const char *name, const char *id, int priority, long long due_ms);
+/* Give back the slot taken by either of the above. Exiting does too, but only an explicit
+ * release makes sure the next waiter finds the slot free as soon as it is told. */
+void queue_release(void);
+
+/* Counts for one queue: slots in use and tasks waiting (live ones only). */
+int queue_stat(const char *name, int *running, int *waiting);
+
+#endif // LATER_QUEUE_H_
@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE // syncfs
+#endif
+
 #include "store.h"
 
 #include "strvec.h"
@@ -9,6 +13,7 @@
 #include <limits.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +24,14 @@
 #include <unistd.h>
 
 static char g_base_dir[PATH_MAX];
+static int g_base_fd = -1;
+
+// files later itself keeps in the base dir next to the task dirs
+static const char *const k_base_files[] = {"catalog",        "catalog.lock",    "layout",
+                                           "supervisor.sock", "supervisor.lock", "supervisor.log",
+                                           "queues",          NULL};
+static int g_layout = -1;
+static store_durability g_durability = STORE_DURABILITY_STRICT;
 
 static int mkdirs(const char *path, mode_t mode)
 {
@@ -79,34 +92,38 @@ static int parse_kv_line(char *line, char **k, char **v)
     return 0;
 }
 
-static int fsync_dir(const char *dir)
+typedef struct
 {
-    int fd = open(dir, O_RDONLY | O_CLOEXEC);
-    if (fd < 0)
-        return -1;
-    int rc = fsync(fd);
-    close(fd);
-    return rc;
-}
+    char *id;
+    time_t created_at;
+    int have_meta;
+} list_key;
 
 static int cmp_by_created_at(const void *a, const void *b)
 {
-    const char *ia = *(const char *const *)a;
-    const char *ib = *(const char *const *)b;
-    task_meta ma, mb;
-    int ra = store_read_meta(ia, &ma);
-    int rb = store_read_meta(ib, &mb);
-    if (ra < 0 && rb < 0)
-        return strcmp(ia, ib);
-    if (ra < 0)
+    const list_key *ka = a;
+    const list_key *kb = b;
+    if (!ka->have_meta && !kb->have_meta)
+        return strcmp(ka->id, kb->id);
+    if (!ka->have_meta)
         return 1;
-    if (rb < 0)
+    if (!kb->have_meta)
         return -1;
-    if (ma.created_at < mb.created_at)
+    if (ka->created_at < kb->created_at)
         return -1;
-    if (ma.created_at > mb.created_at)
+    if (ka->created_at > kb->created_at)
         return 1;
-    return strcmp(ia, ib);
+    return strcmp(ka->id, kb->id);
+}
+
+static int is_base_file(const char *name)
+{
+    for (size_t i = 0; k_base_files[i]; ++i)
+    {
+        if (strcmp(name, k_base_files[i]) == 0)
+            return 1;
+    }
+    return 0;
 }
 
 static int color_enabled(void)
@@ -122,10 +139,67 @@ static void reap_orphan_group(const char *id)
     task_meta meta;
     if (store_read_meta(id, &meta) < 0 || meta.daemon_pid <= 1)
         return;
-    int leader_alive = (kill(meta.daemon_pid, 0) == 0);
-    int group_alive = (kill(-meta.daemon_pid, 0) == 0);
-    if (group_alive && !leader_alive)
-        kill(-meta.daemon_pid, SIGKILL);
+    // the daemon is gone; so go its commands, in its group or in -j groups of their own
+    if (kill(meta.daemon_pid, 0) != 0)
+        store_signal_task(&meta, SIGKILL);
+}
+
+/* Days since 1970-01-01 for a proleptic Gregorian UTC date. */
+static long days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* Shard of a task: the UTC day of the epoch second its id starts with. */
+static int shard_of(const char *id, char *buf, size_t n)
+{
+    time_t t = task_id_time(id);
+    struct tm tm;
+    if (t <= 0 || !gmtime_r(&t, &tm))
+        return -1;
+    return strftime(buf, n, "%Y-%m-%d", &tm) ? 0 : -1;
+}
+
+static int format_rel(const char *id, int sharded, char *buf, size_t n)
+{
+    if (!sharded)
+        return ((size_t)snprintf(buf, n, "%s", id) >= n) ? -1 : 0;
+    char shard[16];
+    if (shard_of(id, shard, sizeof(shard)) < 0)
+        return -1;
+    return ((size_t)snprintf(buf, n, "%s/%s", shard, id) >= n) ? -1 : 0;
+}
+
+/* Where id lives relative to the base dir: the configured layout, or the other one if it has
+ * not been migrated (yet). Tasks that don't exist get the configured layout. */
+static int task_rel(const char *id, char *buf, size_t n)
+{
+    int sharded = store_get_layout() == STORE_LAYOUT_SHARDED;
+    if (format_rel(id, sharded, buf, n) < 0)
+        return -1;
+    int base = store_base_fd();
+    struct stat st;
+    if (base < 0 || fstatat(base, buf, &st, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT)
+        return 0;
+    char alt[128];
+    if (format_rel(id, !sharded, alt, sizeof(alt)) == 0 &&
+        fstatat(base, alt, &st, AT_SYMLINK_NOFOLLOW) == 0 && strlen(alt) < n)
+        memcpy(buf, alt, strlen(alt) + 1);
+    return 0;
+}
+
+/* Task dirs live below the base dir, possibly one shard down; creating or deleting one must
+ * still bump the base dir mtime, which is how the catalog notices changes it missed. */
+static void touch_base(void)
+{
+    int base = store_base_fd();
+    if (base >= 0)
+        futimens(base, NULL);
 }
 
 int store_ensure_base(void)
@@ -144,24 +218,117 @@ const char *store_base_dir(void)
 
 int store_task_dir(const char *id, char *buf, size_t n)
 {
+    char rel[128];
     if (g_base_dir[0] == '\0' && init_base_dir() < 0)
         return -1;
-    return ((size_t)snprintf(buf, n, "%s/%s", g_base_dir, id) >= n) ? -1 : 0;
+    if (task_rel(id, rel, sizeof(rel)) < 0)
+        return -1;
+    return ((size_t)snprintf(buf, n, "%s/%s", g_base_dir, rel) >= n) ? -1 : 0;
 }
 
 int store_path_in_task(const char *id, const char *name, char *buf, size_t n)
 {
+    char rel[128];
+    if (g_base_dir[0] == '\0' && init_base_dir() < 0)
+        return -1;
+    if (task_rel(id, rel, sizeof(rel)) < 0)
+        return -1;
+    return ((size_t)snprintf(buf, n, "%s/%s/%s", g_base_dir, rel, name) >= n) ? -1 : 0;
+}
+
+store_layout store_get_layout(void)
+{
+    if (g_layout >= 0)
+        return (store_layout)g_layout;
+    g_layout = STORE_LAYOUT_FLAT;
+    int base = store_base_fd();
+    if (base < 0)
+        return STORE_LAYOUT_FLAT;
+    int fd = openat(base, "layout", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        char buf[16] = "";
+        ssize_t r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (r > 0 && strncmp(buf, "sharded", 7) == 0)
+            g_layout = STORE_LAYOUT_SHARDED;
+    }
+    return (store_layout)g_layout;
+}
+
+int store_is_shard_name(const char *name)
+{
+    int y, m, d, consumed = 0;
+    if (strlen(name) != 10 || sscanf(name, "%4d-%2d-%2d%n", &y, &m, &d, &consumed) != 3 ||
+        consumed != 10)
+        return 0;
+    return m >= 1 && m <= 12 && d >= 1 && d <= 31;
+}
+
+int store_create_task_dir(const char *id)
+{
+    int base = store_base_fd();
+    if (base < 0)
+        return -1;
+    if (store_get_layout() != STORE_LAYOUT_SHARDED)
+        return (mkdirat(base, id, 0755) < 0 && errno != EEXIST) ? -1 : 0;
+
+    char shard[16], rel[128];
+    if (shard_of(id, shard, sizeof(shard)) < 0 || format_rel(id, 1, rel, sizeof(rel)) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // a concurrent delete may prune the shard between the two mkdirs; recreate it once
+    for (int attempt = 0;; ++attempt)
+    {
+        if (mkdirat(base, shard, 0755) < 0 && errno != EEXIST)
+            return -1;
+        if (mkdirat(base, rel, 0755) == 0 || errno == EEXIST)
+            break;
+        if (errno != ENOENT || attempt > 0)
+            return -1;
+    }
+    touch_base();
+    return 0;
+}
+
+int store_base_fd(void)
+{
+    if (g_base_fd >= 0)
+        return g_base_fd;
     if (g_base_dir[0] == '\0' && init_base_dir() < 0)
         return -1;
-    return ((size_t)snprintf(buf, n, "%s/%s/%s", g_base_dir, id, name) >= n) ? -1 : 0;
+    g_base_fd = open(g_base_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return g_base_fd;
+}
+
+int store_open_task(const char *id)
+{
+    int base = store_base_fd();
+    if (base < 0)
+        return -1;
+    int sharded = store_get_layout() == STORE_LAYOUT_SHARDED;
+    char rel[128];
+    if (format_rel(id, sharded, rel, sizeof(rel)) < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    int fd = openat(base, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0 || errno != ENOENT || format_rel(id, !sharded, rel, sizeof(rel)) < 0)
+        return fd;
+    // not migrated (yet)
+    return openat(base, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 }
 
 int store_acquire_lock(const char *id)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "lock", path, sizeof(path)) < 0)
+    int tfd = store_open_task(id);
+    if (tfd < 0)
         return -1;
-    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    int fd = openat(tfd, "lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    close(tfd);
     if (fd < 0)
         return -1;
     if (flock(fd, LOCK_EX | LOCK_NB) < 0)
@@ -172,12 +339,9 @@ int store_acquire_lock(const char *id)
     return fd;
 }
 
-int store_is_locked(const char *id)
+int store_is_locked_at(int task_fd)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "lock", path, sizeof(path)) < 0)
-        return 0;
-    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int fd = openat(task_fd, "lock", O_RDONLY | O_CLOEXEC);
     if (fd < 0)
         return 0;
     if (flock(fd, LOCK_SH | LOCK_NB) < 0)
@@ -191,101 +355,427 @@ int store_is_locked(const char *id)
     return 0;
 }
 
-int store_write_meta(const task_meta *meta)
+int store_is_locked(const char *id)
 {
-    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
-    if (store_task_dir(meta->id, dir, sizeof(dir)) < 0)
-        return -1;
-    if (ensure_dir(dir, 0755) < 0)
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return 0;
+    int locked = store_is_locked_at(tfd);
+    close(tfd);
+    return locked;
+}
+
+void store_set_durability(store_durability d)
+{
+    g_durability = d;
+}
+
+store_durability store_get_durability(void)
+{
+    return g_durability;
+}
+
+int store_durability_from_name(const char *name, store_durability *d)
+{
+    if (strcmp(name, "strict") == 0)
+        *d = STORE_DURABILITY_STRICT;
+    else if (strcmp(name, "relaxed") == 0)
+        *d = STORE_DURABILITY_RELAXED;
+    else if (strcmp(name, "batched") == 0)
+        *d = STORE_DURABILITY_BATCHED;
+    else
         return -1;
-    if (store_path_in_task(meta->id, "meta", path, sizeof(path)) < 0)
+    return 0;
+}
+
+const char *store_log_policy_name(task_log_policy p)
+{
+    switch (p)
+    {
+    case LOG_ROTATE:
+        return "rotate";
+    case LOG_HEAD_TAIL:
+        return "head-tail";
+    case LOG_RING:
+        return "ring";
+    default:
+        return "all";
+    }
+}
+
+int store_log_policy_from_name(const char *name, task_log_policy *p)
+{
+    if (strcmp(name, "rotate") == 0)
+        *p = LOG_ROTATE;
+    else if (strcmp(name, "head-tail") == 0)
+        *p = LOG_HEAD_TAIL;
+    else if (strcmp(name, "ring") == 0)
+        *p = LOG_RING;
+    else
         return -1;
-    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid()) >= sizeof(tmp))
+    return 0;
+}
+
+int store_sync(void)
+{
+#ifdef __linux__
+    int base = store_base_fd();
+    if (base < 0)
         return -1;
+    return syncfs(base);
+#else
+    sync();
+    return 0;
+#endif
+}
 
-    FILE *f = fopen(tmp, "w");
+/* fsync unless the durability mode defers it to a store_sync(). */
+static int sync_fd(int fd)
+{
+    return g_durability == STORE_DURABILITY_STRICT ? fsync(fd) : 0;
+}
+
+/* Open <name>.tmp.<pid> in the task dir for writing; its name goes to tmp. */
+static FILE *open_tmp(int task_fd, const char *name, char *tmp, size_t n)
+{
+    if ((size_t)snprintf(tmp, n, "%s.tmp.%d", name, (int)getpid()) >= n)
+        return NULL;
+    int fd = openat(task_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    FILE *f = fdopen(fd, "w");
     if (!f)
-        return -1;
-    fprintf(f, "id=%s\n", meta->id);
-    fprintf(f, "cwd=%s\n", meta->cwd);
-    fprintf(f, "created_at=%lld\n", (long long)meta->created_at);
-    fprintf(f, "execute_at=%lld\n", (long long)meta->execute_at);
-    fprintf(f, "daemon_pid=%lld\n", (long long)meta->daemon_pid);
+    {
+        close(fd);
+        unlinkat(task_fd, tmp, 0);
+    }
+    return f;
+}
+
+/* Flush, sync and close f, then atomically rename tmp over name and sync the dir. */
+static int commit_tmp(FILE *f, int task_fd, const char *tmp, const char *name)
+{
     int werr = ferror(f);
-    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+    if (fflush(f) != 0 || sync_fd(fileno(f)) != 0)
         werr = 1;
     if (fclose(f) != 0)
         werr = 1;
-    if (werr)
+    if (werr || renameat(task_fd, tmp, task_fd, name) < 0)
     {
-        unlink(tmp);
+        unlinkat(task_fd, tmp, 0);
         return -1;
     }
-    if (rename(tmp, path) < 0)
+    return sync_fd(task_fd);
+}
+
+void store_commands_digest(char *const *cmds, size_t n, char *buf, size_t bufsz)
+{
+    uint64_t h = HASH_FNV1A_INIT;
+    for (size_t i = 0; i < n; ++i)
     {
-        unlink(tmp);
-        return -1;
+        h = hash_fnv1a(cmds[i], strlen(cmds[i]), h);
+        h = hash_fnv1a("\n", 1, h);
     }
-    return fsync_dir(dir);
+    snprintf(buf, bufsz, "%016llx", (unsigned long long)h);
 }
 
-int store_read_meta(const char *id, task_meta *meta)
+void store_meta_set_commands(task_meta *meta, char *const *cmds, size_t n)
+{
+    meta->cmd_count = n;
+    store_commands_digest(cmds, n, meta->cmd_digest, sizeof(meta->cmd_digest));
+    snprintf(meta->cmd_preview, sizeof(meta->cmd_preview), "%s", n > 0 ? cmds[0] : "");
+}
+
+/*
+ * On-disk meta: a fixed header followed by cwd (cwd_len bytes, no NUL) and the after list
+ * (after_len bytes, no NUL), written in native
+ * byte order since a store never leaves the machine. Fields are only ever appended; a reader
+ * takes the prefix it knows and finds cwd at header_size, so older binaries keep reading
+ * newer records. Files without the magic are the key=value text meta of earlier versions.
+ */
+#define META_MAGIC "LTMB"
+#define META_VERSION 6
+#define META_HAS_COMMANDS 0x1u
+#define META_SUPERVISED 0x2u
+#define META_AFTER_OK 0x4u
+#define META_ONE_SHELL 0x8u
+#define META_CAPTURE 0x10u
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    int64_t created_at;
+    int64_t execute_at;
+    int64_t daemon_pid;
+    uint64_t cmd_count;
+    uint32_t cwd_len;
+    uint32_t flags;
+    char id[64];
+    char cmd_digest[24];
+    char cmd_preview[64];
+    // version 2
+    uint32_t execute_ms;
+    uint32_t parallel; // was reserved, so 0 (sequential) in records written before it existed
+    // version 3: after_len bytes of the after list follow cwd
+    uint32_t after_len;
+    int32_t priority; // was reserved; version 4 with the queue below
+    // version 4
+    char queue[32];
+    // version 5: --when-idle, unused while idle_max_s is 0
+    uint32_t idle_cpu;
+    uint32_t idle_memory;
+    uint32_t idle_io;
+    uint32_t idle_max_s;
+    int64_t idle_mem_kb;
+    // version 6: --log-max, unused while log_max is 0
+    uint64_t log_max;
+    uint32_t log_policy;
+    uint32_t reserved;
+} meta_record;
+
+// version 1 records end here; anything after it reads as zero from them
+#define META_MIN_HEADER offsetof(meta_record, execute_ms)
+
+_Static_assert(sizeof(meta_record) == 288, "meta_record fields may only be appended");
+
+int store_write_meta(const task_meta *meta)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "meta", path, sizeof(path)) < 0)
+    if (store_create_task_dir(meta->id) < 0)
+        return -1;
+    int tfd = store_open_task(meta->id);
+    if (tfd < 0)
         return -1;
-    FILE *f = fopen(path, "r");
+
+    meta_record rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.magic, META_MAGIC, sizeof(rec.magic));
+    rec.version = META_VERSION;
+    rec.header_size = sizeof(rec);
+    rec.created_at = meta->created_at;
+    rec.execute_at = meta->execute_at;
+    rec.daemon_pid = meta->daemon_pid;
+    rec.execute_ms = (uint32_t)meta->execute_ms;
+    rec.parallel = meta->parallel > 0 ? (uint32_t)meta->parallel : 0;
+    rec.cwd_len = (uint32_t)strnlen(meta->cwd, sizeof(meta->cwd) - 1);
+    rec.after_len = (uint32_t)strnlen(meta->after, sizeof(meta->after) - 1);
+    if (meta->after_ok)
+        rec.flags |= META_AFTER_OK;
+    rec.priority = meta->priority;
+    snprintf(rec.queue, sizeof(rec.queue), "%s", meta->queue);
+    if (meta->idle.max_s > 0)
+    {
+        rec.idle_cpu = (uint32_t)meta->idle.cpu;
+        rec.idle_memory = (uint32_t)meta->idle.memory;
+        rec.idle_io = (uint32_t)meta->idle.io;
+        rec.idle_max_s = (uint32_t)meta->idle.max_s;
+        rec.idle_mem_kb = meta->idle.mem_kb;
+    }
+    if (meta->log_max > 0)
+    {
+        rec.log_max = meta->log_max;
+        rec.log_policy = (uint32_t)meta->log_policy;
+    }
+    snprintf(rec.id, sizeof(rec.id), "%s", meta->id);
+    if (meta->supervised)
+        rec.flags |= META_SUPERVISED;
+    if (meta->one_shell)
+        rec.flags |= META_ONE_SHELL;
+    if (meta->capture)
+        rec.flags |= META_CAPTURE;
+    if (meta->cmd_digest[0])
+    {
+        rec.flags |= META_HAS_COMMANDS;
+        rec.cmd_count = meta->cmd_count;
+        snprintf(rec.cmd_digest, sizeof(rec.cmd_digest), "%s", meta->cmd_digest);
+        snprintf(rec.cmd_preview, sizeof(rec.cmd_preview), "%s", meta->cmd_preview);
+    }
+
+    char tmp[64];
+    FILE *f = open_tmp(tfd, "meta", tmp, sizeof(tmp));
     if (!f)
+    {
+        close(tfd);
+        return -1;
+    }
+    fwrite(&rec, sizeof(rec), 1, f);
+    fwrite(meta->cwd, 1, rec.cwd_len, f);
+    fwrite(meta->after, 1, rec.after_len, f);
+    int rc = commit_tmp(f, tfd, tmp, "meta");
+    close(tfd);
+    return rc;
+}
+
+static int decode_meta_record(const char *buf, size_t len, task_meta *meta)
+{
+    uint16_t header_size;
+    if (len < META_MIN_HEADER)
+        return -1;
+    memcpy(&header_size, buf + offsetof(meta_record, header_size), sizeof(header_size));
+    if (header_size < META_MIN_HEADER || header_size > len)
+        return -1;
+
+    // take the fields the record has; ones added after it was written stay zero
+    meta_record rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(&rec, buf, header_size < sizeof(rec) ? header_size : sizeof(rec));
+    if (rec.cwd_len > len - rec.header_size || rec.cwd_len >= sizeof(meta->cwd))
+        return -1;
+    if (rec.after_len > len - rec.header_size - rec.cwd_len ||
+        rec.after_len >= sizeof(meta->after))
         return -1;
 
     memset(meta, 0, sizeof(*meta));
-    char line[PATH_MAX + 64];
-    while (fgets(line, sizeof(line), f))
+    memcpy(meta->id, rec.id, sizeof(meta->id) - 1);
+    memcpy(meta->cwd, buf + rec.header_size, rec.cwd_len);
+    memcpy(meta->after, buf + rec.header_size + rec.cwd_len, rec.after_len);
+    meta->after_ok = (rec.flags & META_AFTER_OK) != 0;
+    memcpy(meta->queue, rec.queue, sizeof(meta->queue) - 1);
+    meta->priority = meta->queue[0] ? rec.priority : 0;
+    if (rec.idle_max_s > 0)
     {
-        char *k, *v;
-        if (parse_kv_line(line, &k, &v) < 0)
-            continue;
-        if (strcmp(k, "id") == 0)
-            snprintf(meta->id, sizeof(meta->id), "%s", v);
-        else if (strcmp(k, "cwd") == 0)
-            snprintf(meta->cwd, sizeof(meta->cwd), "%s", v);
-        else if (strcmp(k, "created_at") == 0)
-            meta->created_at = (time_t)strtoll(v, NULL, 10);
-        else if (strcmp(k, "execute_at") == 0)
-            meta->execute_at = (time_t)strtoll(v, NULL, 10);
-        else if (strcmp(k, "daemon_pid") == 0)
-            meta->daemon_pid = (pid_t)strtoll(v, NULL, 10);
-    }
-    int err = ferror(f);
-    fclose(f);
-    return err ? -1 : 0;
+        meta->idle.cpu = (int)(rec.idle_cpu < 100 ? rec.idle_cpu : 0);
+        meta->idle.memory = (int)(rec.idle_memory < 100 ? rec.idle_memory : 0);
+        meta->idle.io = (int)(rec.idle_io < 100 ? rec.idle_io : 0);
+        meta->idle.mem_kb = rec.idle_mem_kb > 0 ? rec.idle_mem_kb : 0;
+        meta->idle.max_s = (int)(rec.idle_max_s <= INT_MAX ? rec.idle_max_s : INT_MAX);
+    }
+    if (rec.log_max > 0 && rec.log_policy >= LOG_ROTATE && rec.log_policy <= LOG_RING)
+    {
+        meta->log_max = rec.log_max;
+        meta->log_policy = (task_log_policy)rec.log_policy;
+    }
+    meta->created_at = (time_t)rec.created_at;
+    meta->execute_at = (time_t)rec.execute_at;
+    meta->execute_ms = rec.execute_ms < 1000 ? (int)rec.execute_ms : 0;
+    meta->daemon_pid = (pid_t)rec.daemon_pid;
+    meta->parallel = rec.parallel <= TASK_MAX_PARALLEL ? (int)rec.parallel : 0;
+    meta->supervised = (rec.flags & META_SUPERVISED) != 0;
+    meta->one_shell = (rec.flags & META_ONE_SHELL) != 0;
+    meta->capture = (rec.flags & META_CAPTURE) != 0;
+    if (rec.flags & META_HAS_COMMANDS)
+    {
+        meta->cmd_count = (size_t)rec.cmd_count;
+        memcpy(meta->cmd_digest, rec.cmd_digest, sizeof(meta->cmd_digest) - 1);
+        memcpy(meta->cmd_preview, rec.cmd_preview, sizeof(meta->cmd_preview) - 1);
+    }
+    return 0;
 }
 
-int store_task_group_alive(const char *id)
+/* The key=value meta of versions before the binary record. They wrote only these keys; every
+ * later field keeps its zero default. */
+static void decode_meta_text(char *buf, task_meta *meta)
 {
-    task_meta meta;
-    if (store_read_meta(id, &meta) < 0 || meta.daemon_pid <= 1)
-        return 0;
-    if (kill(-meta.daemon_pid, 0) != 0)
-        return 0; // group gone
-    if (store_is_locked(id))
-        return 1;
-    return kill(meta.daemon_pid, 0) != 0;
+    memset(meta, 0, sizeof(*meta));
+    char *line = buf;
+    while (*line)
+    {
+        char *nl = strchr(line, '\n');
+        char *next = nl ? nl + 1 : line + strlen(line);
+        if (nl)
+            *nl = '\0';
+        char *k, *v;
+        if (parse_kv_line(line, &k, &v) == 0)
+        {
+            if (strcmp(k, "id") == 0)
+                snprintf(meta->id, sizeof(meta->id), "%s", v);
+            else if (strcmp(k, "cwd") == 0)
+                snprintf(meta->cwd, sizeof(meta->cwd), "%s", v);
+            else if (strcmp(k, "created_at") == 0)
+                meta->created_at = (time_t)strtoll(v, NULL, 10);
+            else if (strcmp(k, "execute_at") == 0)
+                meta->execute_at = (time_t)strtoll(v, NULL, 10);
+            else if (strcmp(k, "daemon_pid") == 0)
+                meta->daemon_pid = (pid_t)strtoll(v, NULL, 10);
+        }
+        line = next;
+    }
 }
 
-int store_write_commands(const char *id, char *const *cmds, size_t n)
+int store_read_meta_at(int task_fd, task_meta *meta)
 {
-    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
-    if (store_task_dir(id, dir, sizeof(dir)) < 0)
+    int fd = openat(task_fd, "meta", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return -1;
-    if (store_path_in_task(id, "commands", path, sizeof(path)) < 0)
+
+    // either format fits: a record is the header plus cwd and after, text is one line per field
+    char buf[sizeof(meta_record) + PATH_MAX + sizeof(meta->after) + 512];
+    ssize_t n;
+    do
+        n = pread(fd, buf, sizeof(buf) - 1, 0);
+    while (n < 0 && errno == EINTR);
+    close(fd);
+    if (n < 0)
         return -1;
-    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid()) >= sizeof(tmp))
+
+    if ((size_t)n >= sizeof(META_MAGIC) - 1 && memcmp(buf, META_MAGIC, sizeof(META_MAGIC) - 1) == 0)
+        return decode_meta_record(buf, (size_t)n, meta);
+    buf[n] = '\0';
+    decode_meta_text(buf, meta);
+    return 0;
+}
+
+void store_format_meta(const task_meta *meta, FILE *out)
+{
+    fprintf(out, "id=%s\n", meta->id);
+    fprintf(out, "cwd=%s\n", meta->cwd);
+    fprintf(out, "created_at=%lld\n", (long long)meta->created_at);
+    fprintf(out, "execute_at=%lld\n", (long long)meta->execute_at);
+    if (meta->execute_ms)
+        fprintf(out, "execute_ms=%d\n", meta->execute_ms);
+    fprintf(out, "daemon_pid=%lld\n", (long long)meta->daemon_pid);
+    if (meta->parallel)
+        fprintf(out, "parallel=%d\n", meta->parallel);
+    if (meta->one_shell)
+        fprintf(out, "one_shell=1\n");
+    if (meta->capture)
+        fprintf(out, "capture=1\n");
+    if (meta->after[0])
+        fprintf(out, "after=%s\n", meta->after);
+    if (meta->after_ok)
+        fprintf(out, "after_ok=1\n");
+    if (meta->queue[0])
+        fprintf(out, "queue=%s\npriority=%d\n", meta->queue, meta->priority);
+    if (meta->idle.max_s > 0)
+        fprintf(out, "idle_cpu=%d\nidle_memory=%d\nidle_io=%d\nidle_mem_kb=%lld\nidle_max_s=%d\n",
+                meta->idle.cpu, meta->idle.memory, meta->idle.io, meta->idle.mem_kb,
+                meta->idle.max_s);
+    if (meta->log_max > 0)
+        fprintf(out, "log_max=%llu\nlog_policy=%s\n", meta->log_max,
+                store_log_policy_name(meta->log_policy));
+    if (meta->supervised)
+        fprintf(out, "supervised=1\n");
+    if (meta->cmd_digest[0])
+    {
+        fprintf(out, "cmd_count=%zu\n", meta->cmd_count);
+        fprintf(out, "cmd_digest=%s\n", meta->cmd_digest);
+        fprintf(out, "cmd_preview=%s\n", meta->cmd_preview);
+    }
+}
+
+int store_read_meta(const char *id, task_meta *meta)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
         return -1;
+    int rc = store_read_meta_at(tfd, meta);
+    close(tfd);
+    return rc;
+}
 
-    FILE *f = fopen(tmp, "w");
+int store_write_commands(const char *id, char *const *cmds, size_t n)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    char tmp[64];
+    FILE *f = open_tmp(tfd, "commands", tmp, sizeof(tmp));
     if (!f)
+    {
+        close(tfd);
         return -1;
+    }
     for (size_t i = 0; i < n; ++i)
     {
         for (const char *p = cmds[i]; *p; ++p)
@@ -293,29 +783,17 @@ int store_write_commands(const char *id, char *const *cmds, size_t n)
             if (*p == '\n' || *p == '\r')
             {
                 fclose(f);
-                unlink(tmp);
+                unlinkat(tfd, tmp, 0);
+                close(tfd);
                 errno = EINVAL;
                 return -1;
             }
         }
         fprintf(f, "%s\n", cmds[i]);
     }
-    int werr = ferror(f);
-    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
-        werr = 1;
-    if (fclose(f) != 0)
-        werr = 1;
-    if (werr)
-    {
-        unlink(tmp);
-        return -1;
-    }
-    if (rename(tmp, path) < 0)
-    {
-        unlink(tmp);
-        return -1;
-    }
-    return fsync_dir(dir);
+    int rc = commit_tmp(f, tfd, tmp, "commands");
+    close(tfd);
+    return rc;
 }
 
 int store_read_commands(const char *id, strvec **cmds)
@@ -324,12 +802,19 @@ int store_read_commands(const char *id, strvec **cmds)
         return -1;
     strvec *v = *cmds;
 
-    char path[PATH_MAX];
-    if (store_path_in_task(id, "commands", path, sizeof(path)) < 0)
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    int fd = openat(tfd, "commands", O_RDONLY | O_CLOEXEC);
+    close(tfd);
+    if (fd < 0)
         return -1;
-    FILE *f = fopen(path, "r");
+    FILE *f = fdopen(fd, "r");
     if (!f)
+    {
+        close(fd);
         return -1;
+    }
 
     int rc = 0;
     char *line = NULL;
@@ -354,34 +839,22 @@ int store_read_commands(const char *id, strvec **cmds)
 
 int store_create_marker(const char *id, const char *name)
 {
-    char dir[PATH_MAX], path[PATH_MAX];
-    if (store_task_dir(id, dir, sizeof(dir)) < 0)
-        return -1;
-    if (store_path_in_task(id, name, path, sizeof(path)) < 0)
-        return -1;
-    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
-    if (fd < 0)
-        return (errno == EEXIST) ? 0 : -1;
-    if (fsync(fd) < 0)
-    {
-        close(fd);
-        unlink(path);
-        return -1;
-    }
-    close(fd);
-    return fsync_dir(dir);
+    return store_create_marker_with_content(id, name, "");
 }
 
 int store_create_marker_with_content(const char *id, const char *name, const char *content)
 {
-    char dir[PATH_MAX], path[PATH_MAX];
-    if (store_task_dir(id, dir, sizeof(dir)) < 0)
-        return -1;
-    if (store_path_in_task(id, name, path, sizeof(path)) < 0)
+    int tfd = store_open_task(id);
+    if (tfd < 0)
         return -1;
-    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    int fd = openat(tfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
     if (fd < 0)
-        return (errno == EEXIST) ? 0 : -1;
+    {
+        int saved = errno;
+        close(tfd);
+        errno = saved;
+        return (saved == EEXIST) ? 0 : -1;
+    }
 
     size_t len = strlen(content);
     size_t off = 0;
@@ -393,56 +866,348 @@ int store_create_marker_with_content(const char *id, const char *name, const cha
             if (errno == EINTR)
                 continue;
             close(fd);
-            unlink(path);
+            unlinkat(tfd, name, 0);
+            close(tfd);
             return -1;
         }
         off += (size_t)n;
     }
-    if (fsync(fd) < 0)
+    if (sync_fd(fd) < 0)
     {
         close(fd);
-        unlink(path);
+        unlinkat(tfd, name, 0);
+        close(tfd);
         return -1;
     }
     close(fd);
-    return fsync_dir(dir);
+    int rc = sync_fd(tfd);
+    close(tfd);
+    return rc;
 }
 
-int store_has_marker(const char *id, const char *name)
+/* Append one line to a task's diagnostic file (timing, stats). A single short O_APPEND write
+ * keeps lines whole; these files are never synced. */
+static int append_line(const char *id, const char *name, const char *line, int len)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, name, path, sizeof(path)) < 0)
-        return 0;
-    struct stat st;
-    return (stat(path, &st) == 0) ? 1 : 0;
+    if (len < 0)
+        return -1;
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    int fd = openat(tfd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    close(tfd);
+    if (fd < 0)
+        return -1;
+    ssize_t n;
+    do
+        n = write(fd, line, (size_t)len);
+    while (n < 0 && errno == EINTR);
+    close(fd);
+    return n == len ? 0 : -1;
 }
 
-ssize_t store_read_marker(const char *id, const char *name, char *buf, size_t n)
+/* Open a task's diagnostic file for reading; NULL with errno ENOENT if it does not exist. */
+static FILE *open_in_task(const char *id, const char *name)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, name, path, sizeof(path)) < 0)
-        return -1;
-    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return NULL;
+    int fd = openat(tfd, name, O_RDONLY | O_CLOEXEC);
+    close(tfd);
     if (fd < 0)
-        return (errno == ENOENT) ? 0 : -1;
+        return NULL;
+    FILE *f = fdopen(fd, "r");
+    if (!f)
+        close(fd);
+    return f;
+}
 
-    if (n == 0)
+/* Read up to max process groups from the task's groups file; 0 if there is none. */
+static size_t read_groups(const char *id, pid_t *out, size_t max)
+{
+    FILE *f = open_in_task(id, "groups");
+    if (!f)
+        return 0;
+    size_t n = 0;
+    long v;
+    while (n < max && fscanf(f, "%ld", &v) == 1)
     {
-        close(fd);
-        return -1;
+        if (v > 1)
+            out[n++] = (pid_t)v;
     }
+    fclose(f);
+    return n;
+}
 
-    size_t off = 0;
-    while (off < n - 1)
-    {
-        ssize_t r = read(fd, buf + off, n - 1 - off);
-        if (r < 0)
-        {
-            if (errno == EINTR)
-                continue;
-            close(fd);
-            return -1;
-        }
+int store_task_group_alive(const char *id)
+{
+    task_meta meta;
+    if (store_read_meta(id, &meta) < 0 || meta.daemon_pid <= 1)
+        return 0;
+    pid_t groups[TASK_MAX_PARALLEL];
+    size_t n = read_groups(id, groups, TASK_MAX_PARALLEL);
+    int commands_alive = 0;
+    for (size_t i = 0; i < n && !commands_alive; ++i)
+        commands_alive = kill(-groups[i], 0) == 0;
+    int group_alive = kill(-meta.daemon_pid, 0) == 0;
+    if (!group_alive && !commands_alive)
+        return 0; // all gone
+    if (store_is_locked(id))
+        return 1;
+    // the daemon is dead: a -j command left over is ours, and so is its group unless the
+    // daemon's pid has been taken by another process since
+    return commands_alive || kill(meta.daemon_pid, 0) != 0;
+}
+
+int store_write_groups(const char *id, const pid_t *pgids, size_t n)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    int rc = 0;
+    if (n == 0)
+    {
+        if (unlinkat(tfd, "groups", 0) < 0 && errno != ENOENT)
+            rc = -1;
+        close(tfd);
+        return rc;
+    }
+
+    // rewritten on every launch, so like timing it is never synced
+    char tmp[64], line[32];
+    snprintf(tmp, sizeof(tmp), "groups.tmp.%d", (int)getpid());
+    int fd = openat(tfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        close(tfd);
+        return -1;
+    }
+    for (size_t i = 0; i < n && rc == 0; ++i)
+    {
+        int len = snprintf(line, sizeof(line), "%d\n", (int)pgids[i]);
+        if (write(fd, line, (size_t)len) != len)
+            rc = -1;
+    }
+    if (close(fd) < 0 || rc < 0 || renameat(tfd, tmp, tfd, "groups") < 0)
+    {
+        unlinkat(tfd, tmp, 0);
+        rc = -1;
+    }
+    close(tfd);
+    return rc;
+}
+
+int store_signal_task(const task_meta *meta, int sig)
+{
+    // the daemon first, so it starts nothing new while its commands are being signalled
+    int rc = kill(-meta->daemon_pid, sig);
+    int saved = errno;
+    pid_t groups[TASK_MAX_PARALLEL];
+    size_t n = read_groups(meta->id, groups, TASK_MAX_PARALLEL);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (kill(-groups[i], sig) == 0)
+            rc = 0;
+    }
+    if (rc < 0)
+        errno = saved;
+    return rc;
+}
+
+int store_append_timing(const char *id, const char *key, long long value)
+{
+    char line[96];
+    int len = snprintf(line, sizeof(line), "%s=%lld\n", key, value);
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return -1;
+    return append_line(id, "timing", line, len);
+}
+
+int store_append_command_start(const char *id, size_t cmd, long long us)
+{
+    // commands of a parallel task start out of line order, so each one carries its index
+    char line[96];
+    int len = snprintf(line, sizeof(line), "cmd_us=%zu:%lld\n", cmd, us);
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return -1;
+    return append_line(id, "timing", line, len);
+}
+
+int store_read_timing(const char *id, task_timing *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->ready_us = -1;
+
+    FILE *f = open_in_task(id, "timing");
+    if (!f)
+        return (errno == ENOENT) ? 0 : -1;
+
+    size_t cap = 0;
+    char line[96];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f))
+    {
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        long long v = strtoll(eq + 1, NULL, 10);
+        if (strcmp(line, "ready_us") == 0)
+            t->ready_us = v;
+        else if (strcmp(line, "start_us") == 0)
+            t->start_us = v;
+        else if (strcmp(line, "released_us") == 0)
+            t->released_us = v;
+        else if (strcmp(line, "cmd_us") == 0)
+        {
+            char *colon = strchr(eq + 1, ':');
+            size_t i = (size_t)v;
+            if (!colon || i >= STRVEC_MAX_LEN)
+                continue;
+            if (i >= cap)
+            {
+                size_t nc = cap ? cap : 8;
+                while (nc <= i)
+                    nc *= 2;
+                long long *ni = realloc(t->cmd_us, nc * sizeof(*ni));
+                if (!ni)
+                {
+                    rc = -1;
+                    break;
+                }
+                memset(ni + cap, 0, (nc - cap) * sizeof(*ni));
+                t->cmd_us = ni;
+                cap = nc;
+            }
+            t->cmd_us[i] = strtoll(colon + 1, NULL, 10);
+            if (i >= t->ncmd_us)
+                t->ncmd_us = i + 1;
+        }
+    }
+    fclose(f);
+    if (rc < 0)
+        store_timing_free(t);
+    return rc;
+}
+
+void store_timing_free(task_timing *t)
+{
+    free(t->cmd_us);
+    t->cmd_us = NULL;
+    t->ncmd_us = 0;
+}
+
+#define USAGE_FMT                                                                                  \
+    "cmd=%zu rc=%d wall_us=%lld user_us=%lld sys_us=%lld maxrss_kb=%ld majflt=%ld nvcsw=%ld "      \
+    "nivcsw=%ld inblock=%ld oublock=%ld\n"
+
+int store_append_usage(const char *id, const task_usage *u)
+{
+    char line[512];
+    int len = snprintf(line, sizeof(line), USAGE_FMT, u->cmd, u->exit_code, u->wall_us,
+                       u->user_us, u->sys_us, u->max_rss_kb, u->major_faults, u->vol_cs,
+                       u->invol_cs, u->in_blocks, u->out_blocks);
+    if (len < 0 || (size_t)len >= sizeof(line))
+        return -1;
+    return append_line(id, "stats", line, len);
+}
+
+static int usage_cmp(const void *a, const void *b)
+{
+    size_t x = ((const task_usage *)a)->cmd, y = ((const task_usage *)b)->cmd;
+    return (x > y) - (x < y);
+}
+
+int store_read_usage(const char *id, task_usage **out, size_t *n)
+{
+    *out = NULL;
+    *n = 0;
+    FILE *f = open_in_task(id, "stats");
+    if (!f)
+        return (errno == ENOENT) ? 0 : -1;
+
+    size_t cap = 0;
+    char line[512];
+    int rc = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        task_usage u;
+        if (sscanf(line, USAGE_FMT, &u.cmd, &u.exit_code, &u.wall_us, &u.user_us, &u.sys_us,
+                   &u.max_rss_kb, &u.major_faults, &u.vol_cs, &u.invol_cs, &u.in_blocks,
+                   &u.out_blocks) != 11)
+            continue;
+        if (*n == cap)
+        {
+            size_t nc = cap ? cap * 2 : 8;
+            task_usage *ni = realloc(*out, nc * sizeof(*ni));
+            if (!ni)
+            {
+                rc = -1;
+                break;
+            }
+            *out = ni;
+            cap = nc;
+        }
+        (*out)[(*n)++] = u;
+    }
+    fclose(f);
+    if (rc < 0)
+    {
+        free(*out);
+        *out = NULL;
+        *n = 0;
+    }
+    else if (*n > 1)
+    {
+        // parallel commands finish in any order
+        qsort(*out, *n, sizeof(**out), usage_cmp);
+    }
+    return rc;
+}
+
+int store_has_marker_at(int task_fd, const char *name)
+{
+    struct stat st;
+    return (fstatat(task_fd, name, &st, 0) == 0) ? 1 : 0;
+}
+
+int store_has_marker(const char *id, const char *name)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return 0;
+    int has = store_has_marker_at(tfd, name);
+    close(tfd);
+    return has;
+}
+
+ssize_t store_read_marker(const char *id, const char *name, char *buf, size_t n)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+    int fd = openat(tfd, name, O_RDONLY | O_CLOEXEC);
+    close(tfd);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+
+    if (n == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t off = 0;
+    while (off < n - 1)
+    {
+        ssize_t r = read(fd, buf + off, n - 1 - off);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
         if (r == 0)
             break;
         off += (size_t)r;
@@ -454,73 +1219,298 @@ ssize_t store_read_marker(const char *id, const char *name, char *buf, size_t n)
 
 int store_remove_marker(const char *id, const char *name)
 {
-    char path[PATH_MAX];
-    if (store_path_in_task(id, name, path, sizeof(path)) < 0)
-        return -1;
-    if (unlink(path) < 0 && errno != ENOENT)
-        return -1;
-    return 0;
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+    int rc = (unlinkat(tfd, name, 0) < 0 && errno != ENOENT) ? -1 : 0;
+    close(tfd);
+    return rc;
 }
 
-int store_list(strvec **list)
+/* Open the base dir for a scan. The DIR gets its own descriptor so the cached base fd's
+ * offset is left alone. */
+static DIR *open_base_dir(void)
 {
-    if (strvec_init(list) < 0)
-        return -1;
-    strvec *v = *list;
+    int base = store_base_fd();
+    if (base < 0)
+        return NULL;
+    int fd = openat(base, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    DIR *d = fdopendir(fd);
+    if (!d)
+        close(fd);
+    return d;
+}
 
-    if (g_base_dir[0] == '\0' && init_base_dir() < 0)
-        return -1;
+/* readdir entry is a directory; d_type is trusted and only DT_UNKNOWN costs an fstatat. */
+static int entry_is_dir(DIR *d, const struct dirent *e)
+{
+    if (e->d_type != DT_UNKNOWN)
+        return e->d_type == DT_DIR;
+    struct stat st;
+    return fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int in_range(time_t t, time_t since, time_t until)
+{
+    return (since == 0 || t >= since) && (until == 0 || t <= until);
+}
+
+/* Call fn for each task dir in d whose id time is within range. */
+static int scan_tasks(DIR *d, time_t since, time_t until, store_scan_fn fn, void *ctx)
+{
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        if (!is_task_id(e->d_name) || !in_range(task_id_time(e->d_name), since, until))
+            continue;
+        if (!entry_is_dir(d, e))
+            continue;
+        if (fn(e->d_name, ctx) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    DIR *d = opendir(g_base_dir);
+int store_scan(store_scan_fn fn, void *ctx)
+{
+    return store_scan_range(0, 0, fn, ctx);
+}
+
+int store_scan_range(time_t since, time_t until, store_scan_fn fn, void *ctx)
+{
+    DIR *d = open_base_dir();
     if (!d)
         return (errno == ENOENT) ? 0 : -1;
 
+    // flat task dirs and shards can coexist while a migration is incomplete; walk both
+    int rc = 0;
     struct dirent *e;
-    while ((e = readdir(d)))
+    while (rc == 0 && (e = readdir(d)))
     {
-        if (!is_task_id(e->d_name))
+        if (is_task_id(e->d_name))
+        {
+            if (in_range(task_id_time(e->d_name), since, until) && entry_is_dir(d, e) &&
+                fn(e->d_name, ctx) < 0)
+                rc = -1;
             continue;
-        char dir[PATH_MAX];
-        if (store_task_dir(e->d_name, dir, sizeof(dir)) < 0)
+        }
+        if (!store_is_shard_name(e->d_name) || !entry_is_dir(d, e))
             continue;
-        struct stat st;
-        if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+
+        // a shard holds one UTC day; skip it without opening when it is out of range
+        int y, m, dd;
+        sscanf(e->d_name, "%4d-%2d-%2d", &y, &m, &dd);
+        time_t day = (time_t)days_from_civil(y, m, dd) * 86400;
+        if ((until != 0 && day > until) || (since != 0 && day + 86399 < since))
             continue;
 
-        if (strvec_push(v, e->d_name) < 0)
+        int fd = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        DIR *sd = fdopendir(fd);
+        if (!sd)
         {
-            closedir(d);
-            return -1;
+            close(fd);
+            continue;
         }
+        rc = scan_tasks(sd, since, until, fn, ctx);
+        closedir(sd);
     }
     closedir(d);
+    return rc;
+}
 
-    qsort(v->items, v->len, sizeof(*v->items), cmp_by_created_at);
-    return 0;
+static int push_id(const char *id, void *ctx)
+{
+    return strvec_push(ctx, id);
 }
 
-task_status store_resolve_status(const char *id)
+int store_list(strvec **list)
 {
-    int paused = store_has_marker(id, "pause");
-    int cancelled = store_has_marker(id, "cancel");
-    int done = store_has_marker(id, "done");
-    int error = store_has_marker(id, "error");
-    int running = store_has_marker(id, "running");
-    int locked = store_is_locked(id);
+    if (strvec_init(list) < 0)
+        return -1;
+    strvec *v = *list;
+
+    if (store_scan(push_id, v) < 0)
+        return -1;
+    if (v->len < 2)
+        return 0;
+
+    // read each meta once up front rather than twice per comparison
+    list_key *keys = malloc(v->len * sizeof(*keys));
+    if (!keys)
+        return -1;
+    for (size_t i = 0; i < v->len; ++i)
+    {
+        task_meta meta;
+        keys[i].id = v->items[i];
+        keys[i].have_meta = (store_read_meta(v->items[i], &meta) == 0);
+        keys[i].created_at = keys[i].have_meta ? meta.created_at : 0;
+    }
+    qsort(keys, v->len, sizeof(*keys), cmp_by_created_at);
+    for (size_t i = 0; i < v->len; ++i)
+        v->items[i] = keys[i].id;
+    free(keys);
+    return 0;
+}
 
-    if (done)
+static task_status status_from_files(unsigned files, int locked)
+{
+    if (files & TASK_HAS_DONE)
         return STATUS_COMPLETED;
-    if (error)
+    if (files & TASK_HAS_ERROR)
         return STATUS_FAILED;
-    if (cancelled)
+    if (files & TASK_HAS_CANCEL)
         return STATUS_CANCELLED;
-    if (paused && locked)
+    if ((files & TASK_HAS_PAUSE) && locked)
         return STATUS_PAUSED;
-    if (running)
+    if (files & TASK_HAS_RUNNING)
         return locked ? STATUS_RUNNING : STATUS_FAILED;
+    if (files & TASK_HAS_QUEUED)
+        return locked ? STATUS_QUEUED : STATUS_FAILED;
     return locked ? STATUS_PENDING : STATUS_FAILED;
 }
 
+/* Only an unfinished task's status depends on whether its daemon is alive. */
+static int status_needs_lock(unsigned files)
+{
+    return !(files & (TASK_HAS_DONE | TASK_HAS_ERROR | TASK_HAS_CANCEL));
+}
+
+static unsigned read_task_files(DIR *d)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned bit;
+    } known[] = {{"meta", TASK_HAS_META},       {"commands", TASK_HAS_COMMANDS},
+                 {"lock", TASK_HAS_LOCK},       {"running", TASK_HAS_RUNNING},
+                 {"done", TASK_HAS_DONE},       {"error", TASK_HAS_ERROR},
+                 {"cancel", TASK_HAS_CANCEL},   {"pause", TASK_HAS_PAUSE},
+                 {"queued", TASK_HAS_QUEUED}};
+    unsigned files = 0;
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); ++i)
+        {
+            if (strcmp(e->d_name, known[i].name) == 0)
+            {
+                files |= known[i].bit;
+                break;
+            }
+        }
+    }
+    return files;
+}
+
+/* Count lines without keeping them. */
+static size_t count_lines_at(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    size_t n = 0;
+    char buf[16384];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (const char *p = buf; (p = memchr(p, '\n', (size_t)(buf + r - p))); ++p)
+            ++n;
+    }
+    close(fd);
+    return n;
+}
+
+task_status store_resolve_status_at(int task_fd)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned bit;
+    } markers[] = {{"done", TASK_HAS_DONE},     {"error", TASK_HAS_ERROR},
+                   {"cancel", TASK_HAS_CANCEL}, {"pause", TASK_HAS_PAUSE},
+                   {"running", TASK_HAS_RUNNING}, {"queued", TASK_HAS_QUEUED}};
+    unsigned files = 0;
+    for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); ++i)
+    {
+        if (store_has_marker_at(task_fd, markers[i].name))
+            files |= markers[i].bit;
+    }
+    int locked = status_needs_lock(files) ? store_is_locked_at(task_fd) : 0;
+    return status_from_files(files, locked);
+}
+
+task_status store_resolve_status(const char *id)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return STATUS_FAILED;
+    DIR *d = fdopendir(tfd);
+    if (!d)
+    {
+        close(tfd);
+        return STATUS_FAILED;
+    }
+    unsigned files = read_task_files(d);
+    int locked = ((files & TASK_HAS_LOCK) && status_needs_lock(files)) ? store_is_locked_at(dirfd(d))
+                                                                       : 0;
+    closedir(d);
+    return status_from_files(files, locked);
+}
+
+int store_snapshot(const char *id, task_snapshot *snap)
+{
+    memset(snap, 0, sizeof(*snap));
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    DIR *d = fdopendir(tfd);
+    if (!d)
+    {
+        close(tfd);
+        return -1;
+    }
+    int fd = dirfd(d);
+
+    snap->files = read_task_files(d);
+    if ((snap->files & TASK_HAS_META) && store_read_meta_at(fd, &snap->meta) < 0)
+    {
+        snap->files &= ~TASK_HAS_META;
+        memset(&snap->meta, 0, sizeof(snap->meta));
+    }
+    if (snap->files & TASK_HAS_LOCK)
+        snap->locked = store_is_locked_at(fd);
+    snap->status = status_from_files(snap->files, snap->locked);
+    if (snap->meta.cmd_digest[0])
+        snap->ncmds = snap->meta.cmd_count;
+    else if (snap->files & TASK_HAS_COMMANDS)
+        snap->ncmds = count_lines_at(fd, "commands");
+    if (snap->files & TASK_HAS_ERROR)
+    {
+        int efd = openat(fd, "error", O_RDONLY | O_CLOEXEC);
+        if (efd >= 0)
+        {
+            ssize_t r;
+            do
+                r = read(efd, snap->error, sizeof(snap->error) - 1);
+            while (r < 0 && errno == EINTR);
+            snap->error[r > 0 ? r : 0] = '\0';
+            close(efd);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
 const char *store_status_name(task_status st)
 {
     switch (st)
@@ -537,10 +1527,28 @@ const char *store_status_name(task_status st)
             return "cancelled";
         case STATUS_PAUSED:
             return "paused";
+        case STATUS_QUEUED:
+            return "queued";
     }
     return "unknown";
 }
 
+int store_status_from_name(const char *name, task_status *st)
+{
+    static const task_status all[] = {STATUS_PENDING,   STATUS_RUNNING,   STATUS_COMPLETED,
+                                      STATUS_FAILED,    STATUS_CANCELLED, STATUS_PAUSED,
+                                      STATUS_QUEUED};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i)
+    {
+        if (strcmp(name, store_status_name(all[i])) == 0)
+        {
+            *st = all[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
 const char *store_status_color_prefix(task_status st)
 {
     if (!color_enabled())
@@ -559,6 +1567,8 @@ const char *store_status_color_prefix(task_status st)
             return "\033[90m";
         case STATUS_PAUSED:
             return "\033[36m";
+        case STATUS_QUEUED:
+            return "\033[35m";
     }
     return "";
 }
@@ -577,11 +1587,133 @@ int store_delete_task(const char *id)
 {
     if (!is_task_id(id))
         return -1;
-    char dir[PATH_MAX];
-    if (store_task_dir(id, dir, sizeof(dir)) < 0)
+    int base = store_base_fd();
+    char rel[128];
+    if (base < 0 || task_rel(id, rel, sizeof(rel)) < 0)
         return -1;
     reap_orphan_group(id);
-    return rm_rf(dir);
+    int rc = rm_rf_at(base, rel);
+    char *slash = strchr(rel, '/');
+    if (rc == 0 && slash)
+    {
+        // drop the shard with its last task
+        *slash = '\0';
+        unlinkat(base, rel, AT_REMOVEDIR);
+        touch_base();
+    }
+    return rc;
+}
+
+typedef struct
+{
+    char (*ids)[64];
+    size_t len;
+    size_t cap;
+} id_array;
+
+static int collect_id(const char *id, void *ctx)
+{
+    id_array *a = ctx;
+    if (a->len == a->cap)
+    {
+        size_t nc = a->cap ? a->cap * 2 : 256;
+        char(*ni)[64] = realloc(a->ids, nc * sizeof(*ni));
+        if (!ni)
+            return -1;
+        a->ids = ni;
+        a->cap = nc;
+    }
+    snprintf(a->ids[a->len++], sizeof(a->ids[0]), "%s", id);
+    return 0;
+}
+
+static int write_layout(store_layout layout)
+{
+    int base = store_base_fd();
+    if (base < 0)
+        return -1;
+    if (layout == STORE_LAYOUT_FLAT)
+        return (unlinkat(base, "layout", 0) < 0 && errno != ENOENT) ? -1 : 0;
+
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "layout.tmp.%d", (int)getpid());
+    int fd = openat(base, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    static const char text[] = "sharded\n";
+    int rc = (write(fd, text, sizeof(text) - 1) == (ssize_t)(sizeof(text) - 1) && fsync(fd) == 0)
+                 ? 0
+                 : -1;
+    close(fd);
+    if (rc == 0)
+        rc = renameat(base, tmp, base, "layout");
+    if (rc < 0)
+        unlinkat(base, tmp, 0);
+    return rc;
+}
+
+int store_migrate(store_layout to, size_t *moved, size_t *skipped)
+{
+    *moved = 0;
+    *skipped = 0;
+    int base = store_base_fd();
+    if (base < 0)
+        return -1;
+
+    // new tasks go to the target layout from here on
+    if (write_layout(to) < 0)
+        return -1;
+    g_layout = to;
+
+    id_array all = {0};
+    if (store_scan(collect_id, &all) < 0)
+    {
+        free(all.ids);
+        return -1;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < all.len; ++i)
+    {
+        const char *id = all.ids[i];
+        char from[128], dest[128];
+        if (task_rel(id, from, sizeof(from)) < 0 ||
+            format_rel(id, to == STORE_LAYOUT_SHARDED, dest, sizeof(dest)) < 0 ||
+            strcmp(from, dest) == 0)
+            continue;
+        // a live daemon keeps working after a move, but the rename could race its next marker
+        if (store_is_locked(id))
+        {
+            ++*skipped;
+            continue;
+        }
+        char *slash = strchr(dest, '/');
+        if (slash)
+        {
+            *slash = '\0';
+            if (mkdirat(base, dest, 0755) < 0 && errno != EEXIST)
+            {
+                rc = -1;
+                break;
+            }
+            *slash = '/';
+        }
+        if (renameat(base, from, base, dest) < 0)
+        {
+            rc = -1;
+            break;
+        }
+        slash = strchr(from, '/');
+        if (slash)
+        {
+            *slash = '\0';
+            unlinkat(base, from, AT_REMOVEDIR);
+        }
+        ++*moved;
+    }
+    free(all.ids);
+    touch_base();
+    return rc;
 }
 
 int store_list_foreign(strvec **foreign)
@@ -590,10 +1722,7 @@ int store_list_foreign(strvec **foreign)
         return -1;
     strvec *v = *foreign;
 
-    if (g_base_dir[0] == '\0' && init_base_dir() < 0)
-        return -1;
-
-    DIR *d = opendir(g_base_dir);
+    DIR *d = open_base_dir();
     if (!d)
         return (errno == ENOENT) ? 0 : -1;
 
@@ -602,7 +1731,9 @@ int store_list_foreign(strvec **foreign)
     {
         if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
             continue;
-        if (is_task_id(e->d_name))
+        if (is_task_id(e->d_name) || is_base_file(e->d_name))
+            continue;
+        if (store_is_shard_name(e->d_name) && entry_is_dir(d, e))
             continue;
         if (strvec_push(v, e->d_name) < 0)
         {
@@ -616,7 +1747,16 @@ int store_list_foreign(strvec **foreign)
 
 int store_remove_base(void)
 {
-    if (g_base_dir[0] == '\0' && init_base_dir() < 0)
+    int base = store_base_fd();
+    if (base < 0)
         return -1;
+    for (size_t i = 0; k_base_files[i]; ++i)
+    {
+        // queues is a directory of per-queue directories
+        if (unlinkat(base, k_base_files[i], 0) < 0 && (errno == EISDIR || errno == EPERM))
+            rm_rf_at(base, k_base_files[i]);
+    }
+    close(base);
+    g_base_fd = -1;
     return rmdir(g_base_dir);
 }
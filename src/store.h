@@ -5,20 +5,36 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <time.h>
 
 /*
- * Layout: $XDG_DATA_HOME/later/<id>/ (one directory per task)
- *   meta       immutable, key=value: cwd, created_at, execute_at, daemon_pid
+ * Layout: $XDG_DATA_HOME/later/<id>/ (one directory per task), or with the sharded layout
+ * $XDG_DATA_HOME/later/<YYYY-MM-DD>/<id>/, the UTC day of the id's epoch prefix.
+ *   meta       binary record (key=value text in older versions): cwd, created_at,
+ *              execute_at, daemon_pid, cmd_count, cmd_digest, cmd_preview, parallel, after, queue,
+ *              when_idle, log_max
  *   commands   immutable, one shell command per line (no '\n' allowed)
- *   log        stdout + stderr of the task
+ *   log        stdout + stderr of the task; with --capture, framed records (see capture.h)
+ *   log.1      with --log-max rotate: the previous half of the retained output (see tasklog.h)
+ *   log.dropped with --log-max: "<bytes dropped> <offset>" where they were cut out
+ *   log.gz     log (and log.1.gz, log.1) gzipped once the task is over
+ *   log.tail   the last 256KB of log, kept plain next to log.gz (see tasklog.h)
+ *   timing     appended: ready, start and per-command start times
+ *   stats      appended: resource usage of each finished command
+ *   groups     process groups of the running -j commands, one per line (see store_write_groups)
  *   lock       held by the daemon via flock; release on exit = "daemon gone"
  *   running    marker: created when the daemon starts the first command
  *   done       marker: created after all commands exit 0 (terminal: Completed)
  *   error      marker with content: failure reason (terminal: Failed)
  *   cancel     marker: created by `later --cancel` before signalling the daemon
  *   pause      marker: created by `later --pause` before SIGSTOP
+ *   queued     marker: the daemon is due but waiting for a slot in its queue (see queue.h)
+ *
+ * The base dir also holds the task catalog (see catalog.h) and, for the sharded layout, a
+ * `layout` file containing "sharded". Lookups fall back to the other layout, so tasks left
+ * behind by an interrupted or partial migration stay reachable.
  */
 
 typedef enum
@@ -28,33 +44,156 @@ typedef enum
     STATUS_COMPLETED,
     STATUS_FAILED,
     STATUS_CANCELLED,
-    STATUS_PAUSED
+    STATUS_PAUSED,
+    STATUS_QUEUED
 } task_status;
 
+typedef enum
+{
+    STORE_LAYOUT_FLAT,
+    STORE_LAYOUT_SHARDED
+} store_layout;
+
+/* How hard task creation works to survive a crash (--durability / $LATER_DURABILITY):
+ *   strict   fsync every file and the task dir as it is written (default)
+ *   relaxed  skip per-file fsyncs; the daemon issues one store_sync() before reporting ready
+ *   batched  skip them too; the submitting process calls store_sync() once for all its tasks
+ * Only strict orders later markers (done, error...) on disk; a crash in the other modes can
+ * lose a status marker, which resolves as failed. */
+typedef enum
+{
+    STORE_DURABILITY_STRICT,
+    STORE_DURABILITY_RELAXED,
+    STORE_DURABILITY_BATCHED
+} store_durability;
+
+// upper bound for task_meta.parallel
+#define TASK_MAX_PARALLEL 256
+
+/* --when-idle thresholds, see idle.h. */
+typedef struct
+{
+    int cpu, memory, io; // PSI "some avg10" must stay below this percentage; 0 = not checked
+    long long mem_kb;    // MemAvailable must be at least this; 0 = not checked
+    int max_s;           // start anyway after waiting this long; 0 = --when-idle not used
+} task_idle;
+
+/* What a task's log keeps once it reaches --log-max (see tasklog.h). */
+typedef enum
+{
+    LOG_KEEP_ALL, // no --log-max: the log grows without bound
+    LOG_ROTATE,
+    LOG_HEAD_TAIL,
+    LOG_RING
+} task_log_policy;
+
 typedef struct
 {
     char id[64];
     char cwd[PATH_MAX];
     time_t created_at;
     time_t execute_at;
-    pid_t daemon_pid;
+    int execute_ms;   // millisecond within execute_at
+    pid_t daemon_pid; // 0 while a supervised task waits in the supervisor
+    int supervised;   // created through the supervisor (see supervisor.h)
+    int parallel;     // commands run at once, see exec.h; 0 or 1 = one after another
+    int one_shell;    // run the commands in order in a single shell (see exec.h)
+    char after[1024]; // comma-separated ids of tasks that must finish first; empty for none
+    int after_ok;     // ...and must have completed, or this task fails without running
+    char queue[32];   // named queue bounding concurrency (see queue.h); empty for none
+    int priority;     // place in the queue's line, higher first
+    task_idle idle;   // wait for a quiet machine before starting
+    unsigned long long log_max; // bytes of output the log retains; 0 = all
+    task_log_policy log_policy; // how it stays under log_max; LOG_KEEP_ALL if log_max is 0
+    int capture;      // log is framed records of each command's stdout and stderr (capture.h)
+    // summary of the commands file, so listing never has to open it
+    size_t cmd_count;
+    char cmd_digest[17]; // hex FNV-1a of the commands file; empty if not recorded
+    char cmd_preview[64]; // first command, truncated
 } task_meta;
 
+/* Files found in a task dir, as reported by store_snapshot. */
+enum
+{
+    TASK_HAS_META = 1u << 0,
+    TASK_HAS_COMMANDS = 1u << 1,
+    TASK_HAS_LOCK = 1u << 2,
+    TASK_HAS_RUNNING = 1u << 3,
+    TASK_HAS_DONE = 1u << 4,
+    TASK_HAS_ERROR = 1u << 5,
+    TASK_HAS_CANCEL = 1u << 6,
+    TASK_HAS_PAUSE = 1u << 7,
+    TASK_HAS_QUEUED = 1u << 8
+};
+
+/* Everything the listing-driven commands need about one task, read in a single pass. */
+typedef struct
+{
+    task_meta meta; // zeroed unless TASK_HAS_META
+    unsigned files; // TASK_HAS_* bits
+    int locked;     // daemon holds the lock
+    task_status status;
+    size_t ncmds;
+    char error[512]; // content of the error marker, if any
+} task_snapshot;
+
 /* Base dir: $XDG_DATA_HOME/later or $HOME/.local/share/later */
 int store_ensure_base(void);
 const char *store_base_dir(void);
 int store_task_dir(const char *id, char *buf, size_t n);
 int store_path_in_task(const char *id, const char *name, char *buf, size_t n);
 
+/* The base dir is opened once per process (cached, O_CLOEXEC) and task dirs are opened
+ * relative to it, so per-task operations never re-walk the path from $HOME.
+ * store_open_task returns a new O_DIRECTORY fd the caller must close; the *_at functions
+ * below take such an fd. */
+int store_base_fd(void);
+int store_open_task(const char *id);
+
+store_layout store_get_layout(void);
+int store_is_shard_name(const char *name);
+/* mkdir the task dir (and its shard) for id; an existing dir is not an error. */
+int store_create_task_dir(const char *id);
+/* Write the layout file and move every task that isn't live into the layout `to`.
+ * Live tasks are counted in *skipped and stay reachable where they are. */
+int store_migrate(store_layout to, size_t *moved, size_t *skipped);
+
+void store_set_durability(store_durability d);
+store_durability store_get_durability(void);
+/* Return -1 if name is not strict, relaxed or batched. */
+int store_durability_from_name(const char *name, store_durability *d);
+const char *store_log_policy_name(task_log_policy p);
+/* Return -1 if name is not rotate, head-tail or ring. */
+int store_log_policy_from_name(const char *name, task_log_policy *p);
+
+/* Flush everything written to the store's filesystem (syncfs on Linux, sync elsewhere). */
+int store_sync(void);
+
 /* Daemon liveness via advisory file lock. */
 int store_acquire_lock(const char *id);
 int store_is_locked(const char *id);
+int store_is_locked_at(int task_fd);
+
+/* Fill meta's cmd_count, cmd_digest and cmd_preview from the commands about to be stored. */
+void store_meta_set_commands(task_meta *meta, char *const *cmds, size_t n);
+/* Hex digest of cmds as store_write_commands() lays them out on disk. */
+void store_commands_digest(char *const *cmds, size_t n, char *buf, size_t bufsz);
 
 int store_write_meta(const task_meta *meta);
 int store_read_meta(const char *id, task_meta *meta);
+int store_read_meta_at(int task_fd, task_meta *meta);
+/* meta is stored as a binary record; this prints the key=value form older versions wrote. */
+void store_format_meta(const task_meta *meta, FILE *out);
 
-/* Return 1 if the task's process group still has a live member that belongs to this task. */
+/* Return 1 if the task's process group, or the group of one of its -j commands, still has a
+ * live member that belongs to this task. */
 int store_task_group_alive(const char *id);
+/* -j commands run in process groups of their own, so that fail-fast stops whole command trees;
+ * the daemon keeps the groups of those running listed here (n == 0 removes the list). */
+int store_write_groups(const char *id, const pid_t *pgids, size_t n);
+/* Send sig to the task's process group and to those of its running -j commands. Return 0 if
+ * any of them got it, else -1 with errno from signalling the task's group. */
+int store_signal_task(const task_meta *meta, int sig);
 
 int store_write_commands(const char *id, char *const *cmds, size_t n);
 int store_read_commands(const char *id, strvec **cmds);
@@ -63,15 +202,67 @@ int store_read_commands(const char *id, strvec **cmds);
 int store_create_marker(const char *id, const char *name);
 int store_create_marker_with_content(const char *id, const char *name, const char *content);
 int store_has_marker(const char *id, const char *name);
+int store_has_marker_at(int task_fd, const char *name);
 ssize_t store_read_marker(const char *id, const char *name, char *buf, size_t n);
 int store_remove_marker(const char *id, const char *name);
 
+/* Timing file: key=value lines appended by the task's writer as events happen, never
+ * rewritten, so a reader sees whatever has been recorded so far. */
+typedef struct
+{
+    long long ready_us; // from spawn to the task being persisted and ready; -1 if not recorded
+    long long released_us; // wall clock when --after upstreams or a full queue let it go; or 0
+    long long start_us; // wall clock (epoch us) just before the running marker; 0 if not started
+    long long *cmd_us;  // wall clock at which command i started, 0 if it did not; ncmd_us entries
+    size_t ncmd_us;
+} task_timing;
+
+int store_append_timing(const char *id, const char *key, long long value);
+int store_append_command_start(const char *id, size_t cmd, long long us);
+/* Return 0 with t filled (all unset if the task has no timing file), -1 on error. */
+int store_read_timing(const char *id, task_timing *t);
+void store_timing_free(task_timing *t);
+
+/* Stats file: one line of resource usage per finished command, appended by the task's writer. */
+typedef struct
+{
+    size_t cmd;    // 0-based command index
+    int exit_code;
+    long long wall_us;
+    long long user_us;
+    long long sys_us;
+    long max_rss_kb; // peak of the largest single process, not a sum
+    long major_faults;
+    long vol_cs;     // voluntary context switches
+    long invol_cs;   // involuntary context switches
+    long in_blocks;  // block input operations
+    long out_blocks; // block output operations
+} task_usage;
+
+int store_append_usage(const char *id, const task_usage *u);
+/* Allocate *out with every recorded command in order; *n is 0 if nothing was recorded. */
+int store_read_usage(const char *id, task_usage **out, size_t *n);
+
+/* Call fn for every task dir in the base dir, in readdir order; stop early if fn returns < 0. */
+typedef int (*store_scan_fn)(const char *id, void *ctx);
+int store_scan(store_scan_fn fn, void *ctx);
+/* Same, limited to ids whose epoch prefix is within [since, until] (0 = unbounded); shards
+ * outside the range are not opened. */
+int store_scan_range(time_t since, time_t until, store_scan_fn fn, void *ctx);
+
 /* Allocate *list and fill it with task ids sorted by created_at. */
 int store_list(strvec **list);
 
 task_status store_resolve_status(const char *id);
+task_status store_resolve_status_at(int task_fd);
+
+/* Read the task dir once (one readdir) and fill snap from what is there.
+ * Return 0 on success, -1 if the task dir cannot be opened. */
+int store_snapshot(const char *id, task_snapshot *snap);
 
 const char *store_status_name(task_status st);
+/* Inverse of store_status_name. Return 0 on success, -1 if name is unknown. */
+int store_status_from_name(const char *name, task_status *st);
 const char *store_status_color_prefix(task_status st);
 const char *store_status_color_suffix(void);
 int store_status_is_final(task_status st);
@@ -79,8 +270,10 @@ int store_status_is_final(task_status st);
 /* Recursive rm of the task directory. */
 int store_delete_task(const char *id);
 
+/* Entries in the base dir that are neither task dirs nor files owned by later itself. */
 int store_list_foreign(strvec **foreign);
 
+/* Remove later's own files from the base dir, then the (now empty) base dir. */
 int store_remove_base(void);
 
 #endif // LATER_STORE_H_
@@ -0,0 +1,917 @@
+#include "supervisor.h"
+
+#include "catalog.h"
+#include "daemon.h"
+#include "store.h"
+#include "timefmt.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// the longest the loop sleeps; without a wall timer, a clock jump delays a task by at most this
+#define MAX_WAIT_MS 60000
+
+static int socket_addr(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/supervisor.sock",
+                     store_base_dir());
+    if (n < 0 || (size_t)n >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static void no_sigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+    (void)fd;
+#endif
+}
+
+static int connect_supervisor(void)
+{
+    struct sockaddr_un addr;
+    if (socket_addr(&addr) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    no_sigpipe(fd);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send one request line, with pass_fd attached when it is >= 0. */
+static int send_line(int fd, const char *line, int pass_fd)
+{
+    struct iovec iov = {(void *)line, strlen(line)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    if (pass_fd >= 0)
+    {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &pass_fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do
+        n = sendmsg(fd, &msg, SEND_FLAGS);
+    while (n < 0 && errno == EINTR);
+    return n == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/* Read one '\n'-terminated line (without the newline). A received fd goes to *got_fd. */
+static int recv_line(int fd, char *buf, size_t n, int *got_fd)
+{
+    size_t off = 0;
+    if (got_fd)
+        *got_fd = -1;
+    while (off + 1 < n)
+    {
+        struct iovec iov = {buf + off, n - 1 - off};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        union
+        {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        ssize_t r = recvmsg(fd, &msg, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            int passed;
+            memcpy(&passed, CMSG_DATA(c), sizeof(int));
+            if (got_fd && *got_fd < 0)
+                *got_fd = passed;
+            else
+                close(passed);
+        }
+
+        char *nl = memchr(buf + off, '\n', (size_t)r);
+        off += (size_t)r;
+        if (nl)
+        {
+            *nl = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* One request/reply round trip. Return 0 for "ok...", 1 for "err...", -1 if unreachable. */
+static int call(const char *req, int pass_fd, char *reply, size_t n)
+{
+    int fd = connect_supervisor();
+    if (fd < 0)
+        return -1;
+    char local[256];
+    if (!reply)
+    {
+        reply = local;
+        n = sizeof(local);
+    }
+    int rc = -1;
+    if (send_line(fd, req, pass_fd) == 0 && recv_line(fd, reply, n, NULL) == 0)
+        rc = strncmp(reply, "ok", 2) == 0 ? 0 : 1;
+    close(fd);
+    return rc;
+}
+
+static int call_id(const char *verb, const char *id)
+{
+    char req[128];
+    snprintf(req, sizeof(req), "%s %s\n", verb, id);
+    return call(req, -1, NULL, 0) == 0 ? 0 : -1;
+}
+
+int supervisor_cancel(const char *id)
+{
+    return call_id("cancel", id);
+}
+
+int supervisor_pause(const char *id)
+{
+    return call_id("pause", id);
+}
+
+int supervisor_resume(const char *id)
+{
+    return call_id("resume", id);
+}
+
+int supervisor_status(pid_t *pid, size_t *pending)
+{
+    char reply[128];
+    if (call("status\n", -1, reply, sizeof(reply)) != 0)
+        return -1;
+    long long p = 0;
+    unsigned long long k = 0;
+    if (sscanf(reply, "ok %lld %llu", &p, &k) != 2)
+        return -1;
+    *pid = (pid_t)p;
+    *pending = (size_t)k;
+    return 0;
+}
+
+int supervisor_task_cmp(const void *a, const void *b)
+{
+    return strcmp(((const supervisor_task *)a)->id, ((const supervisor_task *)b)->id);
+}
+
+int supervisor_list(supervisor_task **tasks, size_t *n)
+{
+    *tasks = NULL;
+    *n = 0;
+    int fd = connect_supervisor();
+    if (fd < 0)
+        return -1;
+    FILE *f = NULL;
+    if (send_line(fd, "list\n", -1) < 0 || !(f = fdopen(fd, "r")))
+    {
+        close(fd);
+        return -1;
+    }
+
+    int rc = -1;
+    size_t cap = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, "ok", 2) == 0)
+        {
+            rc = 0;
+            break;
+        }
+        if (*n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            supervisor_task *ni = realloc(*tasks, cap * sizeof(*ni));
+            if (!ni)
+                break;
+            *tasks = ni;
+        }
+        supervisor_task *t = &(*tasks)[*n];
+        long long at;
+        if (sscanf(line, "%63s %lld %d", t->id, &at, &t->paused) == 3)
+        {
+            t->execute_at = (time_t)at;
+            ++*n;
+        }
+    }
+    fclose(f);
+    if (rc < 0)
+    {
+        free(*tasks);
+        *tasks = NULL;
+        *n = 0;
+        return -1;
+    }
+    qsort(*tasks, *n, sizeof(**tasks), supervisor_task_cmp);
+    return 0;
+}
+
+int supervisor_add(task_meta *meta, char *const *cmds, size_t ncmds, char *err, size_t errsz)
+{
+    // connect first so nothing is written when there is no supervisor to take the task
+    long long spawned_us = mono_now_us();
+    int fd = connect_supervisor();
+    if (fd < 0)
+        return 1;
+
+    int lock_fd = daemon_prepare_supervised(meta, cmds, ncmds, err, errsz);
+    if (lock_fd < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char req[128], reply[256] = "";
+    snprintf(req, sizeof(req), "add %s\n", meta->id);
+    int rc = -1;
+    if (send_line(fd, req, lock_fd) == 0 && recv_line(fd, reply, sizeof(reply), NULL) == 0)
+        rc = strncmp(reply, "ok", 2) == 0 ? 0 : -1;
+    close(fd);
+    // the supervisor now holds its own reference to the lock
+    close(lock_fd);
+
+    if (rc < 0)
+    {
+        snprintf(err, errsz, "supervisor did not take the task%s%s", reply[0] ? ": " : "",
+                 reply[0] ? reply : "");
+        store_create_marker_with_content(meta->id, "error", err);
+        catalog_set_status(meta->id, STATUS_FAILED);
+    }
+    else
+    {
+        // ready once the supervisor holds it; nothing else writes the task before it fires
+        store_append_timing(meta->id, "ready_us", mono_now_us() - spawned_us);
+    }
+    return rc;
+}
+
+/* --- the supervisor process --- */
+
+typedef struct
+{
+    char id[64];
+    long long at; // epoch ms
+    int lock_fd;
+    int paused;
+} sv_task;
+
+typedef struct
+{
+    sv_task *items;
+    size_t len;
+    size_t cap;
+} sv_vec;
+
+static sv_vec g_heap;   // min-heap on at
+static sv_vec g_parked; // came due while paused; fired on resume
+static int g_listen_fd = -1;
+static int g_self_lock_fd = -1;
+static int g_client_fd = -1;
+static int g_timer_fd = -1; // CLOCK_REALTIME timer for the heap top; also fires on clock changes
+static volatile sig_atomic_t g_child_exited;
+
+static void sv_log(const char *fmt, ...)
+{
+    char now[64];
+    timefmt_format_time(time(NULL), now, sizeof(now));
+    fprintf(stderr, "[%s] ", now);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static int vec_push(sv_vec *v, const sv_task *t)
+{
+    if (v->len == v->cap)
+    {
+        size_t nc = v->cap ? v->cap * 2 : 256;
+        sv_task *ni = realloc(v->items, nc * sizeof(*ni));
+        if (!ni)
+            return -1;
+        v->items = ni;
+        v->cap = nc;
+    }
+    v->items[v->len++] = *t;
+    return 0;
+}
+
+static void heap_swap(size_t a, size_t b)
+{
+    sv_task t = g_heap.items[a];
+    g_heap.items[a] = g_heap.items[b];
+    g_heap.items[b] = t;
+}
+
+static void heap_up(size_t i)
+{
+    while (i > 0 && g_heap.items[(i - 1) / 2].at > g_heap.items[i].at)
+    {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(size_t i)
+{
+    while (1)
+    {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < g_heap.len && g_heap.items[l].at < g_heap.items[m].at)
+            m = l;
+        if (r < g_heap.len && g_heap.items[r].at < g_heap.items[m].at)
+            m = r;
+        if (m == i)
+            return;
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static int heap_push(const sv_task *t)
+{
+    if (vec_push(&g_heap, t) < 0)
+        return -1;
+    heap_up(g_heap.len - 1);
+    return 0;
+}
+
+static sv_task heap_remove(size_t i)
+{
+    sv_task t = g_heap.items[i];
+    g_heap.items[i] = g_heap.items[--g_heap.len];
+    if (i < g_heap.len)
+    {
+        heap_up(i);
+        heap_down(i);
+    }
+    return t;
+}
+
+static sv_task parked_remove(size_t i)
+{
+    sv_task t = g_parked.items[i];
+    g_parked.items[i] = g_parked.items[--g_parked.len];
+    return t;
+}
+
+/* Find id: returns its index and sets *in_heap, or -1. */
+static long find_task(const char *id, int *in_heap)
+{
+    for (size_t i = 0; i < g_heap.len; ++i)
+    {
+        if (strcmp(g_heap.items[i].id, id) == 0)
+        {
+            *in_heap = 1;
+            return (long)i;
+        }
+    }
+    for (size_t i = 0; i < g_parked.len; ++i)
+    {
+        if (strcmp(g_parked.items[i].id, id) == 0)
+        {
+            *in_heap = 0;
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/* In a freshly forked runner: drop every fd that belongs to the supervisor or other tasks. */
+static void close_inherited(int keep)
+{
+    for (size_t i = 0; i < g_heap.len; ++i)
+        if (g_heap.items[i].lock_fd != keep)
+            close(g_heap.items[i].lock_fd);
+    for (size_t i = 0; i < g_parked.len; ++i)
+        if (g_parked.items[i].lock_fd != keep)
+            close(g_parked.items[i].lock_fd);
+    close(g_listen_fd);
+    close(g_self_lock_fd);
+    if (g_timer_fd >= 0)
+        close(g_timer_fd);
+    if (g_client_fd >= 0)
+        close(g_client_fd);
+}
+
+/* Fork t's runner; the runner inherits the lock, so ours is closed. Return -1 if the fork
+ * failed (t is untouched and still owned by the caller). */
+static int fire(const sv_task *t)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        sv_log("fork for %s: %s", t->id, strerror(errno));
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close_inherited(t->lock_fd);
+        daemon_run_supervised(t->id, t->lock_fd);
+        _exit(1);
+    }
+    close(t->lock_fd);
+    return 0;
+}
+
+/* Fire every due task; return how long the loop may sleep. */
+static int run_due(void)
+{
+    while (g_heap.len > 0)
+    {
+        long long now = wall_now_ms();
+        sv_task *top = &g_heap.items[0];
+        if (top->at > now)
+        {
+            if (g_timer_fd >= 0 && wall_timer_arm(g_timer_fd, top->at) == 0)
+                return -1;
+            long long ms = top->at - now;
+            return ms > MAX_WAIT_MS ? MAX_WAIT_MS : (int)ms;
+        }
+
+        // the markers are authoritative; a request that never reached us still counts
+        if (store_has_marker(top->id, "cancel") == 1)
+        {
+            sv_task t = heap_remove(0);
+            close(t.lock_fd);
+            continue;
+        }
+        if (top->paused || store_has_marker(top->id, "pause") == 1)
+        {
+            sv_task t = heap_remove(0);
+            t.paused = 1;
+            if (vec_push(&g_parked, &t) < 0)
+                close(t.lock_fd);
+            continue;
+        }
+        if (fire(top) < 0)
+            break;
+        heap_remove(0);
+    }
+    if (g_timer_fd >= 0)
+        wall_timer_arm(g_timer_fd, 0);
+    return g_heap.len > 0 ? 1000 : MAX_WAIT_MS;
+}
+
+static void reply(int fd, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    size_t len = strlen(buf);
+    if (len + 1 < sizeof(buf))
+    {
+        buf[len++] = '\n';
+        buf[len] = '\0';
+    }
+    send(fd, buf, len, SEND_FLAGS);
+}
+
+static int take_task(const char *id, int lock_fd)
+{
+    task_meta meta;
+    if (store_read_meta(id, &meta) < 0)
+        return -1;
+    sv_task t = {{0}, (long long)meta.execute_at * 1000 + meta.execute_ms, lock_fd,
+                 store_has_marker(id, "pause") == 1};
+    snprintf(t.id, sizeof(t.id), "%s", id);
+    return heap_push(&t);
+}
+
+/* Serve one client. Return 1 when the supervisor should exit (2: after handing tasks off). */
+static int handle_client(int fd)
+{
+    struct timeval tv = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    no_sigpipe(fd);
+
+    char line[256];
+    int passed = -1;
+    if (recv_line(fd, line, sizeof(line), &passed) < 0)
+    {
+        if (passed >= 0)
+            close(passed);
+        return 0;
+    }
+
+    char verb[16] = "", id[64] = "";
+    sscanf(line, "%15s %63s", verb, id);
+    int in_heap = 0;
+    long i = id[0] ? find_task(id, &in_heap) : -1;
+    int rc = 0;
+
+    if (strcmp(verb, "add") == 0)
+    {
+        if (passed < 0 || !id[0])
+            reply(fd, "err missing task or lock");
+        else if (take_task(id, passed) < 0)
+            reply(fd, "err cannot read task %s", id);
+        else
+        {
+            passed = -1;
+            reply(fd, "ok");
+        }
+    }
+    else if (strcmp(verb, "cancel") == 0)
+    {
+        if (i < 0)
+            reply(fd, "err not held");
+        else
+        {
+            sv_task t = in_heap ? heap_remove((size_t)i) : parked_remove((size_t)i);
+            close(t.lock_fd);
+            reply(fd, "ok");
+        }
+    }
+    else if (strcmp(verb, "pause") == 0)
+    {
+        if (i < 0)
+            reply(fd, "err not held");
+        else
+        {
+            if (in_heap)
+                g_heap.items[i].paused = 1;
+            reply(fd, "ok");
+        }
+    }
+    else if (strcmp(verb, "resume") == 0)
+    {
+        if (i < 0)
+            reply(fd, "err not held");
+        else if (in_heap)
+        {
+            g_heap.items[i].paused = 0;
+            reply(fd, "ok");
+        }
+        else
+        {
+            // already due: run it now, back through the heap so a failed fork is retried
+            sv_task t = parked_remove((size_t)i);
+            t.paused = 0;
+            if (heap_push(&t) < 0)
+                close(t.lock_fd);
+            reply(fd, "ok");
+        }
+    }
+    else if (strcmp(verb, "list") == 0)
+    {
+        const sv_vec *vs[] = {&g_heap, &g_parked};
+        for (size_t v = 0; v < 2; ++v)
+            for (size_t k = 0; k < vs[v]->len; ++k)
+                reply(fd, "%s %lld %d", vs[v]->items[k].id, vs[v]->items[k].at / 1000,
+                      vs[v]->items[k].paused);
+        reply(fd, "ok");
+    }
+    else if (strcmp(verb, "status") == 0)
+    {
+        reply(fd, "ok %lld %zu", (long long)getpid(), g_heap.len + g_parked.len);
+    }
+    else if (strcmp(verb, "stop") == 0)
+    {
+        reply(fd, "ok");
+        rc = 2;
+    }
+    else if (strcmp(verb, "exit") == 0)
+    {
+        reply(fd, "ok");
+        rc = 1;
+    }
+    else
+    {
+        reply(fd, "err unknown request");
+    }
+
+    if (passed >= 0)
+        close(passed);
+    return rc;
+}
+
+/* Every supervised task that is pending on disk but whose lock nobody holds (the previous
+ * supervisor died) is taken back. */
+static int adopt_one(const char *id, void *ctx)
+{
+    (void)ctx;
+    task_snapshot snap;
+    if (store_snapshot(id, &snap) < 0 || !(snap.files & TASK_HAS_META))
+        return 0;
+    if (!snap.meta.supervised || snap.meta.daemon_pid > 0 || snap.locked ||
+        (snap.files & (TASK_HAS_RUNNING | TASK_HAS_DONE | TASK_HAS_ERROR | TASK_HAS_CANCEL)))
+        return 0;
+    int lock_fd = store_acquire_lock(id);
+    if (lock_fd < 0)
+        return 0;
+    if (take_task(id, lock_fd) < 0)
+        close(lock_fd);
+    else
+        catalog_refresh(id);
+    return 0;
+}
+
+static void on_sigchld(int sig)
+{
+    (void)sig;
+    g_child_exited = 1;
+}
+
+static void reap_runners(void)
+{
+    g_child_exited = 0;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+}
+
+/* Give every held task its own runner, which sleeps until execute_at like a daemon would. */
+static void hand_off_all(void)
+{
+    sv_vec *vs[] = {&g_heap, &g_parked};
+    for (size_t v = 0; v < 2; ++v)
+    {
+        while (vs[v]->len > 0)
+        {
+            sv_task t = vs[v]->items[--vs[v]->len];
+            if (fire(&t) < 0)
+                close(t.lock_fd);
+        }
+    }
+}
+
+static void raise_fd_limit(void)
+{
+    // every pending task keeps its lock open here
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+#ifdef __APPLE__
+        if (rl.rlim_cur > OPEN_MAX)
+            rl.rlim_cur = OPEN_MAX;
+#endif
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void report(int ready_fd, const char *msg)
+{
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%s", msg);
+    if (n > 0 && write(ready_fd, buf, (size_t)n) < 0)
+    {
+        // nobody left to tell
+    }
+    close(ready_fd);
+}
+
+static void run_supervisor(int ready_fd)
+{
+    int base = store_base_fd();
+    g_self_lock_fd =
+        base < 0 ? -1 : openat(base, "supervisor.lock", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (g_self_lock_fd < 0 || flock(g_self_lock_fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        report(ready_fd, "ealready running");
+        _exit(1);
+    }
+
+    struct sockaddr_un addr;
+    if (socket_addr(&addr) < 0)
+    {
+        report(ready_fd, "esocket path too long");
+        _exit(1);
+    }
+    // whoever holds supervisor.lock owns the socket name, so a leftover one is stale
+    unlink(addr.sun_path);
+    g_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (g_listen_fd < 0 || fcntl(g_listen_fd, F_SETFD, FD_CLOEXEC) < 0 ||
+        bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(g_listen_fd, 64) < 0)
+    {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "e%s: %s", addr.sun_path, strerror(errno));
+        report(ready_fd, msg);
+        _exit(1);
+    }
+    chmod(addr.sun_path, 0600);
+
+    if (chdir("/") < 0)
+    {
+        report(ready_fd, "echdir /");
+        _exit(1);
+    }
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int log_fd = openat(base, "supervisor.log", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (devnull >= 0)
+    {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+    if (log_fd >= 0)
+    {
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL); // no SA_RESTART: an exiting runner wakes poll()
+    raise_fd_limit();
+
+    g_timer_fd = wall_timer_open();
+    store_scan(adopt_one, NULL);
+    sv_log("supervisor %d started with %zu task(s)", (int)getpid(), g_heap.len);
+    report(ready_fd, "k");
+
+    int quit = 0;
+    while (!quit)
+    {
+        if (g_child_exited)
+            reap_runners();
+        int timeout = run_due();
+
+        struct pollfd p[2] = {{g_listen_fd, POLLIN, 0}, {g_timer_fd, POLLIN, 0}};
+        int n = poll(p, g_timer_fd >= 0 ? 2 : 1, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            sv_log("poll: %s", strerror(errno));
+            break;
+        }
+        if (n <= 0 || !(p[0].revents & POLLIN))
+            continue; // expiry or clock change: run_due re-arms (and drains) the timer
+        g_client_fd = accept(g_listen_fd, NULL, NULL);
+        if (g_client_fd < 0)
+            continue;
+        fcntl(g_client_fd, F_SETFD, FD_CLOEXEC);
+        quit = handle_client(g_client_fd);
+        close(g_client_fd);
+        g_client_fd = -1;
+    }
+
+    unlink(addr.sun_path);
+    if (quit == 2)
+    {
+        sv_log("handing %zu task(s) to their own daemons", g_heap.len + g_parked.len);
+        hand_off_all();
+    }
+    sv_log("supervisor %d stopped", (int)getpid());
+    _exit(0);
+}
+
+int supervisor_start(void)
+{
+    if (store_ensure_base() < 0)
+    {
+        fprintf(stderr, "Error: cannot create data dir at %s\n", store_base_dir());
+        return -1;
+    }
+    pid_t running;
+    size_t pending;
+    if (supervisor_status(&running, &pending) == 0)
+    {
+        printf("Supervisor already running (pid %d)\n", (int)running);
+        return 0;
+    }
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        fprintf(stderr, "Error: pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        setsid();
+        pid_t again = fork();
+        if (again != 0)
+            _exit(again < 0 ? 1 : 0);
+        run_supervisor(pipefd[1]);
+        _exit(1);
+    }
+
+    close(pipefd[1]);
+    char msg[512];
+    size_t off = 0;
+    ssize_t r;
+    while (off < sizeof(msg) - 1 &&
+           ((r = read(pipefd[0], msg + off, sizeof(msg) - 1 - off)) > 0 || (r < 0 && errno == EINTR)))
+        off += r > 0 ? (size_t)r : 0;
+    msg[off] = '\0';
+    close(pipefd[0]);
+    waitpid(pid, NULL, 0);
+
+    if (off == 0 || msg[0] != 'k')
+    {
+        fprintf(stderr, "Error: supervisor failed to start%s%s\n", off > 1 ? ": " : "",
+                off > 1 ? msg + 1 : "");
+        return -1;
+    }
+    if (supervisor_status(&running, &pending) == 0)
+        printf("Supervisor started (pid %d, %zu pending task(s))\n", (int)running, pending);
+    return 0;
+}
+
+int supervisor_stop(int handoff)
+{
+    if (call(handoff ? "stop\n" : "exit\n", -1, NULL, 0) != 0)
+        return 1;
+
+    // it has exited once its lock is free; until then it may still be handing tasks off
+    int base = store_base_fd();
+    int fd = base < 0 ? -1 : openat(base, "supervisor.lock", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    int rc = -1;
+    for (int waited = 0; waited < 10000; waited += 20)
+    {
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0)
+        {
+            rc = 0;
+            break;
+        }
+        struct timespec ts = {0, 20 * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,56 @@
+#ifndef LATER_SUPERVISOR_H_
+#define LATER_SUPERVISOR_H_
+
+#include "store.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Opt-in per-user supervisor (`later --supervisor start`). While it runs, new tasks are not
+ * given a sleeping daemon each: the creating process writes the task dir as usual, takes the
+ * task's lock and passes the lock fd over $base/supervisor.sock. The supervisor keeps every
+ * pending task in a min-heap on execute_at, holding its lock so status resolution is
+ * unchanged, and forks the task's runner (daemon_run_supervised) only when it is due.
+ *
+ * Supervised tasks record daemon_pid 0 until their runner starts; cancel, pause and resume
+ * talk to the supervisor for them and signal the runner afterwards, as for any task.
+ * On `stop` the supervisor hands each pending task to its own sleeping runner; tasks orphaned
+ * by a crash are adopted again by the next `start`.
+ *
+ * Requests are single lines on the socket; every reply starts with "ok" or "err".
+ */
+
+typedef struct
+{
+    char id[64];
+    time_t execute_at;
+    int paused;
+} supervisor_task;
+
+/* Start the supervisor in the background unless one is running. Return 0 on success. */
+int supervisor_start(void);
+/* Stop a running supervisor; with handoff, its pending tasks continue as ordinary daemons,
+ * otherwise they are dropped (their locks released). Waits until it has exited.
+ * Return 0 if it stopped, 1 if none was running, -1 on failure. */
+int supervisor_stop(int handoff);
+/* Return 0 and fill *pid and *pending if a supervisor answers, -1 otherwise. */
+int supervisor_status(pid_t *pid, size_t *pending);
+
+/* Create meta's task under the supervisor. Return 0 on success, 1 if no supervisor is running
+ * (nothing was written), or -1 with err set. */
+int supervisor_add(task_meta *meta, char *const *cmds, size_t ncmds, char *err, size_t errsz);
+
+/* Return 0 if the supervisor held id and applied the request, -1 if it is not holding it
+ * (already handed to its runner, or no supervisor). */
+int supervisor_cancel(const char *id);
+int supervisor_pause(const char *id);
+int supervisor_resume(const char *id);
+
+/* Allocate *tasks with everything the supervisor holds, sorted by id for bsearch.
+ * Return 0 on success, -1 if no supervisor answers. */
+int supervisor_list(supervisor_task **tasks, size_t *n);
+int supervisor_task_cmp(const void *a, const void *b);
+
+#endif // LATER_SUPERVISOR_H_
@@ -0,0 +1,624 @@
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range
+#endif
+
+#include "tasklog.h"
+
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef LATER_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// how long the daemon waits for the writer to store its tail before reporting the task done
+#define TASKLOG_FLUSH_MS 2000
+#define TASKLOG_READ_SIZE 65536
+// smaller logs are left as they are; gzip would hardly shrink them
+#define TASKLOG_COMPRESS_MIN 4096
+// how much of the end of a compressed log is also kept plain in log.tail
+#define TASKLOG_TAIL_SIZE (256 * 1024)
+
+// the writer of this process's output, and a pipe that hangs up when it exits
+static pid_t g_writer = -1;
+static int g_writer_done = -1;
+
+/* The last cap bytes seen, oldest first from start. */
+typedef struct
+{
+    char *buf;
+    size_t cap, start, len;
+    unsigned long long seen;
+} byte_ring;
+
+static void ring_put(byte_ring *r, const char *data, size_t n)
+{
+    r->seen += n;
+    if (n >= r->cap)
+    {
+        memcpy(r->buf, data + n - r->cap, r->cap);
+        r->start = 0;
+        r->len = r->cap;
+        return;
+    }
+    size_t end = (r->start + r->len) % r->cap;
+    size_t first = r->cap - end < n ? r->cap - end : n;
+    memcpy(r->buf + end, data, first);
+    memcpy(r->buf, data + first, n - first);
+    if (r->len + n > r->cap)
+    {
+        r->start = (r->start + r->len + n - r->cap) % r->cap;
+        r->len = r->cap;
+    }
+    else
+        r->len += n;
+}
+
+static void ring_flush(const byte_ring *r, int fd)
+{
+    size_t first = r->cap - r->start < r->len ? r->cap - r->start : r->len;
+    write_all(fd, r->buf + r->start, first);
+    write_all(fd, r->buf, r->len - first);
+}
+
+/* Replace log.dropped; a reader sees the old note or the new one, never half of one. */
+static void write_dropped(int tfd, unsigned long long bytes, unsigned long long at)
+{
+    char text[64];
+    int len = snprintf(text, sizeof(text), "%llu %llu\n", bytes, at);
+    int fd = openat(tfd, "log.dropped.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    int rc = write_all(fd, text, (size_t)len);
+    close(fd);
+    if (rc < 0 || renameat(tfd, "log.dropped.tmp", tfd, "log.dropped") < 0)
+        unlinkat(tfd, "log.dropped.tmp", 0);
+}
+
+static unsigned long long size_at(int tfd, const char *name)
+{
+    struct stat st;
+    return fstatat(tfd, name, &st, 0) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+/* Copy in to the task's log under policy until every writer of in has gone. */
+static void run_writer(int in, int tfd, task_log_policy policy, unsigned long long max)
+{
+    int log = openat(tfd, "log", O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log < 0)
+        return;
+
+    // a supervised task's log already exists; what is in it counts toward the first half
+    unsigned long long half = max / 2;
+    unsigned long long size = size_at(tfd, "log");
+    unsigned long long dropped = 0;
+    unsigned long long head_left = policy == LOG_HEAD_TAIL && size < half ? half - size : 0;
+
+    byte_ring ring = {0};
+    if (policy == LOG_HEAD_TAIL || policy == LOG_RING)
+    {
+        ring.cap = (size_t)(policy == LOG_RING ? max : max - half);
+        // untouched pages cost nothing, so a large ring is only paid for as output arrives
+        ring.buf = malloc(ring.cap);
+        if (!ring.buf)
+            policy = LOG_ROTATE;
+    }
+
+    static char buf[TASKLOG_READ_SIZE];
+    for (;;)
+    {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        size_t off = 0, len = (size_t)n;
+        if (policy == LOG_ROTATE)
+        {
+            while (off < len)
+            {
+                if (size >= half)
+                {
+                    dropped += size_at(tfd, "log.1");
+                    renameat(tfd, "log", tfd, "log.1");
+                    close(log);
+                    log = openat(tfd, "log", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                                 0644);
+                    if (log < 0)
+                        return;
+                    size = 0;
+                    if (dropped)
+                        write_dropped(tfd, dropped, 0);
+                }
+                size_t k = half - size < len - off ? (size_t)(half - size) : len - off;
+                write_all(log, buf + off, k);
+                size += k;
+                off += k;
+            }
+            continue;
+        }
+        if (head_left)
+        {
+            size_t k = head_left < len ? (size_t)head_left : len;
+            write_all(log, buf, k);
+            head_left -= k;
+            off = k;
+        }
+        if (off < len)
+            ring_put(&ring, buf + off, len - off);
+    }
+
+    if (ring.buf)
+    {
+        if (ring.seen > ring.len)
+            write_dropped(tfd, ring.seen - ring.len, size_at(tfd, "log"));
+        ring_flush(&ring, log);
+    }
+    close(log);
+}
+
+int tasklog_start(const char *id, task_log_policy policy, unsigned long long max)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    int data[2], done[2];
+    if (pipe(data) < 0)
+    {
+        close(tfd);
+        return -1;
+    }
+    if (pipe(done) < 0)
+    {
+        close(data[0]);
+        close(data[1]);
+        close(tfd);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // out of the task's group: a cancel or pause aimed at it must not take the output too
+        setpgid(0, 0);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        close(data[1]);
+        close(done[0]);
+        // the lock in particular: holding it would keep the task looking alive
+        const int keep[] = {data[0], done[1], tfd};
+        close_others(keep, sizeof(keep) / sizeof(keep[0]));
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0)
+        {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO)
+                close(devnull);
+        }
+        run_writer(data[0], tfd, policy, max);
+        _exit(0);
+    }
+
+    int saved = errno;
+    close(data[0]);
+    close(done[1]);
+    close(tfd);
+    if (pid < 0)
+    {
+        close(data[1]);
+        close(done[0]);
+        errno = saved;
+        return -1;
+    }
+    fcntl(data[1], F_SETFD, FD_CLOEXEC);
+    fcntl(done[0], F_SETFD, FD_CLOEXEC);
+    g_writer = pid;
+    g_writer_done = done[0];
+    return data[1];
+}
+
+int tasklog_finish(void)
+{
+    if (g_writer < 0)
+        return 0;
+    fflush(stdout);
+    fflush(stderr);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull >= 0)
+    {
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        close(devnull);
+    }
+
+    // commands still holding the pipe (daemonized children) would keep it open; don't wait
+    // past the flush timeout for them
+    struct pollfd p = {g_writer_done, POLLIN, 0};
+    int n;
+    do
+        n = poll(&p, 1, TASKLOG_FLUSH_MS);
+    while (n < 0 && errno == EINTR);
+    waitpid(g_writer, NULL, WNOHANG);
+    close(g_writer_done);
+    g_writer = -1;
+    g_writer_done = -1;
+    return n > 0 ? 0 : -1;
+}
+
+int tasklog_compression_available(void)
+{
+#ifdef LATER_HAVE_ZLIB
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef LATER_HAVE_ZLIB
+/* Copy the last TASKLOG_TAIL_SIZE bytes of in (size bytes long) to log.tail. */
+static int write_tail(int tfd, int in, off_t size)
+{
+    static char buf[TASKLOG_READ_SIZE];
+    int out = openat(tfd, "log.tail.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        return -1;
+    int rc = 0;
+    for (off_t at = size - TASKLOG_TAIL_SIZE; at < size && rc == 0;)
+    {
+        size_t want = size - at < (off_t)sizeof(buf) ? (size_t)(size - at) : sizeof(buf);
+        ssize_t n = pread(in, buf, want, at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || write_all(out, buf, (size_t)n) < 0)
+            rc = -1;
+        at += n;
+    }
+    // --log trusts it over log.gz, so it must be whole
+    if (fsync(out) < 0)
+        rc = -1;
+    close(out);
+    if (rc == 0 && renameat(tfd, "log.tail.tmp", tfd, "log.tail") < 0)
+        rc = -1;
+    if (rc < 0)
+        unlinkat(tfd, "log.tail.tmp", 0);
+    return rc;
+}
+
+/* Gzip tfd/name into name.gz, then remove name; with keep_tail, leave its end in log.tail
+ * too. Return 1 if compressed, 0 if left alone. */
+static int compress_at(int tfd, const char *name, int keep_tail, unsigned long long *before,
+                       unsigned long long *after)
+{
+    int in = openat(tfd, name, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(in, &st) < 0 || st.st_size < TASKLOG_COMPRESS_MIN)
+    {
+        close(in);
+        return 0;
+    }
+
+    char gz[32], tmp[40];
+    snprintf(gz, sizeof(gz), "%s.gz", name);
+    snprintf(tmp, sizeof(tmp), "%s.gz.tmp", name);
+    int out = openat(tfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    // gzclose() closes the fd it was given; keep one for the fsync after it
+    int keep = out >= 0 ? dup(out) : -1;
+    gzFile z = keep >= 0 ? gzdopen(out, "wb6") : NULL;
+    if (!z)
+    {
+        if (out >= 0)
+            close(out);
+        if (keep >= 0)
+            close(keep);
+        close(in);
+        unlinkat(tfd, tmp, 0);
+        return -1;
+    }
+
+    static char buf[TASKLOG_READ_SIZE];
+    int rc = 0;
+    for (;;)
+    {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n > 0 && gzwrite(z, buf, (unsigned)n) != (int)n))
+            rc = -1;
+        if (n <= 0 || rc < 0)
+            break;
+    }
+    if (gzclose(z) != Z_OK)
+        rc = -1;
+    // the plain log goes away on the strength of this copy, so it must be on disk first
+    struct stat zst;
+    if (rc == 0 && (fsync(keep) < 0 || fstat(keep, &zst) < 0))
+        rc = -1;
+    close(keep);
+    // in place before log.gz appears, so a reader that finds one finds both; without it
+    // --log just reads log.gz from the start
+    if (rc == 0 && keep_tail && st.st_size > TASKLOG_TAIL_SIZE)
+        write_tail(tfd, in, st.st_size);
+    close(in);
+    if (rc == 0 && renameat(tfd, tmp, tfd, gz) < 0)
+        rc = -1;
+    if (rc < 0)
+    {
+        unlinkat(tfd, tmp, 0);
+        return -1;
+    }
+    unlinkat(tfd, name, 0);
+    if (before)
+        *before += (unsigned long long)st.st_size;
+    if (after)
+        *after += (unsigned long long)zst.st_size;
+    return 1;
+}
+#endif
+
+int tasklog_compress(const char *id, unsigned long long *before, unsigned long long *after)
+{
+#ifdef LATER_HAVE_ZLIB
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    // only a plain log is tailed from its end (see action_log): not a captured one, whose
+    // records cannot be read from the middle, nor a --log-max one, which is small anyway
+    task_meta meta;
+    int plain = store_read_meta_at(tfd, &meta) == 0 && !meta.capture && !meta.log_max;
+    int n = 0;
+    static const char *const names[] = {"log.1", "log"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        int rc = compress_at(tfd, names[i], plain && i == 1, before, after);
+        if (rc < 0)
+        {
+            close(tfd);
+            return -1;
+        }
+        n += rc;
+    }
+    close(tfd);
+    return n;
+#else
+    (void)id;
+    (void)before;
+    (void)after;
+    return 0;
+#endif
+}
+
+struct tasklog_reader
+{
+    int fd; // a plain log, read and copied directly
+#ifdef LATER_HAVE_ZLIB
+    gzFile z; // a compressed one, or NULL
+#endif
+};
+
+tasklog_reader *tasklog_open(const char *id, const char *name)
+{
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return NULL;
+    char gz[32];
+    snprintf(gz, sizeof(gz), "%s.gz", name);
+    // the compressed copy appears before the plain file goes; look for it on both sides
+    int fd = openat(tfd, gz, O_RDONLY | O_CLOEXEC);
+    int compressed = fd >= 0;
+    if (fd < 0)
+        fd = openat(tfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT)
+    {
+        fd = openat(tfd, gz, O_RDONLY | O_CLOEXEC);
+        compressed = fd >= 0;
+    }
+    close(tfd);
+    if (fd < 0)
+        return NULL;
+
+    tasklog_reader *r = malloc(sizeof(*r));
+    if (!r)
+    {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+#ifdef LATER_HAVE_ZLIB
+    r->z = NULL;
+    if (compressed)
+    {
+        r->z = gzdopen(fd, "rb");
+        if (!r->z)
+        {
+            close(fd);
+            free(r);
+            errno = ENOMEM;
+            return NULL;
+        }
+        gzbuffer(r->z, TASKLOG_READ_SIZE);
+        r->fd = -1;
+    }
+#else
+    if (compressed)
+    {
+        close(fd);
+        free(r);
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+    return r;
+}
+
+ssize_t tasklog_read(tasklog_reader *r, char *buf, size_t n)
+{
+#ifdef LATER_HAVE_ZLIB
+    if (r->z)
+    {
+        int got = gzread(r->z, buf, (unsigned)(n < INT_MAX ? n : INT_MAX));
+        return got < 0 ? -1 : got;
+    }
+#endif
+    ssize_t got;
+    do
+        got = read(r->fd, buf, n);
+    while (got < 0 && errno == EINTR);
+    return got;
+}
+
+int tasklog_tail_start(tasklog_reader *r, size_t lines, off_t *start)
+{
+    struct stat st;
+    if (r->fd < 0 || fstat(r->fd, &st) < 0)
+        return -1;
+    *start = 0;
+    if (lines == 0)
+        return 0;
+
+    // count newlines back from the end, a block at a time; the one ending the file does not
+    // start a line
+    static char buf[TASKLOG_READ_SIZE];
+    size_t seen = 0;
+    off_t end = st.st_size;
+    while (end > 0)
+    {
+        size_t n = end < (off_t)sizeof(buf) ? (size_t)end : sizeof(buf);
+        off_t at = end - (off_t)n;
+        ssize_t got;
+        do
+            got = pread(r->fd, buf, n, at);
+        while (got < 0 && errno == EINTR);
+        if (got < 0)
+            return -1;
+        // a short read means the file shrank under us; take what there is
+        for (size_t i = (size_t)got; i-- > 0;)
+        {
+            if (buf[i] != '\n' || at + (off_t)i == st.st_size - 1)
+                continue;
+            if (++seen == lines)
+            {
+                *start = at + (off_t)i + 1;
+                return 0;
+            }
+        }
+        end = at;
+    }
+    return 0;
+}
+
+/* Copy with read and write, where the kernel cannot do it for us. */
+static int copy_plain(int in, off_t from, off_t to, int out)
+{
+    static char buf[TASKLOG_READ_SIZE];
+    while (from < to)
+    {
+        size_t n = to - from < (off_t)sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        ssize_t got = pread(in, buf, n, from);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return got < 0 ? -1 : 0;
+        if (write_all(out, buf, (size_t)got) < 0)
+            return -1;
+        from += got;
+    }
+    return 0;
+}
+
+int tasklog_copy(tasklog_reader *r, off_t from, int fd)
+{
+    struct stat st;
+    if (r->fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fstat(r->fd, &st) < 0)
+        return -1;
+    off_t to = st.st_size;
+#ifdef __linux__
+    // copy_file_range when fd is a file (the filesystem may share the blocks), sendfile into a
+    // pipe, tty or socket; both refuse some fds (O_APPEND, old kernels), which read and write
+    // then take
+    int use_range = 1;
+    while (from < to)
+    {
+        size_t n = to - from < (off_t)(1 << 30) ? (size_t)(to - from) : (size_t)1 << 30;
+        ssize_t done = use_range ? copy_file_range(r->fd, &from, fd, NULL, n, 0)
+                                 : sendfile(fd, r->fd, &from, n);
+        if (done > 0)
+            continue;
+        if (done == 0)
+            return 0; // the file shrank
+        if (errno == EINTR)
+            continue;
+        if (use_range && (errno == EXDEV || errno == EINVAL || errno == EBADF ||
+                          errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            use_range = 0;
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS)
+            break;
+        return -1;
+    }
+#endif
+    return copy_plain(r->fd, from, to, fd);
+}
+
+void tasklog_close(tasklog_reader *r)
+{
+    if (!r)
+        return;
+#ifdef LATER_HAVE_ZLIB
+    if (r->z)
+        gzclose(r->z);
+#endif
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+int tasklog_read_dropped(const char *id, unsigned long long *bytes, unsigned long long *at)
+{
+    *bytes = 0;
+    *at = 0;
+    int tfd = store_open_task(id);
+    if (tfd < 0)
+        return -1;
+    int fd = openat(tfd, "log.dropped", O_RDONLY | O_CLOEXEC);
+    close(tfd);
+    if (fd < 0)
+        return 0;
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0)
+    {
+        buf[n] = '\0';
+        if (sscanf(buf, "%llu %llu", bytes, at) != 2)
+            *bytes = *at = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef LATER_TASKLOG_H_
+#define LATER_TASKLOG_H_
+
+#include "store.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * --log-max: a task's output is written by a small process of its own that reads the pipe the
+ * commands write to and keeps the log within log_max bytes:
+ *   rotate     log holds up to half of it; when full it becomes log.1 (replacing the one
+ *              before) and a new log starts, so the last half to all of log_max is kept
+ *   head-tail  the first half goes to log as it comes; the last half is kept in memory and
+ *              appended when the task ends
+ *   ring       only the last log_max bytes are kept, in memory, and written when it ends
+ * How much was left out and where is recorded in log.dropped, which --log shows in place.
+ *
+ * The writer leaves the task's process group, so a cancelled task's output is still stored,
+ * and holds nothing but the pipe and the task dir: it never keeps the task looking alive.
+ */
+
+// smallest --log-max
+#define TASKLOG_MIN_MAX 1024
+
+/* Start the writer for task id and return the write end of its pipe, for the caller to put on
+ * stdout and stderr; -1 with errno set if it cannot be started. */
+int tasklog_start(const char *id, task_log_policy policy, unsigned long long max);
+/* Point stdout and stderr at /dev/null and give the writer a moment to store what it kept.
+ * Return 0 once it is done (or was never started), -1 if it is still running. */
+int tasklog_finish(void);
+
+/*
+ * Once a task is over its log files are gzipped in place (log -> log.gz, log.1 -> log.1.gz),
+ * if later was built with zlib. Readers go through tasklog_open(), which takes either form.
+ * The last 256KB of an ordinary log (not --capture or --log-max) also stay plain in log.tail,
+ * so --log can show its end without inflating all of it.
+ */
+
+/* Return 1 if this build can compress logs. */
+int tasklog_compression_available(void);
+/* Compress the log files of a finished task; ones under a few KB are left alone. Add their
+ * sizes before and after to *before and *after when given. Return the number of files
+ * compressed, or -1 on error. */
+int tasklog_compress(const char *id, unsigned long long *before, unsigned long long *after);
+
+typedef struct tasklog_reader tasklog_reader;
+/* Open name ("log" or "log.1") of task id, compressed or not. Return NULL with errno set if
+ * it does not exist, or ENOTSUP if it is compressed and this build cannot read it. */
+tasklog_reader *tasklog_open(const char *id, const char *name);
+/* Like read(2): bytes of the uncompressed content, 0 at the end, -1 on error. */
+ssize_t tasklog_read(tasklog_reader *r, char *buf, size_t n);
+/* For a plain (uncompressed) log: the offset its last `lines` lines start at (0 for all of
+ * it), found by reading back from the end. Return -1 if r is compressed; read that one from the
+ * start with tasklog_read(). */
+int tasklog_tail_start(tasklog_reader *r, size_t lines, off_t *start);
+/* Write a plain log from offset from to its current end to fd, letting the kernel move the
+ * bytes where it can (copy_file_range, sendfile). Return -1 with errno set on error or if r is
+ * compressed. */
+int tasklog_copy(tasklog_reader *r, off_t from, int fd);
+void tasklog_close(tasklog_reader *r);
+
+/* Read log.dropped: total bytes left out and the offset into log.1 + log where that happened.
+ * Return 0 with both set to 0 if nothing was dropped, -1 if the task dir cannot be opened. */
+int tasklog_read_dropped(const char *id, unsigned long long *bytes, unsigned long long *at);
+
+#endif // LATER_TASKLOG_H_
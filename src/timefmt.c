@@ -7,23 +7,19 @@
 #include <string.h>
 #include <time.h>
 
-static int parse_relative(const char *input, time_t *out, char *errbuf, size_t errsz)
+/* <num>(d|h|m|s|ms)... in any combination, each unit at most once, as milliseconds;
+ * input is for messages. */
+static int parse_units(const char *input, const char *p, long long *out, char *errbuf,
+                       size_t errsz)
 {
-    /* +<num>(d|h|m|s)... in any combination, each unit at most once */
-    if (input[0] != '+')
-    {
-        snprintf(errbuf, errsz, "Relative time must start with '+'");
-        return -1;
-    }
-    const char *p = input + 1;
     if (!*p)
     {
         snprintf(errbuf, errsz, "Empty relative time");
         return -1;
     }
 
-    long secs = 0;
-    int seen_d = 0, seen_h = 0, seen_m = 0, seen_s = 0;
+    long long ms = 0;
+    int seen_d = 0, seen_h = 0, seen_m = 0, seen_s = 0, seen_ms = 0;
     while (*p)
     {
         if (!isdigit((unsigned char)*p))
@@ -45,25 +41,34 @@ static int parse_relative(const char *input, time_t *out, char *errbuf, size_t e
                 if (seen_d)
                     goto dup;
                 seen_d = 1;
-                secs += v * 86400;
+                ms += v * 86400000LL;
                 break;
             case 'h':
                 if (seen_h)
                     goto dup;
                 seen_h = 1;
-                secs += v * 3600;
+                ms += v * 3600000LL;
                 break;
             case 'm':
+                if (end[1] == 's')
+                {
+                    if (seen_ms)
+                        goto dup;
+                    seen_ms = 1;
+                    ms += v;
+                    ++end;
+                    break;
+                }
                 if (seen_m)
                     goto dup;
                 seen_m = 1;
-                secs += v * 60;
+                ms += v * 60000LL;
                 break;
             case 's':
                 if (seen_s)
                     goto dup;
                 seen_s = 1;
-                secs += v;
+                ms += v * 1000LL;
                 break;
             default:
                 snprintf(errbuf, errsz, "Invalid unit '%c' in: %s", unit, input);
@@ -72,7 +77,7 @@ static int parse_relative(const char *input, time_t *out, char *errbuf, size_t e
         p = end + 1;
     }
 
-    *out = time(NULL) + secs;
+    *out = ms;
     return 0;
 
 dup:
@@ -80,6 +85,26 @@ dup:
     return -1;
 }
 
+static int parse_relative(const char *input, time_t *out, int *ms_out, char *errbuf,
+                          size_t errsz)
+{
+    if (input[0] != '+')
+    {
+        snprintf(errbuf, errsz, "Relative time must start with '+'");
+        return -1;
+    }
+    long long ms;
+    if (parse_units(input, input + 1, &ms, errbuf, errsz) < 0)
+        return -1;
+    // count from the current millisecond, not the start of the current second
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long at = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000 + ms;
+    *out = (time_t)(at / 1000);
+    *ms_out = (int)(at % 1000);
+    return 0;
+}
+
 static int parse_iso(const char *input, time_t *out, char *errbuf, size_t errsz)
 {
     int y, mo, d, h, mi, s;
@@ -157,20 +182,92 @@ static int parse_clock(const char *input, time_t *out, char *errbuf, size_t errs
     return 0;
 }
 
-int timefmt_parse_time(const char *input, time_t *out, char *errbuf, size_t errsz)
+int timefmt_parse_time(const char *input, time_t *out, int *ms, char *errbuf, size_t errsz)
 {
+    int unused;
+    if (!ms)
+        ms = &unused;
+    *ms = 0;
     if (!input || !*input)
     {
         snprintf(errbuf, errsz, "Empty time string");
         return -1;
     }
     if (input[0] == '+')
-        return parse_relative(input, out, errbuf, errsz);
+        return parse_relative(input, out, ms, errbuf, errsz);
     if (strchr(input, 'T'))
         return parse_iso(input, out, errbuf, errsz);
     return parse_clock(input, out, errbuf, errsz);
 }
 
+int timefmt_parse_bound(const char *input, time_t *out, char *errbuf, size_t errsz)
+{
+    if (!input || !*input)
+    {
+        snprintf(errbuf, errsz, "Empty time string");
+        return -1;
+    }
+    if (input[0] == '+' || input[0] == '-')
+    {
+        long long ms;
+        if (parse_units(input, input + 1, &ms, errbuf, errsz) < 0)
+            return -1;
+        time_t secs = (time_t)(ms / 1000);
+        *out = time(NULL) + (input[0] == '-' ? -secs : secs);
+        return 0;
+    }
+
+    struct tm tm = {0};
+    int consumed = 0;
+    if (sscanf(input, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &consumed) == 3)
+    {
+        if (input[consumed] == 'T' &&
+            sscanf(input + consumed, "T%2d:%2d:%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 3)
+        {
+            snprintf(errbuf, errsz, "Invalid ISO time: %s", input);
+            return -1;
+        }
+        if (input[consumed] != 'T' && input[consumed] != '\0')
+        {
+            snprintf(errbuf, errsz, "Invalid date: %s", input);
+            return -1;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        time_t t = mktime(&tm);
+        if (t == (time_t)-1)
+        {
+            snprintf(errbuf, errsz, "Invalid date/time: %s", input);
+            return -1;
+        }
+        *out = t;
+        return 0;
+    }
+
+    int h, m, sec = 0;
+    if ((sscanf(input, "%d:%d:%d%n", &h, &m, &sec, &consumed) == 3 && !input[consumed]) ||
+        (sec = 0, sscanf(input, "%d:%d%n", &h, &m, &consumed) == 2 && !input[consumed]))
+    {
+        if (h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 59)
+        {
+            snprintf(errbuf, errsz, "Invalid time values: %s", input);
+            return -1;
+        }
+        time_t now = time(NULL);
+        localtime_r(&now, &tm);
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = sec;
+        tm.tm_isdst = -1;
+        *out = mktime(&tm);
+        return 0;
+    }
+
+    snprintf(errbuf, errsz, "Invalid time: %s", input);
+    return -1;
+}
+
 void timefmt_format_time(time_t t, char *buf, size_t n)
 {
     struct tm tm;
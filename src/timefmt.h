@@ -7,12 +7,23 @@
 /*
  * Accepted inputs:
  *   +1d2h30m, +30s, +0m        relative to now
+ *   +500ms, +1s250ms           relative, to the millisecond
  *   HH:MM or HH:MM:SS          today (or tomorrow if already past)
  *   YYYY-MM-DDTHH:MM:SS        absolute local time (must be in the future)
  *
- * On error, write a message into errbuf and return -1.
+ * *out gets the second and *ms (may be NULL) the millisecond within it; only relative inputs
+ * have a sub-second part. On error, write a message into errbuf and return -1.
  */
-int timefmt_parse_time(const char *input, time_t *out, char *errbuf, size_t errsz);
+int timefmt_parse_time(const char *input, time_t *out, int *ms, char *errbuf, size_t errsz);
+
+/*
+ * Time bound for filtering, past or future:
+ *   -1d, -2h30m, +15m          relative to now
+ *   YYYY-MM-DD                 local midnight
+ *   YYYY-MM-DDTHH:MM:SS        absolute local time
+ *   HH:MM or HH:MM:SS          today
+ */
+int timefmt_parse_bound(const char *input, time_t *out, char *errbuf, size_t errsz);
 
 /* "YYYY-MM-DD HH:MM:SS" in local time. */
 void timefmt_format_time(time_t t, char *buf, size_t n);
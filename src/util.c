@@ -1,5 +1,6 @@
 #include "util.h"
 
+#include "catalog.h"
 #include "store.h"
 #include "strvec.h"
 
@@ -15,6 +16,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 #include <time.h>
 #include <unistd.h>
 
@@ -245,33 +249,74 @@ int read_commands(strvec **cmds)
 
 void generate_id(char *buf, size_t n)
 {
-    unsigned r = 0;
-    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
-    if (fd >= 0)
-    {
-        if (read(fd, &r, sizeof(r)) != (ssize_t)sizeof(r))
-        {
-            r = (unsigned)time(NULL) ^ (unsigned)getpid();
-        }
-        close(fd);
-    }
-    else
+    // random start, then sequential: ids from one process stay unique within a second even
+    // when --submit creates thousands of them
+    static unsigned seq;
+    static int seeded;
+    if (!seeded)
     {
-        r = (unsigned)time(NULL) ^ (unsigned)getpid();
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || read(fd, &seq, sizeof(seq)) != (ssize_t)sizeof(seq))
+            seq = (unsigned)time(NULL) ^ (unsigned)getpid();
+        if (fd >= 0)
+            close(fd);
+        seeded = 1;
     }
+    unsigned r = seq++;
     snprintf(buf, n, "%lld_%d_%04x", (long long)time(NULL), (int)getpid(), r & 0xFFFFu);
 }
 
+typedef struct
+{
+    const char *prefix;
+    size_t len;
+    int matches;
+    char hit[64];
+} prefix_match;
+
+static int match_prefix(const char *id, void *ctx)
+{
+    prefix_match *pm = ctx;
+    if (strncmp(id, pm->prefix, pm->len) != 0)
+        return 0;
+    if (++pm->matches == 1)
+        snprintf(pm->hit, sizeof(pm->hit), "%s", id);
+    // a second hit already makes it ambiguous; stop the scan
+    return pm->matches > 1 ? -1 : 0;
+}
+
+/* Unique-prefix lookup over directory names only; no task dir is opened. */
+static int resolve_prefix(const char *input, char *out, size_t n)
+{
+    prefix_match pm = {input, strlen(input), 0, ""};
+
+    // once the epoch part is complete the id can only live in that second's shard
+    time_t t = task_id_time(input);
+    if (store_scan_range(t, t, match_prefix, &pm) < 0 && pm.matches < 2)
+        return -1;
+    if (pm.matches == 0)
+        return -1;
+    if (pm.matches > 1)
+        return -2;
+    snprintf(out, n, "%s", pm.hit);
+    return 0;
+}
+
 int resolve_id(const char *input, char *out, size_t n)
 {
-    strvec *list = NULL;
-    if (store_list(&list) < 0)
+    // a full id needs a single lookup
+    if (is_task_id(input))
     {
-        strvec_free(&list);
-        return -1;
+        int fd = store_open_task(input);
+        if (fd >= 0)
+        {
+            close(fd);
+            snprintf(out, n, "%s", input);
+            return 0;
+        }
     }
 
-    // try as 1-based index
+    // try as 1-based index; only this needs the list order
     int all_digits = input[0] != '\0';
     for (const char *p = input; *p; ++p)
     {
@@ -283,51 +328,24 @@ int resolve_id(const char *input, char *out, size_t n)
     }
     if (all_digits)
     {
-        char *end;
-        long idx = strtol(input, &end, 10);
-        if (*end == '\0' && idx >= 1 && (size_t)idx <= list->len)
+        catalog *cat = NULL;
+        if (catalog_load(&cat) < 0)
         {
-            snprintf(out, n, "%s", list->items[idx - 1]);
-            strvec_free(&list);
-            return 0;
+            catalog_free(&cat);
+            return -1;
         }
-    }
-
-    // extract match first
-    for (size_t i = 0; i < list->len; ++i)
-    {
-        if (strcmp(list->items[i], input) == 0)
+        char *end;
+        long idx = strtol(input, &end, 10);
+        if (*end == '\0' && idx >= 1 && (size_t)idx <= cat->len)
         {
-            snprintf(out, n, "%s", list->items[i]);
-            strvec_free(&list);
+            snprintf(out, n, "%s", cat->items[idx - 1].id);
+            catalog_free(&cat);
             return 0;
         }
+        catalog_free(&cat);
     }
 
-    // unique prefix
-    size_t in_len = strlen(input);
-    int matches = 0;
-    const char *hit = NULL;
-    for (size_t i = 0; i < list->len; ++i)
-    {
-        if (strncmp(list->items[i], input, in_len) == 0)
-        {
-            ++matches;
-            hit = list->items[i];
-        }
-    }
-    int rc;
-    if (matches == 1)
-    {
-        snprintf(out, n, "%s", hit);
-        rc = 0;
-    }
-    else
-    {
-        rc = (matches == 0) ? -1 : -2;
-    }
-    strvec_free(&list);
-    return rc;
+    return resolve_prefix(input, out, n);
 }
 
 int is_task_id(const char *name)
@@ -352,30 +370,165 @@ int is_task_id(const char *name)
     return *p == '\0';
 }
 
-int rm_rf(const char *path)
+time_t task_id_time(const char *id)
 {
-    struct stat st;
-    if (lstat(path, &st) < 0)
-        return (errno == ENOENT) ? 0 : -1;
-    if (!S_ISDIR(st.st_mode))
-        return unlink(path);
+    long long t = 0;
+    const char *p = id;
+    while (isdigit((unsigned char)*p) && t < 1000000000000LL)
+        t = t * 10 + (*p++ - '0');
+    return (*p == '_') ? (time_t)t : 0;
+}
+
+int parse_size(const char *s, unsigned long long *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s || errno || n == 0 || *s == '-')
+        return -1;
+    unsigned long long mult;
+    if (*end == '\0')
+        mult = 1;
+    else if (strcmp(end, "K") == 0 || strcmp(end, "k") == 0)
+        mult = 1024;
+    else if (strcmp(end, "M") == 0)
+        mult = 1024 * 1024;
+    else if (strcmp(end, "G") == 0)
+        mult = 1024 * 1024 * 1024;
+    else
+        return -1;
+    if (n > (1ULL << 50) / mult)
+        return -1;
+    *out = n * mult;
+    return 0;
+}
+
+uint64_t hash_fnv1a(const void *data, size_t n, uint64_t h)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+long long wall_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    DIR *d = opendir(path);
+long long wall_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long mono_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int wall_timer_open(void)
+{
+#ifdef __linux__
+    return timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+#else
+    return -1;
+#endif
+}
+
+int wall_timer_arm(int fd, long long at_ms)
+{
+#ifdef __linux__
+    uint64_t ticks;
+    while (read(fd, &ticks, sizeof(ticks)) > 0)
+        ;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(at_ms / 1000);
+    its.it_value.tv_nsec = (long)(at_ms % 1000) * 1000000L;
+    // a zero it_value would disarm; an already-passed deadline must still fire
+    if (at_ms > 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+#else
+    (void)fd;
+    (void)at_ms;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void sleep_until_wall(long long at_ms)
+{
+#ifdef __linux__
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if (fd >= 0)
+    {
+        while (wall_now_ms() < at_ms)
+        {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = (time_t)(at_ms / 1000);
+            its.it_value.tv_nsec = (long)(at_ms % 1000) * 1000000L;
+            if (timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+                break;
+            // ECANCELED: the clock was set; loop to re-arm against the new time
+            uint64_t ticks;
+            if (read(fd, &ticks, sizeof(ticks)) < 0 && errno != ECANCELED && errno != EINTR)
+                break;
+        }
+        close(fd);
+        if (wall_now_ms() >= at_ms)
+            return;
+    }
+#endif
+    // relative sleeps can't see clock changes; keep each short enough to notice them
+    long long now;
+    while ((now = wall_now_ms()) < at_ms)
+    {
+        long long left = at_ms - now;
+        if (left > 1000)
+            left = 1000;
+        struct timespec ts = {(time_t)(left / 1000), (long)(left % 1000) * 1000000L};
+        nanosleep(&ts, NULL);
+    }
+}
+
+int rm_rf_at(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        if (errno == ENOTDIR || errno == ELOOP)
+            return unlinkat(dir_fd, name, 0);
+        return -1;
+    }
+    DIR *d = fdopendir(fd);
     if (!d)
+    {
+        close(fd);
         return -1;
+    }
     struct dirent *e;
     int rc = 0;
     while ((e = readdir(d)))
     {
         if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
             continue;
-        char sub[PATH_MAX];
-        if ((size_t)snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name) >= sizeof(sub))
-        {
-            rc = -1;
-            break;
-        }
-        if (rm_rf(sub) < 0)
+        int sub_rc = (e->d_type == DT_DIR || e->d_type == DT_UNKNOWN)
+                         ? rm_rf_at(dirfd(d), e->d_name)
+                         : unlinkat(dirfd(d), e->d_name, 0);
+        if (sub_rc < 0 && errno != ENOENT)
         {
             rc = -1;
             break;
@@ -383,6 +536,60 @@ int rm_rf(const char *path)
     }
     closedir(d);
     if (rc == 0)
-        rc = rmdir(path);
+        rc = unlinkat(dir_fd, name, AT_REMOVEDIR);
     return rc;
 }
+
+int rm_rf(const char *path)
+{
+    return rm_rf_at(AT_FDCWD, path);
+}
+
+int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = write(fd, p + off, len - off);
+        if (n > 0)
+        {
+            off += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        return -1;
+    }
+    return 0;
+}
+
+void close_others(const int *keep, size_t nkeep)
+{
+    // closing while /dev/fd is being read is not safe everywhere: close it a batch at a time
+    // and look again until nothing is left
+    for (;;)
+    {
+        DIR *d = opendir("/dev/fd");
+        if (!d)
+            return;
+        int dfd = dirfd(d);
+        int fds[256];
+        size_t n = 0;
+        struct dirent *e;
+        while (n < sizeof(fds) / sizeof(fds[0]) && (e = readdir(d)))
+        {
+            int fd = atoi(e->d_name);
+            int kept = fd <= STDERR_FILENO || fd == dfd;
+            for (size_t i = 0; i < nkeep && !kept; ++i)
+                kept = fd == keep[i];
+            if (!kept)
+                fds[n++] = fd;
+        }
+        closedir(d);
+        for (size_t i = 0; i < n; ++i)
+            close(fds[i]);
+        if (n < sizeof(fds) / sizeof(fds[0]))
+            return;
+    }
+}
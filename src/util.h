@@ -4,7 +4,9 @@
 #include "strvec.h"
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 /* mkdir(path, mode), tolerating EEXIST if the existing path is a directory.
  * Return 0 on success or pre-existing directory; -1 with errno set otherwise
@@ -25,7 +27,38 @@ int resolve_id(const char *input, char *out, size_t n);
 /* Return 1 if name has the shape generate_id produces <digits>_<digits>_<hex>. */
 int is_task_id(const char *name);
 
+/* The epoch second an id starts with (when generate_id ran), or 0 if it has none. */
+time_t task_id_time(const char *id);
+
+/* "64K", "10M", "2G" or a plain number of bytes. Return -1 unless s is a positive size. */
+int parse_size(const char *s, unsigned long long *out);
+
+/* 64-bit FNV-1a over n bytes, continuing from h (start with HASH_FNV1A_INIT). */
+#define HASH_FNV1A_INIT 1469598103934665603ULL
+uint64_t hash_fnv1a(const void *data, size_t n, uint64_t h);
+
+/* Wall-clock deadlines (CLOCK_REALTIME, epoch milliseconds). */
+long long wall_now_ms(void);
+long long wall_now_us(void);
+/* CLOCK_MONOTONIC in microseconds; comparable across processes, for measuring latencies. */
+long long mono_now_us(void);
+/* Block until the wall clock reaches at_ms. On Linux this is an absolute timerfd that is
+ * re-armed as soon as the clock is set; elsewhere the deadline is re-checked every second. */
+void sleep_until_wall(long long at_ms);
+/* For poll loops: a CLOCK_REALTIME timerfd that also becomes readable when the clock is set.
+ * Return -1 where timerfd is not available; callers then rely on their poll timeout. */
+int wall_timer_open(void);
+/* Arm fd for at_ms (0 disarms) and drain a pending expiry or clock-change notice. */
+int wall_timer_arm(int fd, long long at_ms);
+
 /* Recursive directory removal. */
 int rm_rf(const char *path);
+/* Same, with name relative to dir_fd (or AT_FDCWD). */
+int rm_rf_at(int dir_fd, const char *name);
+
+/* write() all of data, retrying on EINTR and short writes. Return 0, or -1 with errno set. */
+int write_all(int fd, const void *data, size_t len);
+/* Close every descriptor above stderr other than the nkeep in keep; for a child just forked. */
+void close_others(const int *keep, size_t nkeep);
 
 #endif // LATER_UTIL_H_